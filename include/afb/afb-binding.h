@@ -88,7 +88,12 @@ enum afb_session_v1
        AFB_SESSION_LOA_EQ_0 = AFB_SESSION_LOA_EQ | AFB_SESSION_LOA_0, /* check LOA == 0 */
        AFB_SESSION_LOA_EQ_1 = AFB_SESSION_LOA_EQ | AFB_SESSION_LOA_1, /* check LOA == 1 */
        AFB_SESSION_LOA_EQ_2 = AFB_SESSION_LOA_EQ | AFB_SESSION_LOA_2, /* check LOA == 2 */
-       AFB_SESSION_LOA_EQ_3 = AFB_SESSION_LOA_EQ | AFB_SESSION_LOA_3  /* check LOA == 3 */
+       AFB_SESSION_LOA_EQ_3 = AFB_SESSION_LOA_EQ | AFB_SESSION_LOA_3, /* check LOA == 3 */
+
+       AFB_SESSION_SERIAL_BINDING = 0,     /* calls are serialized with the calls SERIAL_BINDING of the binding (default) */
+       AFB_SESSION_SERIAL_SESSION = 512,   /* calls are serialized with the calls SERIAL_SESSION of the binding for the same session */
+       AFB_SESSION_PARALLEL = 1024,        /* calls can be processed in parallel with any other call */
+       AFB_SESSION_CONCURRENCY_MASK = 1536 /* mask for concurrency policy */
 };
 
 /*
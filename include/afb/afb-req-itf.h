@@ -266,6 +266,8 @@ static inline void afb_req_context_clear(struct afb_req req)
  * Adds one to the count of references of 'req'.
  * This function MUST be called by asynchronous implementations
  * of verbs if no reply was sent before returning.
+ * The count of references is atomic: afb_req_addref and
+ * afb_req_unref can be called from any thread.
  */
 static inline void afb_req_addref(struct afb_req req)
 {
@@ -33,10 +33,12 @@
 #include "session.h"
 #include "afb-msg-json.h"
 #include "afb-apis.h"
+#include "afb-rate.h"
 #include "afb-api-so.h"
 #include "afb-context.h"
 #include "afb-evt.h"
 #include "afb-subcall.h"
+#include "afb-completion.h"
 #include "verbose.h"
 
 static const char DEFAULT_PATH_PREFIX[] = "/org/agl/afb/api/";
@@ -218,7 +220,11 @@ struct dbus_memo {
 	struct api_dbus *api;		/* the dbus api */
 	struct afb_req req;		/* the request handle */
 	struct afb_context *context;	/* the context of the query */
+	const char *verb;		/* the verb of the query */
+	size_t lenverb;			/* the length of the verb */
+	const char *raw;		/* the arguments of the query */
 	uint64_t msgid;			/* the message identifier */
+	struct afb_completion completion; /* for calling by the main loop */
 };
 
 struct dbus_event
@@ -230,7 +236,7 @@ struct dbus_event
 };
 
 /* allocates and init the memorizing data */
-static struct dbus_memo *api_dbus_client_memo_make(struct api_dbus *api, struct afb_req req, struct afb_context *context)
+static struct dbus_memo *api_dbus_client_memo_make(struct api_dbus *api, struct afb_req req, struct afb_context *context, const char *verb, size_t lenverb, const char *raw)
 {
 	struct dbus_memo *memo;
 
@@ -239,14 +245,23 @@ static struct dbus_memo *api_dbus_client_memo_make(struct api_dbus *api, struct
 		afb_req_addref(req);
 		memo->req = req;
 		memo->context = context;
+		memo->verb = verb;
+		memo->lenverb = lenverb;
+		memo->raw = raw;
 		memo->msgid = 0;
 		memo->api = api;
-		memo->next = api->client.memos;
-		api->client.memos = memo;
+		memo->next = NULL;
 	}
 	return memo;
 }
 
+/* records the memo, only by the main loop */
+static void api_dbus_client_memo_record(struct dbus_memo *memo)
+{
+	memo->next = memo->api->client.memos;
+	memo->api->client.memos = memo;
+}
+
 /* free and release the memorizing data */
 static void api_dbus_client_memo_destroy(struct dbus_memo *memo)
 {
@@ -316,21 +331,17 @@ static int api_dbus_client_on_reply(sd_bus_message *message, void *userdata, sd_
 	return 1;
 }
 
-/* on call, propagate it to the dbus service */
-static void api_dbus_client_call(struct api_dbus *api, struct afb_req req, struct afb_context *context, const char *verb, size_t lenverb)
+/* sends the call of 'memo' to the dbus service, only by the main loop */
+static void api_dbus_client_call_send(void *closure)
 {
-	size_t size;
 	int rc;
-	char *method = strndupa(verb, lenverb);
-	struct dbus_memo *memo;
+	struct dbus_memo *memo = closure;
+	struct api_dbus *api = memo->api;
+	char *method = strndupa(memo->verb, memo->lenverb);
 	struct sd_bus_message *msg;
 
-	/* create the recording data */
-	memo = api_dbus_client_memo_make(api, req, context);
-	if (memo == NULL) {
-		afb_req_fail(req, "error", "out of memory");
-		return;
-	}
+	/* record the call */
+	api_dbus_client_memo_record(memo);
 
 	/* creates the message */
 	msg = NULL;
@@ -339,9 +350,9 @@ static void api_dbus_client_call(struct api_dbus *api, struct afb_req req, struc
 		goto error;
 
 	rc = sd_bus_message_append(msg, "ssu",
-			afb_req_raw(req, &size),
-			ctxClientGetUuid(context->session),
-			(uint32_t)context->flags);
+			memo->raw,
+			ctxClientGetUuid(memo->context->session),
+			(uint32_t)memo->context->flags);
 	if (rc < 0)
 		goto error;
 
@@ -357,12 +368,32 @@ static void api_dbus_client_call(struct api_dbus *api, struct afb_req req, struc
 error:
 	/* if there was an error report it directly */
 	errno = -rc;
-	afb_req_fail(req, "error", "dbus error");
+	afb_req_fail(memo->req, "error", "dbus error");
 	api_dbus_client_memo_destroy(memo);
 end:
 	sd_bus_message_unref(msg);
 }
 
+/*
+ * On call, propagate it to the dbus service. The call can come from
+ * any thread but the memos and the bus belong to the main loop.
+ */
+static void api_dbus_client_call(struct api_dbus *api, struct afb_req req, struct afb_context *context, const char *verb, size_t lenverb)
+{
+	size_t size;
+	struct dbus_memo *memo;
+
+	/* create the recording data */
+	memo = api_dbus_client_memo_make(api, req, context, verb, lenverb, afb_req_raw(req, &size));
+	if (memo == NULL) {
+		afb_req_fail(req, "error", "out of memory");
+		return;
+	}
+
+	/* send it by the main loop */
+	afb_completion_post(afb_completion_get_main_queue(), &memo->completion, api_dbus_client_call_send, memo);
+}
+
 static int api_dbus_service_start(struct api_dbus *api, int share_session, int onneed)
 {
 	/* not an error when onneed */
@@ -635,8 +666,8 @@ error:
 
 static void afb_api_dbus_server_event_add(void *closure, const char *event, int eventid);
 static void afb_api_dbus_server_event_remove(void *closure, const char *event, int eventid);
-static void afb_api_dbus_server_event_push(void *closure, const char *event, int eventid, struct json_object *object);
-static void afb_api_dbus_server_event_broadcast(void *closure, const char *event, int eventid, struct json_object *object);
+static void afb_api_dbus_server_event_push(void *closure, struct afb_evt_data *data);
+static void afb_api_dbus_server_event_broadcast(void *closure, struct afb_evt_data *data);
 
 /* the interface for events broadcasting */
 static const struct afb_evt_itf evt_broadcast_itf = {
@@ -773,19 +804,19 @@ struct dbus_req {
 	const char *request;		/* the readen request as string */
 	struct json_object *json;	/* the readen request as object */
 	struct listener *listener;	/* the listener for events */
-	int refcount;			/* reference count of the request */
+	int refcount;			/* atomic reference count of the request */
 };
 
 /* increment the reference count of the request */
 static void dbus_req_addref(struct dbus_req *dreq)
 {
-	dreq->refcount++;
+	__atomic_add_fetch(&dreq->refcount, 1, __ATOMIC_RELAXED);
 }
 
 /* decrement the reference count of the request and free/release it on falling to null */
 static void dbus_req_unref(struct dbus_req *dreq)
 {
-	if (dreq == NULL || --dreq->refcount)
+	if (dreq == NULL || __atomic_sub_fetch(&dreq->refcount, 1, __ATOMIC_ACQ_REL))
 		return;
 
 	afb_context_disconnect(&dreq->context);
@@ -933,24 +964,29 @@ static void afb_api_dbus_server_event_remove(void *closure, const char *event, i
 	afb_api_dbus_server_event_send(closure, '-', event, eventid, "", 0);
 }
 
-static void afb_api_dbus_server_event_push(void *closure, const char *event, int eventid, struct json_object *object)
+static void afb_api_dbus_server_event_push(void *closure, struct afb_evt_data *data)
 {
-	const char *data = json_object_to_json_string_ext(object, JSON_C_TO_STRING_PLAIN);
-	afb_api_dbus_server_event_send(closure, '!', event, eventid, data, 0);
-	json_object_put(object);
+	size_t length;
+	const char *text = afb_evt_data_encode(data, &afb_evt_encoding_json, &length);
+	if (text == NULL)
+		ERROR("can't encode event %s", afb_evt_data_event(data));
+	else
+		afb_api_dbus_server_event_send(closure, '!', afb_evt_data_event(data), afb_evt_data_id(data), text, 0);
 }
 
-static void afb_api_dbus_server_event_broadcast(void *closure, const char *event, int eventid, struct json_object *object)
+static void afb_api_dbus_server_event_broadcast(void *closure, struct afb_evt_data *data)
 {
 	int rc;
+	size_t length;
+	const char *text;
 	struct api_dbus *api;
 
 	api = closure;
-	rc = sd_bus_emit_signal(api->sdbus, api->path, api->name, "broadcast",
-			"ss", event, json_object_to_json_string_ext(object, JSON_C_TO_STRING_PLAIN));
+	text = afb_evt_data_encode(data, &afb_evt_encoding_json, &length);
+	rc = text == NULL ? -1 : sd_bus_emit_signal(api->sdbus, api->path, api->name, "broadcast",
+			"ss", afb_evt_data_event(data), text);
 	if (rc < 0)
-		ERROR("error while broadcasting event %s", event);
-	json_object_put(object);
+		ERROR("error while broadcasting event %s", afb_evt_data_event(data));
 }
 
 /* called when the object for the service is called */
@@ -1003,7 +1039,8 @@ static int api_dbus_server_on_object_called(sd_bus_message *message, void *userd
 	dreq->refcount = 1;
 	areq.itf = &afb_api_dbus_req_itf;
 	areq.closure = dreq;
-	afb_apis_call_(areq, &dreq->context, api->api, method);
+	if (afb_rate_check(areq, &dreq->context, api->api, strlen(api->api), method, strlen(method)))
+		afb_apis_call_(areq, &dreq->context, api->api, method);
 	dbus_req_unref(dreq);
 	return 1;
 
@@ -1040,10 +1077,23 @@ int afb_api_dbus_add_server(const char *path)
 		ERROR("can't add dbus object %s for %s", api->path, api->name);
 		goto error3;
 	}
-	INFO("afb service over dbus installed, name %s, path %s", api->name, api->path);
 
+	/* receive the broadcasts */
 	api->server.listener = afb_evt_listener_create(&evt_broadcast_itf, api);
+	if (api->server.listener == NULL) {
+		ERROR("can't create the listener of events for %s", api->name);
+		goto error4;
+	}
+	if (afb_evt_add_broadcast(api->server.listener, "*") < 0) {
+		ERROR("can't receive the broadcasts for %s", api->name);
+		goto error5;
+	}
+	INFO("afb service over dbus installed, name %s, path %s", api->name, api->path);
 	return 0;
+error5:
+	afb_evt_listener_unref(api->server.listener);
+error4:
+	sd_bus_slot_unref(api->server.slot_call);
 error3:
 	sd_bus_release_name(api->sdbus, api->name);
 error2:
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
 #include <dirent.h>
 #include <dlfcn.h>
 #include <unistd.h>
@@ -51,6 +52,7 @@ struct api_so_desc {
 	size_t apilength;		/* length of the API name */
 	void *handle;			/* context of dlopen */
 	struct afb_svc *service;	/* handler for service started */
+	struct afb_thread_group *group;	/* serialization of the calls */
 	struct afb_binding_interface interface;	/* interface for the binding */
 };
 
@@ -60,6 +62,12 @@ static const char binding_service_event_function_v1[] = "afbBindingV1ServiceEven
 
 static int api_timeout = 15;
 
+/* key of the cookie recording the client of a session */
+static const char client_cookie_key[] = "thread-client";
+
+/* weights of the clients for sharing the threads by level of assurance */
+static int client_weights[8] = { 1, 1, 1, 1, 1, 1, 1, 1 };
+
 static struct afb_event afb_api_so_event_make_cb(void *closure, const char *name);
 static int afb_api_so_event_broadcast_cb(void *closure, const char *name, struct json_object *object);
 static void afb_api_so_vverbose_cb(void *closure, int level, const char *file, int line, const char *fmt, va_list args);
@@ -68,7 +76,7 @@ static int afb_api_so_rootdir_open_locale(void *closure, const char *filename, i
 
 static const struct afb_daemon_itf daemon_itf = {
 	.event_broadcast = afb_api_so_event_broadcast_cb,
-	.get_event_loop = afb_common_get_event_loop,
+	.get_event_loop = afb_common_get_main_event_loop,
 	.get_user_bus = afb_common_get_user_bus,
 	.get_system_bus = afb_common_get_system_bus,
 	.vverbose = afb_api_so_vverbose_cb,
@@ -182,6 +190,65 @@ static int call_check(struct afb_req req, struct afb_context *context, const str
 	return 1;
 }
 
+/* get the group serializing the calls to the 'verb' for the 'context' */
+static struct afb_thread_group *call_group(struct api_so_desc *desc, struct afb_context *context, const struct afb_verb_desc_v1 *verb)
+{
+	struct afb_thread_group *group, *result;
+	int policy = (int)verb->session & AFB_SESSION_CONCURRENCY_MASK;
+
+	if (policy == AFB_SESSION_PARALLEL)
+		return NULL;
+
+	if (policy == AFB_SESSION_SERIAL_SESSION && context->session != NULL) {
+		/* the group of the session is recorded as a cookie of the session */
+		result = ctxClientCookieGet(context->session, desc);
+		if (result == NULL) {
+			/* the first of concurrent callers records its group */
+			group = afb_thread_group_create();
+			if (group != NULL) {
+				result = ctxClientCookieAdd(context->session, desc, group, (void*)afb_thread_group_unref);
+				if (result != group)
+					afb_thread_group_unref(group);
+			}
+		}
+		if (result != NULL)
+			return result;
+	}
+
+	return desc->group;
+}
+
+/*
+ * get the client accounting the jobs of the session of the 'context'
+ * with the weight of the level of assurance of the session
+ */
+static struct afb_thread_client *call_client(struct afb_context *context)
+{
+	struct afb_thread_client *client, *result;
+	int weight;
+
+	if (context->session == NULL)
+		return NULL;
+
+	weight = client_weights[context->loa_in];
+	result = ctxClientCookieGet(context->session, client_cookie_key);
+	if (result != NULL)
+		afb_thread_client_set_weight(result, weight);
+	else {
+		/* the first of concurrent callers records its client */
+		client = afb_thread_client_create(weight);
+		if (client != NULL) {
+			result = ctxClientCookieAdd(context->session, client_cookie_key, client, (void*)afb_thread_client_unref);
+			if (result != client) {
+				afb_thread_client_unref(client);
+				if (result != NULL)
+					afb_thread_client_set_weight(result, weight);
+			}
+		}
+	}
+	return result;
+}
+
 static void call_cb(void *closure, struct afb_req req, struct afb_context *context, const char *strverb, size_t lenverb)
 {
 	const struct afb_verb_desc_v1 *verb;
@@ -198,7 +265,7 @@ static void call_cb(void *closure, struct afb_req req, struct afb_context *conte
 			afb_sig_req_timeout(req, verb->callback, api_timeout);
 		else
 			/* threaded */
-			afb_thread_call(req, verb->callback, api_timeout, desc);
+			afb_thread_call(req, verb->callback, api_timeout, call_group(desc, context, verb), call_client(context));
 	}
 }
 
@@ -249,6 +316,42 @@ void afb_api_so_set_timeout(int to)
 	api_timeout = to;
 }
 
+/*
+ * Sets the weights of the clients for sharing the threads as given
+ * by 'spec': W0[,W1[,...]] where Wn is the weight of the sessions of
+ * level of assurance n, the missing weights being the last given.
+ * Returns 0 in case of success or -1 on error.
+ */
+int afb_api_so_set_client_weights(const char *spec)
+{
+	int loa, weights[8];
+	long weight;
+	const char *iter;
+	char *end;
+
+	iter = spec;
+	weight = 1;
+	for (loa = 0 ; loa < 8 ; loa++) {
+		if (*iter) {
+			weight = strtol(iter, &end, 10);
+			if (end == iter || weight <= 0 || weight > INT_MAX || (*end != 0 && *end != ','))
+				goto invalid;
+			iter = *end ? end + 1 : end;
+		}
+		weights[loa] = (int)weight;
+	}
+	if (*iter)
+		goto invalid;
+
+	memcpy(client_weights, weights, sizeof weights);
+	return 0;
+
+invalid:
+	ERROR("invalid weights of clients %s, expected W0[,W1[,...]]", spec);
+	errno = EINVAL;
+	return -1;
+}
+
 int afb_api_so_add_binding(const char *path)
 {
 	int rc;
@@ -283,6 +386,13 @@ int afb_api_so_add_binding(const char *path)
 	}
 	desc->handle = handle;
 
+	/* creates the group serializing the calls */
+	desc->group = afb_thread_group_create();
+	if (desc->group == NULL) {
+		ERROR("out of memory");
+		goto error3;
+	}
+
 	/* init the interface */
 	desc->interface.verbosity = verbosity;
 	desc->interface.mode = AFB_MODE_LOCAL;
@@ -340,6 +450,7 @@ int afb_api_so_add_binding(const char *path)
 	return 0;
 
 error3:
+	afb_thread_group_unref(desc->group);
 	free(desc);
 error2:
 	dlclose(handle);
@@ -19,6 +19,7 @@
 #pragma once
 
 extern void afb_api_so_set_timeout(int to);
+extern int afb_api_so_set_client_weights(const char *spec);
 
 extern int afb_api_so_add_binding(const char *path);
 
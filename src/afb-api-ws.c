@@ -41,10 +41,12 @@
 #include "afb-ws.h"
 #include "afb-msg-json.h"
 #include "afb-apis.h"
+#include "afb-rate.h"
 #include "afb-api-so.h"
 #include "afb-context.h"
 #include "afb-evt.h"
 #include "afb-subcall.h"
+#include "afb-completion.h"
 #include "verbose.h"
 
 struct api_ws_memo;
@@ -95,17 +97,31 @@ static const struct afb_ws_itf api_ws_client_ws_itf =
 
 static void api_ws_server_event_add(void *closure, const char *event, int eventid);
 static void api_ws_server_event_remove(void *closure, const char *event, int eventid);
-static void api_ws_server_event_push(void *closure, const char *event, int eventid, struct json_object *object);
-static void api_ws_server_event_broadcast(void *closure, const char *event, int eventid, struct json_object *object);
+static void api_ws_server_event_push(void *closure, struct afb_evt_data *data);
+static void api_ws_server_event_broadcast(void *closure, struct afb_evt_data *data);
+static int api_ws_server_event_batch(void *closure, struct afb_evt_data **datas, int count);
+static void api_ws_server_event_disconnect(void *closure);
+static char *api_ws_server_event_encode_push(const char *event, int eventid, struct json_object *object, size_t *length);
+static char *api_ws_server_event_encode_broadcast(const char *event, int eventid, struct json_object *object, size_t *length);
 
 /* the interface for events pushing */
 static const struct afb_evt_itf api_ws_server_evt_itf = {
 	.broadcast = api_ws_server_event_broadcast,
 	.push = api_ws_server_event_push,
+	.batch = api_ws_server_event_batch,
+	.disconnect = api_ws_server_event_disconnect,
 	.add = api_ws_server_event_add,
 	.remove = api_ws_server_event_remove
 };
 
+/* the encodings of the events, shared by all the clients */
+static const struct afb_evt_encoding evt_push_encoding = {
+	.encode = api_ws_server_event_encode_push
+};
+static const struct afb_evt_encoding evt_broadcast_encoding = {
+	.encode = api_ws_server_event_encode_broadcast
+};
+
 /******************* client description part for server *****************************/
 
 struct api_ws_client
@@ -124,12 +140,27 @@ struct api_ws_client
 
 	/* websocket */
 	struct afb_ws *ws;
+
+	/* the queue of the loop writing the websocket */
+	struct afb_completion_queue *queue;
+};
+
+/*
+ * structure for a message sent to a client by the loop of its websocket
+ */
+struct api_ws_server_msg
+{
+	struct afb_completion completion;	/* for sending by the loop */
+	struct api_ws_client *client;		/* the client */
+	char *buffer;				/* the message */
+	size_t length;				/* the length of the message */
 };
 
 /******************* websocket interface for client part **********************************/
 
 static void api_ws_server_on_binary(void *closure, char *data, size_t size);
 static void api_ws_server_on_hangup(void *closure);
+static void api_ws_server_on_writable(void *closure);
 
 static const struct afb_ws_itf api_ws_server_ws_itf =
 {
@@ -137,7 +168,8 @@ static const struct afb_ws_itf api_ws_server_ws_itf =
 	.on_text = NULL,
 	.on_binary = api_ws_server_on_binary,
 	.on_error = NULL,
-	.on_hangup = api_ws_server_on_hangup
+	.on_hangup = api_ws_server_on_hangup,
+	.on_writable = api_ws_server_on_writable
 };
 
 /******************* ws request part for server *****************/
@@ -152,7 +184,7 @@ struct api_ws_server_req {
 	struct json_object *json;	/* the readen request as object */
 	const char *request;		/* the readen request as string */
 	size_t lenreq;			/* the length of the request */
-	int refcount;			/* reference count of the request */
+	int refcount;			/* atomic reference count of the request */
 	uint32_t msgid;			/* the incoming request msgid */
 };
 
@@ -443,6 +475,25 @@ static int api_ws_write_object(struct writebuf *wb, struct json_object *object)
 	return string != NULL && api_ws_write_string(wb, string);
 }
 
+static char *api_ws_write_flatten(struct writebuf *wb, size_t *length)
+{
+	int i;
+	size_t sz;
+	char *result;
+
+	for (sz = 0, i = 0 ; i < wb->count ; i++)
+		sz += wb->iovec[i].iov_len;
+	result = malloc(sz ? sz : 1);
+	if (result != NULL) {
+		for (sz = 0, i = 0 ; i < wb->count ; i++) {
+			memcpy(&result[sz], wb->iovec[i].iov_base, wb->iovec[i].iov_len);
+			sz += wb->iovec[i].iov_len;
+		}
+		*length = sz;
+	}
+	return result;
+}
+
 
 
 
@@ -456,7 +507,12 @@ struct api_ws_memo {
 	struct api_ws *api;		/* the ws api */
 	struct afb_req req;		/* the request handle */
 	struct afb_context *context;	/* the context of the query */
+	const char *verb;		/* the verb of the query */
+	size_t lenverb;			/* the length of the verb */
+	const char *raw;		/* the arguments of the query */
+	size_t szraw;			/* the length of the arguments */
 	uint32_t msgid;			/* the message identifier */
+	struct afb_completion completion; /* for sending by the main loop */
 };
 
 struct api_ws_event
@@ -493,7 +549,7 @@ static struct api_ws_event *api_ws_client_event_search(struct api_ws *api, uint3
 
 
 /* allocates and init the memorizing data */
-static struct api_ws_memo *api_ws_client_memo_make(struct api_ws *api, struct afb_req req, struct afb_context *context)
+static struct api_ws_memo *api_ws_client_memo_make(struct api_ws *api, struct afb_req req, struct afb_context *context, const char *verb, size_t lenverb, const char *raw, size_t szraw)
 {
 	struct api_ws_memo *memo;
 
@@ -502,14 +558,27 @@ static struct api_ws_memo *api_ws_client_memo_make(struct api_ws *api, struct af
 		afb_req_addref(req);
 		memo->req = req;
 		memo->context = context;
-		do { memo->msgid = ++api->client.id; } while(api_ws_client_memo_search(api, memo->msgid) != NULL);
+		memo->verb = verb;
+		memo->lenverb = lenverb;
+		memo->raw = raw;
+		memo->szraw = szraw;
+		memo->msgid = 0;
 		memo->api = api;
-		memo->next = api->client.memos;
-		api->client.memos = memo;
+		memo->next = NULL;
 	}
 	return memo;
 }
 
+/* records the memo with a new message identifier, only by the main loop */
+static void api_ws_client_memo_record(struct api_ws_memo *memo)
+{
+	struct api_ws *api = memo->api;
+
+	do { memo->msgid = ++api->client.id; } while(api_ws_client_memo_search(api, memo->msgid) != NULL);
+	memo->next = api->client.memos;
+	api->client.memos = memo;
+}
+
 /* free and release the memorizing data */
 static void api_ws_client_memo_destroy(struct api_ws_memo *memo)
 {
@@ -803,55 +872,70 @@ static void api_ws_client_on_binary(void *closure, char *data, size_t size)
 	free(data);
 }
 
-/* on call, propagate it to the ws service */
-static void api_ws_client_call_cb(void * closure, struct afb_req req, struct afb_context *context, const char *verb, size_t lenverb)
+/* sends the call of 'memo' to the ws service, only by the main loop */
+static void api_ws_client_call_send(void *closure)
 {
 	int rc;
-	struct api_ws_memo *memo;
 	struct writebuf wb = { .count = 0 };
-	const char *raw;
-	size_t szraw;
-	struct api_ws *api = closure;
+	struct api_ws_memo *memo = closure;
 
-	/* create the recording data */
-	memo = api_ws_client_memo_make(api, req, context);
-	if (memo == NULL) {
-		afb_req_fail(req, "error", "out of memory");
-		return;
-	}
+	/* record the call */
+	api_ws_client_memo_record(memo);
 
 	/* creates the call message */
-	raw = afb_req_raw(req, &szraw);
-	if (raw == NULL)
-		goto internal_error;
 	if (!api_ws_write_uint32(&wb, memo->msgid)
-	 || !api_ws_write_uint32(&wb, (uint32_t)context->flags)
-	 || !api_ws_write_string_nz(&wb, verb, lenverb)
-	 || !api_ws_write_string(&wb, ctxClientGetUuid(context->session))
-	 || !api_ws_write_string_length(&wb, raw, szraw))
+	 || !api_ws_write_uint32(&wb, (uint32_t)memo->context->flags)
+	 || !api_ws_write_string_nz(&wb, memo->verb, memo->lenverb)
+	 || !api_ws_write_string(&wb, ctxClientGetUuid(memo->context->session))
+	 || !api_ws_write_string_length(&wb, memo->raw, memo->szraw))
 		goto overflow;
 
 	/* send */
-	rc = afb_ws_binary_v(api->client.ws, wb.iovec, wb.count);
+	rc = afb_ws_binary_v(memo->api->client.ws, wb.iovec, wb.count);
 	if (rc < 0)
 		goto ws_send_error;
 	return;
 
 ws_send_error:
-	afb_req_fail(req, "error", "websocket sending error");
-	goto clean_memo;
-
-internal_error:
-	afb_req_fail(req, "error", "internal: raw is NULL!");
+	afb_req_fail(memo->req, "error", "websocket sending error");
 	goto clean_memo;
 
 overflow:
-	afb_req_fail(req, "error", "overflow: size doesn't match 32 bits!");
+	afb_req_fail(memo->req, "error", "overflow: size doesn't match 32 bits!");
 
 clean_memo:
 	api_ws_client_memo_destroy(memo);
 }
 
+/*
+ * On call, propagate it to the ws service. The call can come from
+ * any thread but the memos and the websocket belong to the main loop.
+ */
+static void api_ws_client_call_cb(void * closure, struct afb_req req, struct afb_context *context, const char *verb, size_t lenverb)
+{
+	struct api_ws_memo *memo;
+	const char *raw;
+	size_t szraw;
+	struct api_ws *api = closure;
+
+	/* get the arguments */
+	raw = afb_req_raw(req, &szraw);
+	if (raw == NULL) {
+		afb_req_fail(req, "error", "internal: raw is NULL!");
+		return;
+	}
+
+	/* create the recording data */
+	memo = api_ws_client_memo_make(api, req, context, verb, lenverb, raw, szraw);
+	if (memo == NULL) {
+		afb_req_fail(req, "error", "out of memory");
+		return;
+	}
+
+	/* send it by the main loop */
+	afb_completion_post(afb_completion_get_main_queue(), &memo->completion, api_ws_client_call_send, memo);
+}
+
 static int api_ws_service_start_cb(void *closure, int share_session, int onneed)
 {
 	struct api_ws *api = closure;
@@ -935,13 +1019,51 @@ error:
 
 static void api_ws_server_client_unref(struct api_ws_client *client)
 {
-	if (!--client->refcount) {
+	if (!__atomic_sub_fetch(&client->refcount, 1, __ATOMIC_ACQ_REL)) {
 		afb_evt_listener_unref(client->listener);
 		afb_ws_destroy(client->ws);
 		free(client);
 	}
 }
 
+/* sends the message from the loop of the websocket of the client */
+static void api_ws_server_msg_send(void *closure)
+{
+	struct api_ws_server_msg *msg = closure;
+
+	if (afb_ws_binary(msg->client->ws, msg->buffer, msg->length) < 0)
+		ERROR("error while sending %c", msg->buffer[0]);
+	api_ws_server_client_unref(msg->client);
+	free(msg->buffer);
+	free(msg);
+}
+
+/*
+ * Sends the message of 'wb' to 'client'. The websocket is only written
+ * by its loop because the replies come from any thread.
+ * Returns 0 in case of success or -1 on error.
+ */
+static int api_ws_server_client_send(struct api_ws_client *client, struct writebuf *wb)
+{
+	struct api_ws_server_msg *msg;
+
+	msg = malloc(sizeof *msg);
+	if (msg == NULL)
+		goto error;
+	msg->buffer = api_ws_write_flatten(wb, &msg->length);
+	if (msg->buffer == NULL)
+		goto error2;
+	msg->client = client;
+	__atomic_add_fetch(&client->refcount, 1, __ATOMIC_RELAXED);
+	afb_completion_post(client->queue, &msg->completion, api_ws_server_msg_send, msg);
+	return 0;
+
+error2:
+	free(msg);
+error:
+	return -1;
+}
+
 /* on call, propagate it to the ws service */
 static void api_ws_server_called(struct api_ws_client *client, struct readbuf *rb, char *data, size_t size)
 {
@@ -950,7 +1072,7 @@ static void api_ws_server_called(struct api_ws_client *client, struct readbuf *r
 	const char *uuid, *verb;
 	uint32_t flags;
 
-	client->refcount++;
+	__atomic_add_fetch(&client->refcount, 1, __ATOMIC_RELAXED);
 
 	/* create the request */
 	wreq = calloc(1 , sizeof *wreq);
@@ -977,7 +1099,8 @@ static void api_ws_server_called(struct api_ws_client *client, struct readbuf *r
 	/* makes the call */
 	areq.itf = &afb_api_ws_req_itf;
 	areq.closure = wreq;
-	afb_apis_call_(areq, &wreq->context, client->api, verb);
+	if (afb_rate_check(areq, &wreq->context, client->api, strlen(client->api), verb, strlen(verb)))
+		afb_apis_call_(areq, &wreq->context, client->api, verb);
 	api_ws_server_req_unref(wreq);
 	return;
 
@@ -1010,6 +1133,15 @@ static void api_ws_server_on_hangup(void *closure)
 	api_ws_server_client_unref(client);
 }
 
+/* callback when the data waiting are written */
+static void api_ws_server_on_writable(void *closure)
+{
+	struct api_ws_client *client = closure;
+
+	/* sends the events kept while the client was not reading */
+	afb_evt_listener_unblock(client->listener);
+}
+
 static void api_ws_server_accept(struct api_ws *api)
 {
 	struct api_ws_client *client;
@@ -1019,6 +1151,10 @@ static void api_ws_server_accept(struct api_ws *api)
 	client = calloc(1, sizeof *client);
 	if (client != NULL) {
 		client->listener = afb_evt_listener_create(&api_ws_server_evt_itf, client);
+		if (client->listener != NULL && afb_evt_add_broadcast(client->listener, "*") < 0) {
+			afb_evt_listener_unref(client->listener);
+			client->listener = NULL;
+		}
 		if (client->listener != NULL) {
 			lenaddr = (socklen_t)sizeof addr;
 			client->fd = accept(api->fd, &addr, &lenaddr);
@@ -1027,6 +1163,7 @@ static void api_ws_server_accept(struct api_ws *api)
 				fcntl(client->fd, F_SETFL, O_NONBLOCK);
 				client->ws = afb_ws_create(afb_common_get_event_loop(), client->fd, &api_ws_server_ws_itf, client);
 				if (client->ws != NULL) {
+					client->queue = afb_completion_get_queue();
 					client->api = api->api;
 					client->refcount = 1;
 					return;
@@ -1050,7 +1187,7 @@ static void api_ws_server_event_send(struct api_ws_client *client, char order, c
 	 && api_ws_write_uint32(&wb, eventid)
 	 && api_ws_write_string(&wb, event)
 	 && (data == NULL || api_ws_write_string(&wb, data))) {
-		rc = afb_ws_binary_v(client->ws, wb.iovec, wb.count);
+		rc = api_ws_server_client_send(client, &wb);
 		if (rc >= 0)
 			return;
 	}
@@ -1067,27 +1204,96 @@ static void api_ws_server_event_remove(void *closure, const char *event, int eve
 	api_ws_server_event_send(closure, '-', event, eventid, NULL);
 }
 
-static void api_ws_server_event_push(void *closure, const char *event, int eventid, struct json_object *object)
+static char *api_ws_server_event_encode_push(const char *event, int eventid, struct json_object *object, size_t *length)
 {
 	const char *data = json_object_to_json_string_ext(object, JSON_C_TO_STRING_PLAIN);
-	api_ws_server_event_send(closure, '!', event, eventid, data ? : "null");
-	json_object_put(object);
+	struct writebuf wb = { .count = 0 };
+
+	if (api_ws_write_char(&wb, '!')
+	 && api_ws_write_uint32(&wb, eventid)
+	 && api_ws_write_string(&wb, event)
+	 && api_ws_write_string(&wb, data ? : "null"))
+		return api_ws_write_flatten(&wb, length);
+	return NULL;
+}
+
+static char *api_ws_server_event_encode_broadcast(const char *event, int eventid, struct json_object *object, size_t *length)
+{
+	struct writebuf wb = { .count = 0 };
+
+	if (api_ws_write_char(&wb, '*') && api_ws_write_string(&wb, event) && api_ws_write_object(&wb, object))
+		return api_ws_write_flatten(&wb, length);
+	return NULL;
 }
 
-static void api_ws_server_event_broadcast(void *closure, const char *event, int eventid, struct json_object *object)
+static void api_ws_server_event_push(void *closure, struct afb_evt_data *data)
 {
 	int rc;
+	size_t length;
+	const char *buffer;
 	struct api_ws_client *client = closure;
 
-	struct writebuf wb = { .count = 0 };
+	buffer = afb_evt_data_encode(data, &evt_push_encoding, &length);
+	if (buffer != NULL) {
+		rc = afb_ws_binary(client->ws, buffer, length);
+		if (rc >= 0)
+			return;
+	}
+	ERROR("error while sending ! for event %s", afb_evt_data_event(data));
+}
+
+static void api_ws_server_event_broadcast(void *closure, struct afb_evt_data *data)
+{
+	int rc;
+	size_t length;
+	const char *buffer;
+	struct api_ws_client *client = closure;
+
+	buffer = afb_evt_data_encode(data, &evt_broadcast_encoding, &length);
+	if (buffer != NULL) {
+		rc = afb_ws_binary(client->ws, buffer, length);
+		if (rc >= 0)
+			return;
+	}
+	ERROR("error while broadcasting event %s", afb_evt_data_event(data));
+}
+
+static int api_ws_server_event_batch(void *closure, struct afb_evt_data **datas, int count)
+{
+	int i, n;
+	struct iovec iovec[WRITEBUF_COUNT_MAX];
+	struct api_ws_client *client = closure;
+
+	/* a client not reading keeps its events */
+	if (!afb_ws_is_writable(client->ws))
+		return 0;
+
+	n = 0;
+	for (i = 0 ; i < count ; i++) {
+		iovec[n].iov_base = (void*)afb_evt_data_encode(datas[i],
+				afb_evt_data_id(datas[i]) ? &evt_push_encoding : &evt_broadcast_encoding,
+				&iovec[n].iov_len);
+		if (iovec[n].iov_base == NULL)
+			ERROR("error while sending event %s", afb_evt_data_event(datas[i]));
+		else if (++n == WRITEBUF_COUNT_MAX) {
+			if (afb_ws_binary_messages(client->ws, iovec, n) < 0)
+				ERROR("error while sending events");
+			n = 0;
+			if (!afb_ws_is_writable(client->ws))
+				return i + 1;
+		}
+	}
+	if (n != 0 && afb_ws_binary_messages(client->ws, iovec, n) < 0)
+		ERROR("error while sending events");
+	return count;
+}
+
+static void api_ws_server_event_disconnect(void *closure)
+{
+	struct api_ws_client *client = closure;
 
-	if (api_ws_write_char(&wb, '*') && api_ws_write_string(&wb, event) && api_ws_write_object(&wb, object)) {
-		rc = afb_ws_binary_v(client->ws, wb.iovec, wb.count);
-		if (rc < 0)
-			ERROR("error while broadcasting event %s", event);
-	} else
-		ERROR("error while broadcasting event %s", event);
-	json_object_put(object);
+	ERROR("disconnecting client of %s: too many events waiting", client->api);
+	afb_ws_hangup(client->ws);
 }
 
 /******************* ws request part for server *****************/
@@ -1096,7 +1302,7 @@ static void api_ws_server_event_broadcast(void *closure, const char *event, int
 static void api_ws_server_req_addref_cb(void *closure)
 {
 	struct api_ws_server_req *wreq = closure;
-	wreq->refcount++;
+	__atomic_add_fetch(&wreq->refcount, 1, __ATOMIC_RELAXED);
 }
 
 /* decrement the reference count of the request and free/release it on falling to null */
@@ -1107,7 +1313,7 @@ static void api_ws_server_req_unref_cb(void *closure)
 
 static void api_ws_server_req_unref(struct api_ws_server_req *wreq)
 {
-	if (wreq == NULL || --wreq->refcount)
+	if (wreq == NULL || __atomic_sub_fetch(&wreq->refcount, 1, __ATOMIC_ACQ_REL))
 		return;
 
 	afb_context_disconnect(&wreq->context);
@@ -1153,7 +1359,7 @@ static void api_ws_server_req_success_cb(void *closure, struct json_object *obj,
 	 && api_ws_write_uint32(&wb, (uint32_t)wreq->context.flags)
 	 && api_ws_write_string(&wb, info ? : "")
 	 && api_ws_write_object(&wb, obj)) {
-		rc = afb_ws_binary_v(wreq->client->ws, wb.iovec, wb.count);
+		rc = api_ws_server_client_send(wreq->client, &wb);
 		if (rc >= 0)
 			goto success;
 	}
@@ -1173,7 +1379,7 @@ static void api_ws_server_req_fail_cb(void *closure, const char *status, const c
 	 && api_ws_write_uint32(&wb, (uint32_t)wreq->context.flags)
 	 && api_ws_write_string(&wb, status)
 	 && api_ws_write_string(&wb, info ? : "")) {
-		rc = afb_ws_binary_v(wreq->client->ws, wb.iovec, wb.count);
+		rc = api_ws_server_client_send(wreq->client, &wb);
 		if (rc >= 0)
 			return;
 	}
@@ -1199,7 +1405,7 @@ static void api_ws_server_req_send_cb(void *closure, const char *buffer, size_t
 	 && api_ws_write_uint32(&wb, wreq->msgid)
 	 && api_ws_write_uint32(&wb, (uint32_t)wreq->context.flags)
 	 && api_ws_write_string_length(&wb, buffer, size)) {
-		rc = afb_ws_binary_v(wreq->client->ws, wb.iovec, wb.count);
+		rc = api_ws_server_client_send(wreq->client, &wb);
 		if (rc >= 0)
 			return;
 	}
@@ -1220,7 +1426,7 @@ static int api_ws_server_req_subscribe_cb(void *closure, struct afb_event event)
 	 && api_ws_write_uint32(&wb, wreq->msgid)
 	 && api_ws_write_uint32(&wb, (uint32_t)afb_evt_event_id(event))
 	 && api_ws_write_string(&wb, afb_evt_event_name(event))) {
-		rc2 = afb_ws_binary_v(wreq->client->ws, wb.iovec, wb.count);
+		rc2 = api_ws_server_client_send(wreq->client, &wb);
 		if (rc2 >= 0)
 			goto success;
 	}
@@ -1239,7 +1445,7 @@ static int api_ws_server_req_unsubscribe_cb(void *closure, struct afb_event even
 	 && api_ws_write_uint32(&wb, wreq->msgid)
 	 && api_ws_write_uint32(&wb, (uint32_t)afb_evt_event_id(event))
 	 && api_ws_write_string(&wb, afb_evt_event_name(event))) {
-		rc2 = afb_ws_binary_v(wreq->client->ws, wb.iovec, wb.count);
+		rc2 = api_ws_server_client_send(wreq->client, &wb);
 		if (rc2 >= 0)
 			goto success;
 	}
@@ -31,18 +31,8 @@
 static const char *default_locale = NULL;
 static struct locale_root *rootdir = NULL;
 
-/*
-struct sd_event *afb_common_get_thread_event_loop()
-{
-	sd_event *result;
-	int rc = sd_event_default(&result);
-	if (rc != 0) {
-		errno = -rc;
-		result = NULL;
-	}
-	return result;
-}
-*/
+/* the event loop of the reactor thread, NULL for the main loop */
+static _Thread_local struct sd_event *thread_loop = NULL;
 
 static void *sdopen(void **p, int (*f)(void **))
 {
@@ -64,7 +54,7 @@ static struct sd_bus *sdbusopen(struct sd_bus **p, int (*f)(struct sd_bus **))
 			errno = -rc;
 			*p = NULL;
 		} else {
-			rc = sd_bus_attach_event(*p, afb_common_get_event_loop(), 0);
+			rc = sd_bus_attach_event(*p, afb_common_get_main_event_loop(), 0);
 			if (rc < 0) {
 				sd_bus_unref(*p);
 				errno = -rc;
@@ -75,12 +65,30 @@ static struct sd_bus *sdbusopen(struct sd_bus **p, int (*f)(struct sd_bus **))
 	return *p;
 }
 
-struct sd_event *afb_common_get_event_loop()
+struct sd_event *afb_common_get_main_event_loop()
 {
 	static struct sd_event *result = NULL;
 	return sdopen((void*)&result, (void*)sd_event_new);
 }
 
+/*
+ * Returns the event loop of the calling thread: its own loop
+ * for reactor threads, the main loop otherwise.
+ */
+struct sd_event *afb_common_get_event_loop()
+{
+	return thread_loop ? : afb_common_get_main_event_loop();
+}
+
+/*
+ * Makes the calling thread a reactor that runs its own event loop.
+ * Returns the event loop or NULL on error.
+ */
+struct sd_event *afb_common_set_thread_event_loop()
+{
+	return sdopen((void*)&thread_loop, (void*)sd_event_default);
+}
+
 struct sd_bus *afb_common_get_user_bus()
 {
 	static struct sd_bus *result = NULL;
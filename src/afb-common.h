@@ -21,6 +21,8 @@ struct sd_event;
 struct sd_bus;
 
 extern struct sd_event *afb_common_get_event_loop();
+extern struct sd_event *afb_common_get_main_event_loop();
+extern struct sd_event *afb_common_set_thread_event_loop();
 extern struct sd_bus *afb_common_get_user_bus();
 extern struct sd_bus *afb_common_get_system_bus();
 
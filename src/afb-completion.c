@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2015, 2016 "IoT.bzh"
+ * Author José Bollo <jose.bollo@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <systemd/sd-event.h>
+
+#include "afb-completion.h"
+#include "afb-common.h"
+#include "verbose.h"
+
+/*
+ * The queue of completions of an event loop
+ */
+struct afb_completion_queue
+{
+	struct afb_completion *incoming;	/* lock-free stack of posted completions, latest first */
+	int efd;			/* the eventfd waking up the loop */
+	pthread_t thread;		/* the thread running the loop */
+	struct sd_event_source *evsrc;	/* the event source of 'efd' */
+};
+
+/* the queue of the event loop of the current thread */
+static _Thread_local struct afb_completion_queue *current_queue = NULL;
+
+/* the queue of the main event loop */
+static struct afb_completion_queue *main_queue = NULL;
+
+/*
+ * Runs the completions posted to 'queue' since the previous call.
+ * The whole stack is taken at once and reverted to run
+ * the completions in the order of their posting.
+ */
+static void run_completions(struct afb_completion_queue *queue)
+{
+	struct afb_completion *stack, *fifo, *completion;
+
+	stack = __atomic_exchange_n(&queue->incoming, NULL, __ATOMIC_ACQUIRE);
+	fifo = NULL;
+	while (stack != NULL) {
+		completion = stack;
+		stack = completion->next;
+		completion->next = fifo;
+		fifo = completion;
+	}
+	while (fifo != NULL) {
+		completion = fifo;
+		fifo = completion->next;
+		completion->callback(completion->closure);
+	}
+}
+
+/* callback of the event loop for the eventfd of the queue */
+static int on_completion_event(sd_event_source *src, int fd, uint32_t revents, void *queue)
+{
+	uint64_t count;
+
+	/* read before draining so that no wake up is lost */
+	read(fd, &count, sizeof count);
+	run_completions(queue);
+	return 0;
+}
+
+/*
+ * Initialise the queue of completions for the event loop of the
+ * calling thread. Must be called by the thread that runs the loop.
+ * Returns 0 in case of success or -1 in case of error.
+ */
+int afb_completion_init()
+{
+	int rc;
+	struct sd_event *loop;
+	struct afb_completion_queue *queue;
+
+	loop = afb_common_get_event_loop();
+	if (loop == NULL) {
+		ERROR("can't get the event loop: %m");
+		goto error;
+	}
+
+	queue = malloc(sizeof *queue);
+	if (queue == NULL) {
+		ERROR("out of memory");
+		goto error;
+	}
+
+	queue->incoming = NULL;
+	queue->thread = pthread_self();
+	queue->efd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	if (queue->efd < 0) {
+		ERROR("can't create the eventfd of completions: %m");
+		goto error2;
+	}
+
+	rc = sd_event_add_io(loop, &queue->evsrc, queue->efd, EPOLLIN, on_completion_event, queue);
+	if (rc < 0) {
+		errno = -rc;
+		ERROR("can't add the eventfd of completions to the loop: %m");
+		goto error3;
+	}
+
+	current_queue = queue;
+	if (loop == afb_common_get_main_event_loop())
+		__atomic_store_n(&main_queue, queue, __ATOMIC_RELEASE);
+	return 0;
+
+error3:
+	close(queue->efd);
+error2:
+	free(queue);
+error:
+	return -1;
+}
+
+/*
+ * Returns the queue of completions of the event loop of the
+ * calling thread or NULL if the thread has no queue.
+ */
+struct afb_completion_queue *afb_completion_get_queue()
+{
+	return current_queue;
+}
+
+/*
+ * Returns the queue of completions of the main event loop
+ * or NULL if it is not yet initialised.
+ */
+struct afb_completion_queue *afb_completion_get_main_queue()
+{
+	return __atomic_load_n(&main_queue, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Posts the 'completion' for calling 'callback' with 'closure'
+ * by the event loop of 'queue'. The call is direct when the
+ * caller is the thread of that loop or when 'queue' is NULL.
+ * Otherwise, 'completion' must remain valid until 'callback'
+ * is called.
+ */
+void afb_completion_post(struct afb_completion_queue *queue, struct afb_completion *completion, void (*callback)(void *closure), void *closure)
+{
+	struct afb_completion *head;
+	uint64_t one = 1;
+
+	if (queue == NULL || pthread_equal(pthread_self(), queue->thread)) {
+		callback(closure);
+		return;
+	}
+
+	completion->callback = callback;
+	completion->closure = closure;
+	head = __atomic_load_n(&queue->incoming, __ATOMIC_RELAXED);
+	do {
+		completion->next = head;
+	} while (!__atomic_compare_exchange_n(&queue->incoming, &head, completion, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	/* wakes up the loop only when the stack was empty */
+	if (head == NULL)
+		write(queue->efd, &one, sizeof one);
+}
+
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2015, 2016 "IoT.bzh"
+ * Author José Bollo <jose.bollo@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+/*
+ * A completion is a deferred call of 'callback' with 'closure'
+ * that is run by the thread of an event loop. It is intended
+ * to be embedded in the structure that it completes.
+ */
+struct afb_completion
+{
+	struct afb_completion *next;	/* link in the queue */
+	void (*callback)(void *closure);	/* the function to call */
+	void *closure;			/* its closure */
+};
+
+/*
+ * The queue of completions of an event loop.
+ */
+struct afb_completion_queue;
+
+extern int afb_completion_init();
+
+extern struct afb_completion_queue *afb_completion_get_queue();
+
+extern struct afb_completion_queue *afb_completion_get_main_queue();
+
+extern void afb_completion_post(struct afb_completion_queue *queue, struct afb_completion *completion, void (*callback)(void *closure), void *closure);
+
@@ -31,6 +31,12 @@
 
 #define CTX_NBCLIENTS   10   // allow a default of 10 authenticated clients
 
+#define DEFLT_WORKERS_MIN   1      // default minimum count of threads
+#define DEFLT_WORKERS_MAX   3      // default maximum count of threads
+#define DEFLT_WORKERS_IDLE  30     // default seconds of idleness before stopping a thread
+#define DEFLT_JOBS_MAX      20     // default maximum count of requests waiting a thread
+#define DEFLT_REACTORS      1      // default count of event loops serving HTTP
+
 struct afb_config_item
 {
 	struct afb_config_item *previous;
@@ -56,6 +62,16 @@ struct afb_config
   int  apiTimeout;
   int  cntxTimeout;        // Client Session Context timeout
   int  nbSessionMax;	// max count of sessions
+  int  sessionMemory;      // memory allowed for sessions in kilobytes, 0 if unlimited
+  int  sessionShared;      // share the sessions with the daemons of the same sessiondir
+  int  workersMin;         // min count of threads processing requests
+  int  workersMax;         // max count of threads processing requests
+  int  workersIdle;        // seconds of idleness before stopping a thread
+  int  jobsMax;            // max count of requests waiting a thread
+  int  reactors;           // count of event loops serving HTTP
+  char *rateSession;       // limit of calls of each session: RATE[:BURST] or NULL
+  char *eventQueue;        // queue of events of clients: SIZE[:POLICY] or NULL
+  char *clientWeights;     // weights of the clients by LOA: W0[,W1[,...]] or NULL
   int mode;           // mode of listening
   int aliascount;
   int tracereq;
@@ -18,15 +18,27 @@
 
 #define _GNU_SOURCE
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 #include <json-c/json.h>
+#include <systemd/sd-event.h>
 #include <afb/afb-event-itf.h>
 
 #include "afb-evt.h"
+#include "afb-completion.h"
+#include "verbose.h"
+
+/* default maximum count of data waiting in the queue of a listener */
+#define DEFAULT_QUEUE_MAX 1024
 
 struct afb_evt_watch;
 
@@ -38,17 +50,77 @@ struct afb_evt_listener {
 	/* chaining listeners */
 	struct afb_evt_listener *next;
 
+	/* link pointing to this listener in the list of listeners */
+	struct afb_evt_listener **prev;
+
+	/* next listener in the same bucket of listeners */
+	struct afb_evt_listener *next_by_closure;
+
 	/* interface for callbacks */
 	const struct afb_evt_itf *itf;
 
 	/* closure for the callback */
 	void *closure;
 
-	/* head of the list of events listened */
-	struct afb_evt_watch *watchs;
+	/* index of the events listened, by address of the event */
+	struct afb_evt_watch **watchs;
+
+	/* size of the index of watchs (0 or power of 2) */
+	unsigned watchsize;
+
+	/* count of watchs */
+	unsigned watchcount;
 
 	/* count of reference to the listener */
 	int refcount;
+
+	/* the data waiting to be sent to the listener */
+	struct afb_evt_data **queue;
+
+	/* count of data waiting and size of the queue */
+	int queuecount, queuesize;
+
+	/* next listener having data to send */
+	struct afb_evt_listener *next_ready;
+
+	/* is the listener in the list of listeners having data to send? */
+	int ready;
+
+	/* maximum count of data waiting, 0 for no limit */
+	int queuemax;
+
+	/* policy when the queue is full */
+	enum afb_evt_policy policy;
+
+	/* couldn't the listener send its data? */
+	int blocked;
+
+	/* disconnection required (1) or done (2) */
+	int disconnect;
+
+	/* is the listener sending its queue? */
+	int sending;
+
+	/* was the listener unblocked while sending? */
+	int unblocked;
+
+	/* the queue of the loop owning the listener, NULL for the main loop */
+	struct afb_completion_queue *loop;
+
+	/* sends the queue from the loop owning the listener */
+	struct afb_completion completion;
+
+	/* is the sending posted to the loop owning the listener? */
+	int posted;
+
+	/* was the listener released while ready or sending? */
+	int dead;
+
+	/* the patterns of broadcasts received */
+	struct broadcast_interest *interests;
+
+	/* mark of the latest broadcast given, avoiding duplicates */
+	unsigned broadcastmark;
 };
 
 /*
@@ -56,61 +128,1076 @@ struct afb_evt_listener {
  */
 struct afb_evt_event {
 
-	/* next event */
-	struct afb_evt_event *next;
+	/* next event in the same bucket of ids */
+	struct afb_evt_event *next_by_id;
+
+	/* next event in the same bucket of addresses */
+	struct afb_evt_event *next_by_address;
 
 	/* head of the list of listeners watching the event */
 	struct afb_evt_watch *watchs;
 
+	/* count of watchs of the event */
+	int watchcount;
+
 	/* id of the event */
 	int id;
 
-	/* name of the event */
-	char name[1];
-};
+	/* name of the event */
+	char name[1];
+};
+
+/*
+ * Structure for associating events and listeners
+ */
+struct afb_evt_watch {
+
+	/* the event */
+	struct afb_evt_event *event;
+
+	/* link to the next listener for the same event */
+	struct afb_evt_watch *next_by_event;
+
+	/* link pointing to this watch in the list of the event */
+	struct afb_evt_watch **prev_by_event;
+
+	/* the listener */
+	struct afb_evt_listener *listener;
+
+	/* link to the next watch in the same bucket of the index of the listener */
+	struct afb_evt_watch *next_by_listener;
+
+	/* activity */
+	unsigned activity;
+
+	/* index in the heap of delayed watchs or -1 */
+	int delayed;
+
+	/* minimal nanoseconds between two deliveries, 0 when not limited */
+	uint64_t interval;
+
+	/* time of the earliest next delivery */
+	uint64_t next;
+
+	/* the latest data waiting its delivery or NULL */
+	struct afb_evt_data *pending;
+};
+
+/*
+ * Structure for the nodes of the prefix tree of the patterns of broadcasts.
+ * A node is the prefix made of the keys of the nodes from the root.
+ */
+struct broadcast_node {
+
+	/* the parent node, NULL for the root */
+	struct broadcast_node *parent;
+
+	/* next node of the same parent */
+	struct broadcast_node *next;
+
+	/* first child node */
+	struct broadcast_node *children;
+
+	/* interests for the events of the name of the node */
+	struct broadcast_interest *exacts;
+
+	/* interests for the events starting with the name of the node */
+	struct broadcast_interest *prefixes;
+
+	/* the last character of the name */
+	char key;
+};
+
+/*
+ * Structure for the patterns of broadcasts of listeners
+ */
+struct broadcast_interest {
+
+	/* next interest of the same node */
+	struct broadcast_interest *next_by_node;
+
+	/* next interest of the same listener */
+	struct broadcast_interest *next_by_listener;
+
+	/* the listener */
+	struct afb_evt_listener *listener;
+
+	/* the node of the pattern */
+	struct broadcast_node *node;
+
+	/* is the pattern a prefix? (ending with *) */
+	int prefix;
+};
+
+/*
+ * Structure for the limits of rate of delivery set for events
+ */
+struct event_rate {
+
+	/* next limit */
+	struct event_rate *next;
+
+	/* minimal nanoseconds between two deliveries */
+	uint64_t interval;
+
+	/* length of the name */
+	size_t length;
+
+	/* is the name a prefix? (ending with *) */
+	int prefix;
+
+	/* name of the event */
+	char name[1];
+};
+
+/*
+ * Structure for a data encoded for a protocol
+ */
+struct afb_evt_encoded {
+
+	/* next encoding of the same data */
+	struct afb_evt_encoded *next;
+
+	/* the encoding */
+	const struct afb_evt_encoding *encoding;
+
+	/* length of the buffer */
+	size_t length;
+
+	/* the encoded data */
+	char *buffer;
+};
+
+/*
+ * Structure for the data of an event given to listeners
+ */
+struct afb_evt_data {
+
+	/* next data in the queue of dispatch */
+	struct afb_evt_data *next;
+
+	/* count of reference to the data */
+	int refcount;
+
+	/* id of the event (0 for broadcasts) */
+	int eventid;
+
+	/* the object of the event */
+	struct json_object *object;
+
+	/* the encodings made of the data */
+	struct afb_evt_encoded *encodeds;
+
+	/* name of the event */
+	char event[1];
+};
+
+/* declare functions */
+static char *encode_json(const char *event, int eventid, struct json_object *object, size_t *length);
+static int evt_broadcast(struct afb_evt_event *evt, struct json_object *obj);
+static int evt_push(struct afb_evt_event *evt, struct json_object *obj);
+static void evt_destroy(struct afb_evt_event *evt);
+static const char *evt_name(struct afb_evt_event *evt);
+static struct afb_evt_event **search_event_id(int id);
+static void send_readys();
+static int match_broadcast(const char *event, struct afb_evt_data *data);
+
+/* the plain JSON encoding */
+const struct afb_evt_encoding afb_evt_encoding_json = {
+	.encode = encode_json
+};
+
+/* the interface for events */
+static struct afb_event_itf afb_evt_event_itf = {
+	.broadcast = (void*)evt_broadcast,
+	.push = (void*)evt_push,
+	.drop = (void*)evt_destroy,
+	.name = (void*)evt_name
+};
+
+/* head of the list of listeners */
+static struct afb_evt_listener *listeners = NULL;
+
+/* root of the prefix tree of the patterns of broadcasts */
+static struct broadcast_node broadcast_root;
+
+/* mark of the latest broadcast */
+static unsigned broadcast_mark = 0;
+
+/* head of the list of listeners having data to send */
+static struct afb_evt_listener *readys = NULL;
+
+/* default queue of listeners */
+static int default_queuemax = DEFAULT_QUEUE_MAX;
+static enum afb_evt_policy default_policy = afb_evt_policy_drop_oldest;
+
+/* names of the policies */
+static const char *policy_names[] = {
+	[afb_evt_policy_drop_oldest] = "drop-oldest",
+	[afb_evt_policy_drop_newest] = "drop-newest",
+	[afb_evt_policy_coalesce] = "coalesce",
+	[afb_evt_policy_disconnect] = "disconnect"
+};
+
+/* hash table of the listeners by closure */
+static struct afb_evt_listener **listeners_by_closure = NULL;
+static unsigned listeners_size = 0;
+static unsigned listeners_count = 0;
+
+/* hash tables of events by id and by address */
+static struct afb_evt_event **events_by_id = NULL;
+static struct afb_evt_event **events_by_address = NULL;
+static unsigned events_size = 0;
+static unsigned events_count = 0;
+
+/* handling id of events */
+static int event_id_counter = 0;
+static int event_id_wrapped = 0;
+
+/*
+ * Events are pushed by the workers while delayed deliveries are
+ * made by the event loop: the lock is recursive because listeners
+ * may call back the functions of events.
+ */
+static pthread_mutex_t mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/* the limits of rate of events */
+static struct event_rate *event_rates = NULL;
+
+/* heap of the watchs delaying a delivery, sorted by time of delivery */
+static struct afb_evt_watch **delayed = NULL;
+static int delayed_size = 0;
+static int delayed_count = 0;
+
+/* timer of the delayed deliveries */
+static int timerfd = -1;
+static struct sd_event_source *timersrc = NULL;
+
+/* lock-free stack of the data pushed and not yet dispatched, latest first */
+static struct afb_evt_data *incoming = NULL;
+
+/* eventfd waking up the loop for dispatching the incoming data */
+static int dispatchfd = -1;
+static struct sd_event_source *dispatchsrc = NULL;
+
+/* the counters */
+static struct afb_evt_stats stats;
+
+/*
+ * Returns the hash code of the address 'ptr'
+ */
+static inline unsigned hash_address(const void *ptr)
+{
+	return (unsigned)(((uint64_t)(uintptr_t)ptr * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+/*
+ * Returns the current monotonic time in nanoseconds
+ */
+static uint64_t get_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Encodes the 'object' as a plain JSON text
+ */
+static char *encode_json(const char *event, int eventid, struct json_object *object, size_t *length)
+{
+	const char *text;
+	char *result;
+
+	text = json_object_to_json_string_ext(object, JSON_C_TO_STRING_PLAIN);
+	if (text == NULL)
+		text = "null";
+	*length = strlen(text);
+	result = malloc(*length + 1);
+	if (result != NULL)
+		memcpy(result, text, *length + 1);
+	return result;
+}
+
+/*
+ * Creates the data of the 'event' of 'eventid' for the 'object'.
+ * 'object' is released (like json_object_put) on error.
+ * Returns the created data or NULL when out of memory.
+ */
+static struct afb_evt_data *data_create(const char *event, int eventid, struct json_object *object)
+{
+	size_t length;
+	struct afb_evt_data *data;
+
+	length = strlen(event);
+	data = malloc(length + sizeof *data);
+	if (data == NULL) {
+		json_object_put(object);
+		errno = ENOMEM;
+		return NULL;
+	}
+	data->refcount = 1;
+	data->eventid = eventid;
+	data->object = object;
+	data->encodeds = NULL;
+	memcpy(data->event, event, length + 1);
+	return data;
+}
+
+/*
+ * Increases the reference count of 'data' and returns it
+ */
+struct afb_evt_data *afb_evt_data_addref(struct afb_evt_data *data)
+{
+	__atomic_add_fetch(&data->refcount, 1, __ATOMIC_RELAXED);
+	return data;
+}
+
+/*
+ * Decreases the reference count of 'data' and destroys it when it falls to zero
+ */
+void afb_evt_data_unref(struct afb_evt_data *data)
+{
+	struct afb_evt_encoded *encoded;
+
+	if (!__atomic_sub_fetch(&data->refcount, 1, __ATOMIC_ACQ_REL)) {
+		while ((encoded = data->encodeds) != NULL) {
+			data->encodeds = encoded->next;
+			free(encoded->buffer);
+			free(encoded);
+		}
+		json_object_put(data->object);
+		free(data);
+	}
+}
+
+/*
+ * Returns the name of the event of 'data'
+ */
+const char *afb_evt_data_event(struct afb_evt_data *data)
+{
+	return data->event;
+}
+
+/*
+ * Returns the id of the event of 'data' (0 for broadcasts)
+ */
+int afb_evt_data_id(struct afb_evt_data *data)
+{
+	return data->eventid;
+}
+
+/*
+ * Returns the object of 'data'. It is shared by all listeners and
+ * must not be modified nor released.
+ */
+struct json_object *afb_evt_data_object(struct afb_evt_data *data)
+{
+	return data->object;
+}
+
+/*
+ * Returns the buffer of 'data' encoded with 'encoding' and stores its
+ * length in 'length'. The encoding is made once by data and encoding,
+ * the returned buffer is valid as long as 'data' is referenced.
+ * Returns NULL on error.
+ */
+const char *afb_evt_data_encode(struct afb_evt_data *data, const struct afb_evt_encoding *encoding, size_t *length)
+{
+	struct afb_evt_encoded *head, *encoded;
+
+	/* search an existing encoding */
+	head = __atomic_load_n(&data->encodeds, __ATOMIC_ACQUIRE);
+	for (encoded = head ; encoded != NULL ; encoded = encoded->next)
+		if (encoded->encoding == encoding)
+			goto found;
+
+	/* create the encoding */
+	encoded = malloc(sizeof *encoded);
+	if (encoded == NULL)
+		goto error;
+	encoded->buffer = encoding->encode(data->event, data->eventid, data->object, &encoded->length);
+	if (encoded->buffer == NULL)
+		goto error2;
+	encoded->encoding = encoding;
+
+	/* record it unless an other thread did it meanwhile */
+	encoded->next = head;
+	while (!__atomic_compare_exchange_n(&data->encodeds, &encoded->next, encoded, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		for (head = encoded->next ; head != NULL ; head = head->next) {
+			if (head->encoding == encoding) {
+				free(encoded->buffer);
+				free(encoded);
+				encoded = head;
+				goto found;
+			}
+		}
+	}
+
+found:
+	*length = encoded->length;
+	return encoded->buffer;
+
+error2:
+	free(encoded);
+error:
+	return NULL;
+}
+
+/*
+ * Arms the timer for the earliest delayed delivery
+ */
+static void delayed_arm()
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof its);
+	if (delayed_count != 0) {
+		its.it_value.tv_sec = (time_t)(delayed[0]->next / 1000000000u);
+		its.it_value.tv_nsec = (long)(delayed[0]->next % 1000000000u);
+	}
+	timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * Moves the delayed 'watch' at 'index' to its place in the heap
+ */
+static void delayed_place(struct afb_evt_watch *watch, int index)
+{
+	int up;
+
+	/* toward the top */
+	while (index > 0 && delayed[up = (index - 1) / 2]->next > watch->next) {
+		delayed[index] = delayed[up];
+		delayed[index]->delayed = index;
+		index = up;
+	}
+
+	/* toward the bottom */
+	while ((up = 2 * index + 1) < delayed_count) {
+		if (up + 1 < delayed_count && delayed[up + 1]->next < delayed[up]->next)
+			up++;
+		if (delayed[up]->next >= watch->next)
+			break;
+		delayed[index] = delayed[up];
+		delayed[index]->delayed = index;
+		index = up;
+	}
+
+	delayed[index] = watch;
+	watch->delayed = index;
+}
+
+/*
+ * Adds the 'watch' to the heap of delayed deliveries
+ * Returns 0 in case of success or -1 on memory depletion
+ */
+static int delayed_add(struct afb_evt_watch *watch)
+{
+	int size;
+	struct afb_evt_watch **heap;
+
+	if (delayed_count == delayed_size) {
+		size = delayed_size ? 2 * delayed_size : 16;
+		heap = realloc(delayed, (unsigned)size * sizeof *heap);
+		if (heap == NULL)
+			return -1;
+		delayed = heap;
+		delayed_size = size;
+	}
+	delayed_place(watch, delayed_count++);
+	if (watch->delayed == 0)
+		delayed_arm();
+	return 0;
+}
+
+/*
+ * Removes the 'watch' from the heap of delayed deliveries
+ */
+static void delayed_remove(struct afb_evt_watch *watch)
+{
+	int index;
+
+	index = watch->delayed;
+	watch->delayed = -1;
+	if (--delayed_count != index)
+		delayed_place(delayed[delayed_count], index);
+}
+
+/*
+ * Drops the delivery pending for 'watch' if any
+ */
+static void drop_pending(struct afb_evt_watch *watch)
+{
+	if (watch->delayed >= 0)
+		delayed_remove(watch);
+	if (watch->pending != NULL) {
+		afb_evt_data_unref(watch->pending);
+		watch->pending = NULL;
+	}
+}
+
+/*
+ * Makes 'listener' ready to send its queue
+ */
+static void make_ready(struct afb_evt_listener *listener)
+{
+	if (!listener->ready) {
+		listener->ready = 1;
+		listener->next_ready = readys;
+		readys = listener;
+	}
+}
+
+/*
+ * Releases the 'count' first data of the queue of 'listener'
+ */
+static void dequeue(struct afb_evt_listener *listener, int count)
+{
+	int i;
+
+	for (i = 0 ; i < count ; i++)
+		afb_evt_data_unref(listener->queue[i]);
+	listener->queuecount -= count;
+	memmove(listener->queue, &listener->queue[count], (unsigned)listener->queuecount * sizeof *listener->queue);
+}
+
+/*
+ * Accounts 'count' data dropped
+ */
+static void drop(int count)
+{
+	stats.dropped += (unsigned)count;
+}
+
+/*
+ * Makes room in the full queue of 'listener' for 'data' following
+ * the policy of the listener.
+ * Returns 1 if the data has to be added or 0 if it is done.
+ */
+static int overflow(struct afb_evt_listener *listener, struct afb_evt_data *data)
+{
+	int i;
+	struct afb_evt_data *old;
+
+	switch (listener->policy) {
+	case afb_evt_policy_drop_newest:
+		drop(1);
+		return 0;
+
+	case afb_evt_policy_coalesce:
+		/* replace the latest data of the same event if any */
+		for (i = listener->queuecount ; i-- > 0 ; ) {
+			old = listener->queue[i];
+			if (old->eventid == data->eventid && (old->eventid != 0 || !strcmp(old->event, data->event))) {
+				listener->queue[i] = afb_evt_data_addref(data);
+				afb_evt_data_unref(old);
+				drop(1);
+				return 0;
+			}
+		}
+		/* else drop the oldest */
+		break;
+
+	case afb_evt_policy_disconnect:
+		drop(listener->queuecount + 1);
+		dequeue(listener, listener->queuecount);
+		listener->disconnect = 1;
+		stats.disconnected++;
+		make_ready(listener);
+		return 0;
+
+	default:
+		break;
+	}
+
+	/* drop the oldest */
+	i = listener->queuecount - listener->queuemax + 1;
+	drop(i);
+	dequeue(listener, i);
+	return 1;
+}
+
+/*
+ * Adds the 'data' to the queue of 'listener'. The data is sent
+ * by the next call to 'send_readys'.
+ */
+static void enqueue(struct afb_evt_listener *listener, struct afb_evt_data *data)
+{
+	int size;
+	struct afb_evt_data **queue;
+
+	/* the listener is being disconnected */
+	if (listener->disconnect) {
+		drop(1);
+		return;
+	}
+
+	/* the queue is full */
+	if (listener->queuemax > 0 && listener->queuecount >= listener->queuemax && !overflow(listener, data))
+		return;
+
+	if (listener->queuecount == listener->queuesize) {
+		size = listener->queuesize ? 2 * listener->queuesize : 8;
+		queue = realloc(listener->queue, (unsigned)size * sizeof *queue);
+		if (queue == NULL) {
+			ERROR("out of memory, event %s lost", data->event);
+			drop(1);
+			return;
+		}
+		listener->queue = queue;
+		listener->queuesize = size;
+	}
+	listener->queue[listener->queuecount++] = afb_evt_data_addref(data);
+	make_ready(listener);
+}
+
+/*
+ * Sends its queue of data to 'listener', at once if it can
+ * send many data, data by data otherwise. The data that the
+ * listener can't send remain in its queue.
+ * The mutex, held by the caller, is released while calling the
+ * listener: its flag 'sending' keeps it from being freed or sent
+ * by others meanwhile.
+ */
+static void send_queue(struct afb_evt_listener *listener)
+{
+	int i, count, size, sent, npushed;
+	struct afb_evt_data **queue, **pushed, *data;
+
+	/* disconnect the listener if required */
+	if (listener->disconnect) {
+		if (listener->disconnect == 1) {
+			listener->disconnect = 2;
+			if (listener->itf->disconnect != NULL) {
+				pthread_mutex_unlock(&mutex);
+				listener->itf->disconnect(listener->closure);
+				pthread_mutex_lock(&mutex);
+			}
+		}
+		return;
+	}
+
+	/* detach the queue: sending can push data again */
+	queue = listener->queue;
+	count = listener->queuecount;
+	size = listener->queuesize;
+	listener->queue = NULL;
+	listener->queuecount = listener->queuesize = 0;
+	listener->unblocked = 0;
+
+	pthread_mutex_unlock(&mutex);
+	if (listener->itf->batch != NULL)
+		sent = listener->itf->batch(listener->closure, queue, count);
+	else {
+		for (i = 0 ; i < count && !__atomic_load_n(&listener->dead, __ATOMIC_RELAXED) ; i++) {
+			data = queue[i];
+			if (data->eventid != 0)
+				listener->itf->push(listener->closure, data);
+			else
+				listener->itf->broadcast(listener->closure, data);
+		}
+		sent = count;
+	}
+	pthread_mutex_lock(&mutex);
+
+	/* the listener was released meanwhile */
+	if (listener->dead) {
+		for (i = 0 ; i < count ; i++)
+			afb_evt_data_unref(queue[i]);
+		free(queue);
+		return;
+	}
+
+	/* put back the queue and the data pushed meanwhile */
+	pushed = listener->queue;
+	npushed = listener->queuecount;
+	listener->queue = queue;
+	listener->queuecount = count;
+	listener->queuesize = size;
+	dequeue(listener, sent);
+	if (pushed != NULL) {
+		if (listener->queuecount + npushed > listener->queuesize) {
+			size = listener->queuecount + npushed;
+			queue = realloc(listener->queue, (unsigned)size * sizeof *queue);
+			if (queue == NULL) {
+				ERROR("out of memory, events lost");
+				drop(listener->queuecount);
+				dequeue(listener, listener->queuecount);
+			} else {
+				listener->queue = queue;
+				listener->queuesize = size;
+			}
+		}
+		if (listener->queuecount + npushed <= listener->queuesize) {
+			memcpy(&listener->queue[listener->queuecount], pushed, (unsigned)npushed * sizeof *pushed);
+			listener->queuecount += npushed;
+			free(pushed);
+		} else {
+			free(listener->queue);
+			listener->queue = pushed;
+			listener->queuecount = npushed;
+			listener->queuesize = npushed;
+		}
+	}
+
+	/* wait afb_evt_listener_unblock if not everything was sent */
+	if (sent < count && !listener->unblocked)
+		listener->blocked = 1;
+
+	/* the data left are sent by the next call to 'send_readys' */
+	if (listener->queuecount != 0 && !listener->blocked)
+		make_ready(listener);
+}
+
+/*
+ * Callback of the loop owning 'listener' for sending its queue
+ */
+static void on_posted(void *closure)
+{
+	struct afb_evt_listener *listener = closure;
+
+	pthread_mutex_lock(&mutex);
+	listener->posted = 0;
+	if (!listener->dead && (!listener->blocked || listener->disconnect) && !listener->sending) {
+		listener->sending = 1;
+		send_queue(listener);
+		listener->sending = 0;
+	}
+	if (listener->dead && !listener->ready && !listener->posted && !listener->sending)
+		free(listener);
+	send_readys();
+	pthread_mutex_unlock(&mutex);
+}
+
+/*
+ * Sends their queue to the listeners having data to send. The
+ * listeners are written by the loop owning them: the sending of the
+ * listeners of other loops is posted to their loop. The listeners
+ * being sent are left to their sender that makes them ready again
+ * if data were pushed meanwhile.
+ */
+static void send_readys()
+{
+	struct afb_evt_listener *listener;
+	struct afb_completion_queue *loop;
+
+	while ((listener = readys) != NULL) {
+		readys = listener->next_ready;
+		listener->ready = 0;
+		if (!listener->dead && (!listener->blocked || listener->disconnect) && !listener->posted && !listener->sending) {
+			loop = listener->loop ? : afb_completion_get_main_queue();
+			if (loop != NULL && loop != afb_completion_get_queue()) {
+				listener->posted = 1;
+				afb_completion_post(loop, &listener->completion, on_posted, listener);
+			} else {
+				listener->sending = 1;
+				send_queue(listener);
+				listener->sending = 0;
+			}
+		}
+		if (listener->dead && !listener->ready && !listener->posted && !listener->sending)
+			free(listener);
+	}
+}
+
+/*
+ * Pushes the 'data' to the listener of 'watch' at time 'now', taking care
+ * of the limit of rate of the watch: when the limit is reached, the data
+ * is recorded for a delayed delivery and replaces any data still pending.
+ */
+static void push_watch(struct afb_evt_watch *watch, struct afb_evt_data *data, uint64_t now)
+{
+	if (watch->interval != 0 && timerfd >= 0) {
+		if (watch->pending != NULL) {
+			/* coalesce to the latest value */
+			afb_evt_data_unref(watch->pending);
+			watch->pending = afb_evt_data_addref(data);
+			stats.coalesced++;
+			return;
+		}
+		if (now < watch->next) {
+			/* too early, delay the delivery */
+			if (delayed_add(watch) == 0) {
+				watch->pending = afb_evt_data_addref(data);
+				return;
+			}
+		}
+		watch->next = now + watch->interval;
+	}
+	enqueue(watch->listener, data);
+}
+
+/*
+ * Callback of the timer of delayed deliveries
+ */
+static int on_delayed(sd_event_source *src, int fd, uint32_t revents, void *closure)
+{
+	uint64_t count, now;
+	struct afb_evt_watch *watch;
+	struct afb_evt_data *data;
+
+	read(fd, &count, sizeof count);
+
+	pthread_mutex_lock(&mutex);
+	now = get_now();
+	while (delayed_count != 0 && (watch = delayed[0])->next <= now) {
+		delayed_remove(watch);
+		data = watch->pending;
+		watch->pending = NULL;
+		watch->next = now + watch->interval;
+		enqueue(watch->listener, data);
+		afb_evt_data_unref(data);
+	}
+	delayed_arm();
+	send_readys();
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+/*
+ * Dispatches the 'data' to the queues of its listeners at time 'now'
+ */
+static void dispatch(struct afb_evt_data *data, uint64_t now)
+{
+	struct afb_evt_watch *watch;
+	struct afb_evt_event *evt;
+
+	if (data->eventid == 0) {
+		/* broadcast to the listeners having a matching pattern */
+		match_broadcast(data->event, data);
+	} else if (events_size != 0) {
+		/* push, the event may have been destroyed meanwhile */
+		evt = *search_event_id(data->eventid);
+		if (evt != NULL)
+			for (watch = evt->watchs ; watch != NULL ; watch = watch->next_by_event)
+				if (watch->activity != 0)
+					push_watch(watch, data, now);
+	}
+}
+
+/*
+ * Callback of the eventfd of the dispatch: dispatches the data pushed
+ * since the previous call. The whole stack is taken at once and
+ * reverted to dispatch the data in the order of their push. Then
+ * each listener sends the data of its queue at once.
+ */
+static int on_dispatch(sd_event_source *src, int fd, uint32_t revents, void *closure)
+{
+	uint64_t count, now;
+	struct afb_evt_data *stack, *fifo, *data;
+
+	/* read before draining so that no wake up is lost */
+	read(fd, &count, sizeof count);
+	stack = __atomic_exchange_n(&incoming, NULL, __ATOMIC_ACQUIRE);
+	fifo = NULL;
+	while (stack != NULL) {
+		data = stack;
+		stack = data->next;
+		data->next = fifo;
+		fifo = data;
+	}
+
+	pthread_mutex_lock(&mutex);
+	now = get_now();
+	while (fifo != NULL) {
+		data = fifo;
+		fifo = data->next;
+		dispatch(data, now);
+		afb_evt_data_unref(data);
+	}
+	send_readys();
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+/*
+ * Posts the 'data' for its dispatch by the event loop. Without
+ * event loop, the data is dispatched immediately.
+ * The reference of 'data' is given to the dispatch.
+ */
+static void post(struct afb_evt_data *data)
+{
+	struct afb_evt_data *head;
+	uint64_t one = 1;
+
+	if (dispatchfd < 0) {
+		pthread_mutex_lock(&mutex);
+		dispatch(data, get_now());
+		send_readys();
+		pthread_mutex_unlock(&mutex);
+		afb_evt_data_unref(data);
+		return;
+	}
+
+	head = __atomic_load_n(&incoming, __ATOMIC_RELAXED);
+	do {
+		data->next = head;
+	} while (!__atomic_compare_exchange_n(&incoming, &head, data, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	/* wakes up the loop only when the stack was empty */
+	if (head == NULL)
+		write(dispatchfd, &one, sizeof one);
+}
 
 /*
- * Structure for associating events and listeners
+ * Makes the event 'loop' dispatching the events to the listeners
+ * and handling the delayed deliveries of the limits of rate.
+ * Until then, the events are dispatched by the pushing thread
+ * and the rates aren't limited.
+ * Returns 0 in case of success or -1 in case of error.
  */
-struct afb_evt_watch {
+int afb_evt_set_event_loop(struct sd_event *loop)
+{
+	int rc;
 
-	/* the event */
-	struct afb_evt_event *event;
+	timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (timerfd < 0) {
+		ERROR("can't create the timer of events: %m");
+		goto error;
+	}
+	rc = sd_event_add_io(loop, &timersrc, timerfd, EPOLLIN, on_delayed, NULL);
+	if (rc < 0) {
+		errno = -rc;
+		ERROR("can't add the timer of events to the loop: %m");
+		goto error2;
+	}
 
-	/* link to the next listener for the same event */
-	struct afb_evt_watch *next_by_event;
+	rc = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	if (rc < 0) {
+		ERROR("can't create the eventfd of events: %m");
+		goto error3;
+	}
+	dispatchfd = rc;
+	rc = sd_event_add_io(loop, &dispatchsrc, dispatchfd, EPOLLIN, on_dispatch, NULL);
+	if (rc < 0) {
+		errno = -rc;
+		ERROR("can't add the eventfd of events to the loop: %m");
+		goto error4;
+	}
+	return 0;
 
-	/* the listener */
-	struct afb_evt_listener *listener;
+error4:
+	close(dispatchfd);
+	dispatchfd = -1;
+error3:
+	sd_event_source_unref(timersrc);
+	timersrc = NULL;
+error2:
+	close(timerfd);
+	timerfd = -1;
+error:
+	return -1;
+}
 
-	/* link to the next event for the same listener */
-	struct afb_evt_watch *next_by_listener;
+/*
+ * Adds a limit of rate of delivery of events as given by 'spec': EVENT=RATE
+ * where EVENT is the name of the event or a prefix of names when it
+ * ends with * and RATE is the count of deliveries per second. The events
+ * pushed faster are coalesced to their latest value.
+ * Returns 0 in case of success or -1 on error.
+ */
+int afb_evt_add_rate(const char *spec)
+{
+	const char *eq;
+	char *end;
+	double rate;
+	size_t length;
+	struct event_rate *er, **prv;
+
+	eq = strchr(spec, '=');
+	if (eq == NULL || eq == spec)
+		goto invalid;
+	rate = strtod(eq + 1, &end);
+	if (end == eq + 1 || *end != 0 || !(rate > 0))
+		goto invalid;
+
+	length = (size_t)(eq - spec);
+	er = malloc(length + sizeof *er);
+	if (er == NULL) {
+		ERROR("out of memory");
+		return -1;
+	}
+	er->next = NULL;
+	er->interval = (uint64_t)(1e9 / rate) ? : 1;
+	er->prefix = spec[length - 1] == '*';
+	er->length = length - (size_t)er->prefix;
+	memcpy(er->name, spec, er->length);
+	er->name[er->length] = 0;
+
+	/* the first set limit wins */
+	prv = &event_rates;
+	while (*prv != NULL)
+		prv = &(*prv)->next;
+	*prv = er;
+	return 0;
 
-	/* activity */
-	unsigned activity;
-};
+invalid:
+	ERROR("invalid rate of event %s, expected EVENT=RATE", spec);
+	errno = EINVAL;
+	return -1;
+}
 
-/* declare functions */
-static int evt_broadcast(struct afb_evt_event *evt, struct json_object *obj);
-static int evt_push(struct afb_evt_event *evt, struct json_object *obj);
-static void evt_destroy(struct afb_evt_event *evt);
-static const char *evt_name(struct afb_evt_event *evt);
+/*
+ * Returns the minimal nanoseconds between two deliveries of the event 'name'
+ * or 0 when not limited.
+ */
+static uint64_t search_interval(const char *name)
+{
+	struct event_rate *er;
 
-/* the interface for events */
-static struct afb_event_itf afb_evt_event_itf = {
-	.broadcast = (void*)evt_broadcast,
-	.push = (void*)evt_push,
-	.drop = (void*)evt_destroy,
-	.name = (void*)evt_name
-};
+	for (er = event_rates ; er != NULL ; er = er->next)
+		if (er->prefix ? !strncmp(er->name, name, er->length) : !strcmp(er->name, name))
+			return er->interval;
+	return 0;
+}
 
-/* head of the list of listeners */
-static struct afb_evt_listener *listeners = NULL;
+/*
+ * Sets the default queue of the listeners as given by 'spec': SIZE[:POLICY]
+ * where SIZE is the maximum count of events waiting to be sent (0 for no
+ * limit) and POLICY, what to do when the queue is full, is one of
+ * drop-oldest (default), drop-newest, coalesce or disconnect.
+ * Returns 0 in case of success or -1 on error.
+ */
+int afb_evt_set_queue(const char *spec)
+{
+	char *end;
+	long size;
+	int policy;
+
+	size = strtol(spec, &end, 10);
+	if (end == spec || size < 0 || size > INT32_MAX)
+		goto invalid;
+	policy = afb_evt_policy_drop_oldest;
+	if (*end == ':') {
+		for (policy = 0 ; policy < (int)(sizeof policy_names / sizeof *policy_names) ; policy++)
+			if (!strcmp(end + 1, policy_names[policy]))
+				break;
+		if (policy == (int)(sizeof policy_names / sizeof *policy_names))
+			goto invalid;
+	} else if (*end != 0)
+		goto invalid;
 
-/* handling id of events */
-static struct afb_evt_event *events = NULL;
-static int event_id_counter = 0;
-static int event_id_wrapped = 0;
+	default_queuemax = (int)size;
+	default_policy = (enum afb_evt_policy)policy;
+	return 0;
+
+invalid:
+	ERROR("invalid queue of events %s, expected SIZE[:drop-oldest|drop-newest|coalesce|disconnect]", spec);
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Gets the counters of events in 'result'
+ */
+void afb_evt_get_stats(struct afb_evt_stats *result)
+{
+	pthread_mutex_lock(&mutex);
+	*result = stats;
+	pthread_mutex_unlock(&mutex);
+}
 
 /*
  * Broadcasts the event 'evt' with its 'object'
@@ -125,48 +1212,226 @@ static int evt_broadcast(struct afb_evt_event *evt, struct json_object *object)
 /*
  * Broadcasts the 'event' with its 'object'
  * 'object' is released (like json_object_put)
- * Returns the count of listener having receive the event.
+ * Returns the count of listener that will receive the event.
  */
 int afb_evt_broadcast(const char *event, struct json_object *object)
+{
+	int result;
+	struct afb_evt_data *data;
+
+	data = data_create(event, 0, object);
+	if (data == NULL)
+		return -1;
+
+	pthread_mutex_lock(&mutex);
+	result = match_broadcast(event, NULL);
+	pthread_mutex_unlock(&mutex);
+	post(data);
+	return result;
+}
+
+/*
+ * Gives the broadcast 'data' to the listeners of 'interests'
+ * not yet marked. Gives nothing when 'data' is NULL.
+ * Returns the count of listeners newly marked.
+ */
+static int give_broadcast(struct broadcast_interest *interests, struct afb_evt_data *data)
 {
 	int result;
 	struct afb_evt_listener *listener;
 
 	result = 0;
-	listener = listeners;
-	while(listener) {
-		if (listener->itf->broadcast != NULL) {
-			listener->itf->broadcast(listener->closure, event, 0, json_object_get(object));
+	for ( ; interests != NULL ; interests = interests->next_by_node) {
+		listener = interests->listener;
+		if (listener->broadcastmark != broadcast_mark) {
+			listener->broadcastmark = broadcast_mark;
+			if (data != NULL)
+				enqueue(listener, data);
 			result++;
 		}
-		listener = listener->next;
 	}
-	json_object_put(object);
 	return result;
 }
 
+/*
+ * Searches the listeners having a pattern matching the name 'event'
+ * by walking the prefix tree along the name and gives them the
+ * broadcast 'data' if not NULL.
+ * Returns the count of listeners matching.
+ */
+static int match_broadcast(const char *event, struct afb_evt_data *data)
+{
+	int result;
+	struct broadcast_node *node;
+
+	broadcast_mark++;
+	node = &broadcast_root;
+	result = give_broadcast(node->prefixes, data);
+	while (*event) {
+		node = node->children;
+		while (node != NULL && node->key != *event)
+			node = node->next;
+		if (node == NULL)
+			return result;
+		event++;
+		result += give_broadcast(node->prefixes, data);
+	}
+	return result + give_broadcast(node->exacts, data);
+}
+
+/*
+ * Removes the node of the prefix tree of broadcasts for 'interest'
+ * and the nodes of its parents that become useless.
+ */
+static void remove_interest(struct broadcast_interest *interest)
+{
+	struct broadcast_interest **prvi;
+	struct broadcast_node *node, *parent, **prvn;
+
+	node = interest->node;
+	prvi = interest->prefix ? &node->prefixes : &node->exacts;
+	while (*prvi != interest)
+		prvi = &(*prvi)->next_by_node;
+	*prvi = interest->next_by_node;
+	free(interest);
+
+	while ((parent = node->parent) != NULL
+	    && node->children == NULL && node->exacts == NULL && node->prefixes == NULL) {
+		prvn = &parent->children;
+		while (*prvn != node)
+			prvn = &(*prvn)->next;
+		*prvn = node->next;
+		free(node);
+		node = parent;
+	}
+}
+
+/*
+ * Searches the node of the prefix tree of broadcasts for the 'length'
+ * first characters of 'name', creating it if 'create' isn't null.
+ * Returns the node found or NULL if not found or out of memory.
+ */
+static struct broadcast_node *search_node(const char *name, size_t length, int create)
+{
+	struct broadcast_node *node, *child;
+
+	node = &broadcast_root;
+	while (length) {
+		child = node->children;
+		while (child != NULL && child->key != *name)
+			child = child->next;
+		if (child == NULL) {
+			if (!create)
+				return NULL;
+			child = calloc(1, sizeof *child);
+			if (child == NULL)
+				return NULL;
+			child->parent = node;
+			child->next = node->children;
+			child->key = *name;
+			node->children = child;
+		}
+		node = child;
+		name++;
+		length--;
+	}
+	return node;
+}
+
+/*
+ * Searches the interest of 'listener' for the 'pattern'
+ * Returns a pointer to the link to the interest, pointing NULL if not found.
+ */
+static struct broadcast_interest **search_interest(struct afb_evt_listener *listener, const char *pattern)
+{
+	size_t length;
+	int prefix;
+	struct broadcast_node *node;
+	struct broadcast_interest **prv;
+
+	length = strlen(pattern);
+	prefix = length != 0 && pattern[length - 1] == '*';
+	node = search_node(pattern, length - (size_t)prefix, 0);
+	prv = &listener->interests;
+	while (*prv != NULL && ((*prv)->node != node || (*prv)->prefix != prefix))
+		prv = &(*prv)->next_by_listener;
+	return prv;
+}
+
+/*
+ * Makes the 'listener' receiving the broadcasts of the events whose
+ * name matches 'pattern': either the name itself or, when ending
+ * with *, a prefix of the names ("*" alone matching all the names).
+ * Returns 0 in case of success or else -1.
+ */
+int afb_evt_add_broadcast(struct afb_evt_listener *listener, const char *pattern)
+{
+	size_t length;
+	struct broadcast_node *node;
+	struct broadcast_interest *interest;
+
+	/* check parameter */
+	if (listener->itf->broadcast == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&mutex);
+
+	/* already added? */
+	if (*search_interest(listener, pattern) != NULL)
+		goto end;
+
+	/* not found, allocate a new */
+	interest = malloc(sizeof *interest);
+	if (interest == NULL)
+		goto nomem;
+	length = strlen(pattern);
+	interest->prefix = length != 0 && pattern[length - 1] == '*';
+	node = search_node(pattern, length - (size_t)interest->prefix, 1);
+	if (node == NULL)
+		goto nomem2;
+
+	/* initialise and link */
+	interest->listener = listener;
+	interest->node = node;
+	if (interest->prefix) {
+		interest->next_by_node = node->prefixes;
+		node->prefixes = interest;
+	} else {
+		interest->next_by_node = node->exacts;
+		node->exacts = interest;
+	}
+	interest->next_by_listener = listener->interests;
+	listener->interests = interest;
+end:
+	pthread_mutex_unlock(&mutex);
+	return 0;
+
+nomem2:
+	free(interest);
+nomem:
+	pthread_mutex_unlock(&mutex);
+	errno = ENOMEM;
+	return -1;
+}
+
 /*
  * Pushes the event 'evt' with 'obj' to its listeners
  * 'obj' is released (like json_object_put)
- * Returns the count of listener taht received the event.
+ * Returns the count of listener that will receive the event.
  */
 static int evt_push(struct afb_evt_event *evt, struct json_object *obj)
 {
 	int result;
-	struct afb_evt_watch *watch;
-	struct afb_evt_listener *listener;
+	struct afb_evt_data *data;
 
-	result = 0;
-	watch = evt->watchs;
-	while(watch) {
-		listener = watch->listener;
-		assert(listener->itf->push != NULL);
-		if (watch->activity != 0)
-			listener->itf->push(listener->closure, evt->name, evt->id, json_object_get(obj));
-		watch = watch->next_by_event;
-		result++;
-	}
-	json_object_put(obj);
+	data = data_create(evt->name, evt->id, obj);
+	if (data == NULL)
+		return -1;
+
+	result = __atomic_load_n(&evt->watchcount, __ATOMIC_RELAXED);
+	post(data);
 	return result;
 }
 
@@ -178,12 +1443,52 @@ static const char *evt_name(struct afb_evt_event *evt)
 	return evt->name;
 }
 
+/*
+ * Returns the link pointing to the watch of 'evt' in the index of 'listener'
+ * or pointing to NULL when 'listener' doesn't watch 'evt'
+ */
+static struct afb_evt_watch **search_watch(struct afb_evt_listener *listener, struct afb_evt_event *evt)
+{
+	struct afb_evt_watch **prv;
+
+	prv = &listener->watchs[hash_address(evt) & (listener->watchsize - 1)];
+	while (*prv != NULL && (*prv)->event != evt)
+		prv = &(*prv)->next_by_listener;
+	return prv;
+}
+
+/*
+ * Doubles the size of the index of watchs of 'listener'
+ * Returns 0 in case of success or -1 on memory depletion
+ */
+static int grow_watchs(struct afb_evt_listener *listener)
+{
+	unsigned idx, size;
+	struct afb_evt_watch **watchs, *watch, **prv;
+
+	size = listener->watchsize ? 2 * listener->watchsize : 4;
+	watchs = calloc(size, sizeof *watchs);
+	if (watchs == NULL)
+		return -1;
+	for (idx = 0 ; idx < listener->watchsize ; idx++) {
+		while ((watch = listener->watchs[idx]) != NULL) {
+			listener->watchs[idx] = watch->next_by_listener;
+			prv = &watchs[hash_address(watch->event) & (size - 1)];
+			watch->next_by_listener = *prv;
+			*prv = watch;
+		}
+	}
+	free(listener->watchs);
+	listener->watchs = watchs;
+	listener->watchsize = size;
+	return 0;
+}
+
 /*
  * remove the 'watch'
  */
 static void remove_watch(struct afb_evt_watch *watch)
 {
-	struct afb_evt_watch **prv;
 	struct afb_evt_event *evt;
 	struct afb_evt_listener *listener;
 
@@ -194,47 +1499,113 @@ static void remove_watch(struct afb_evt_watch *watch)
 		listener->itf->remove(listener->closure, evt->name, evt->id);
 
 	/* unlink the watch for its event */
-	prv = &evt->watchs;
-	while(*prv != watch)
-		prv = &(*prv)->next_by_event;
-	*prv = watch->next_by_event;
+	*watch->prev_by_event = watch->next_by_event;
+	if (watch->next_by_event != NULL)
+		watch->next_by_event->prev_by_event = watch->prev_by_event;
+	__atomic_sub_fetch(&evt->watchcount, 1, __ATOMIC_RELAXED);
 
 	/* unlink the watch for its listener */
-	prv = &listener->watchs;
-	while(*prv != watch)
-		prv = &(*prv)->next_by_listener;
-	*prv = watch->next_by_listener;
+	*search_watch(listener, evt) = watch->next_by_listener;
+	listener->watchcount--;
 
 	/* recycle memory */
+	drop_pending(watch);
 	free(watch);
 }
 
+/*
+ * Returns the link pointing to the event of 'id' in the table
+ * of events or pointing to NULL if there is no such event
+ */
+static struct afb_evt_event **search_event_id(int id)
+{
+	struct afb_evt_event **prv;
+
+	prv = &events_by_id[(unsigned)id & (events_size - 1)];
+	while (*prv != NULL && (*prv)->id != id)
+		prv = &(*prv)->next_by_id;
+	return prv;
+}
+
+/*
+ * Returns the link pointing to the event 'evt' in the table
+ * of events or pointing to NULL if 'evt' isn't a valid event
+ */
+static struct afb_evt_event **search_event_address(struct afb_evt_event *evt)
+{
+	struct afb_evt_event **prv;
+
+	prv = &events_by_address[hash_address(evt) & (events_size - 1)];
+	while (*prv != NULL && *prv != evt)
+		prv = &(*prv)->next_by_address;
+	return prv;
+}
+
+/*
+ * Doubles the size of the tables of events
+ * Returns 0 in case of success or -1 on memory depletion
+ */
+static int grow_events()
+{
+	unsigned idx, size;
+	struct afb_evt_event **byid, **byaddr, *evt, **prv;
+
+	size = events_size ? 2 * events_size : 64;
+	byid = calloc(size, sizeof *byid);
+	byaddr = calloc(size, sizeof *byaddr);
+	if (byid == NULL || byaddr == NULL) {
+		free(byid);
+		free(byaddr);
+		return -1;
+	}
+	for (idx = 0 ; idx < events_size ; idx++) {
+		while ((evt = events_by_id[idx]) != NULL) {
+			events_by_id[idx] = evt->next_by_id;
+			prv = &byid[(unsigned)evt->id & (size - 1)];
+			evt->next_by_id = *prv;
+			*prv = evt;
+		}
+		while ((evt = events_by_address[idx]) != NULL) {
+			events_by_address[idx] = evt->next_by_address;
+			prv = &byaddr[hash_address(evt) & (size - 1)];
+			evt->next_by_address = *prv;
+			*prv = evt;
+		}
+	}
+	free(events_by_id);
+	free(events_by_address);
+	events_by_id = byid;
+	events_by_address = byaddr;
+	events_size = size;
+	return 0;
+}
+
 /*
  * Destroys the event 'evt'
  */
 static void evt_destroy(struct afb_evt_event *evt)
 {
 	struct afb_evt_event **prv;
-	if (evt != NULL) {
-		/* removes the event if valid! */
-		prv = &events;
-		while (*prv != NULL) {
-			if (*prv != evt)
-				prv = &(*prv)->next;
-			else {
-				/* valid, unlink */
-				*prv = evt->next;
-
-				/* removes all watchers */
-				while(evt->watchs != NULL)
-					remove_watch(evt->watchs);
-
-				/* free */
-				free(evt);
-				break;
-			}
+
+	/* removes the event if valid! */
+	pthread_mutex_lock(&mutex);
+	if (evt != NULL && events_size != 0) {
+		prv = search_event_address(evt);
+		if (*prv != NULL) {
+			/* valid, unlink */
+			*prv = evt->next_by_address;
+			*search_event_id(evt->id) = evt->next_by_id;
+			events_count--;
+
+			/* removes all watchers */
+			while(evt->watchs != NULL)
+				remove_watch(evt->watchs);
+
+			/* free */
+			free(evt);
 		}
 	}
+	pthread_mutex_unlock(&mutex);
 }
 
 /*
@@ -244,7 +1615,13 @@ static void evt_destroy(struct afb_evt_event *evt)
 struct afb_event afb_evt_create_event(const char *name)
 {
 	size_t len;
-	struct afb_evt_event *evt;
+	struct afb_evt_event *evt, **prv;
+
+	pthread_mutex_lock(&mutex);
+
+	/* makes room for the event */
+	if (events_count >= events_size && grow_events() < 0)
+		goto error;
 
 	/* allocates the id */
 	do {
@@ -252,12 +1629,7 @@ struct afb_event afb_evt_create_event(const char *name)
 			event_id_wrapped = 1;
 			event_id_counter = 1024; /* heuristic: small numbers are not destroyed */
 		}
-		if (!event_id_wrapped)
-			break;
-		evt = events;
-		while(evt != NULL && evt->id != event_id_counter)
-			evt = evt->next;
-	} while (evt != NULL);
+	} while (event_id_wrapped && *search_event_id(event_id_counter) != NULL);
 
 	/* allocates the event */
 	len = strlen(name);
@@ -266,16 +1638,26 @@ struct afb_event afb_evt_create_event(const char *name)
 		goto error;
 
 	/* initialize the event */
-	evt->next = events;
 	evt->watchs = NULL;
+	evt->watchcount = 0;
 	evt->id = event_id_counter;
 	assert(evt->id > 0);
 	memcpy(evt->name, name, len + 1);
-	events = evt;
+
+	/* records the event */
+	prv = &events_by_id[(unsigned)evt->id & (events_size - 1)];
+	evt->next_by_id = *prv;
+	*prv = evt;
+	prv = &events_by_address[hash_address(evt) & (events_size - 1)];
+	evt->next_by_address = *prv;
+	*prv = evt;
+	events_count++;
+	pthread_mutex_unlock(&mutex);
 
 	/* returns the event */
 	return (struct afb_event){ .itf = &afb_evt_event_itf, .closure = evt };
 error:
+	pthread_mutex_unlock(&mutex);
 	return (struct afb_event){ .itf = NULL, .closure = NULL };
 }
 
@@ -295,6 +1677,44 @@ int afb_evt_event_id(struct afb_event event)
 	return (event.itf != &afb_evt_event_itf) ? 0 : ((struct afb_evt_event *)event.closure)->id;
 }
 
+/*
+ * Returns the link pointing to the listener of 'itf' and 'closure'
+ * in the table of listeners or pointing to NULL if there is none
+ */
+static struct afb_evt_listener **search_listener(const struct afb_evt_itf *itf, void *closure)
+{
+	struct afb_evt_listener **prv;
+
+	prv = &listeners_by_closure[hash_address(closure) & (listeners_size - 1)];
+	while (*prv != NULL && ((*prv)->itf != itf || (*prv)->closure != closure))
+		prv = &(*prv)->next_by_closure;
+	return prv;
+}
+
+/*
+ * Doubles the size of the table of listeners
+ * Returns 0 in case of success or -1 on memory depletion
+ */
+static int grow_listeners()
+{
+	unsigned size;
+	struct afb_evt_listener **table, *listener, **prv;
+
+	size = listeners_size ? 2 * listeners_size : 16;
+	table = calloc(size, sizeof *table);
+	if (table == NULL)
+		return -1;
+	for (listener = listeners ; listener != NULL ; listener = listener->next) {
+		prv = &table[hash_address(listener->closure) & (size - 1)];
+		listener->next_by_closure = *prv;
+		*prv = listener;
+	}
+	free(listeners_by_closure);
+	listeners_by_closure = table;
+	listeners_size = size;
+	return 0;
+}
+
 /*
  * Returns an instance of the listener defined by the 'send' callback
  * and the 'closure'.
@@ -302,27 +1722,63 @@ int afb_evt_event_id(struct afb_event event)
  */
 struct afb_evt_listener *afb_evt_listener_create(const struct afb_evt_itf *itf, void *closure)
 {
-	struct afb_evt_listener *listener;
+	struct afb_evt_listener *listener, **prv;
+
+	pthread_mutex_lock(&mutex);
 
 	/* search if an instance already exists */
-	listener = listeners;
-	while (listener != NULL) {
-		if (listener->itf == itf && listener->closure == closure)
-			return afb_evt_listener_addref(listener);
-		listener = listener->next;
+	if (listeners_size != 0) {
+		listener = *search_listener(itf, closure);
+		if (listener != NULL) {
+			afb_evt_listener_addref(listener);
+			goto end;
+		}
 	}
 
+	/* makes room for the listener */
+	listener = NULL;
+	if (listeners_count >= listeners_size && grow_listeners() < 0)
+		goto end;
+
 	/* allocates */
 	listener = calloc(1, sizeof *listener);
 	if (listener != NULL) {
 		/* init */
-		listener->next = listeners;
 		listener->itf = itf;
 		listener->closure = closure;
 		listener->watchs = NULL;
+		listener->watchsize = 0;
+		listener->watchcount = 0;
 		listener->refcount = 1;
+		listener->queue = NULL;
+		listener->queuecount = 0;
+		listener->queuesize = 0;
+		listener->ready = 0;
+		listener->queuemax = default_queuemax;
+		listener->policy = default_policy;
+		listener->blocked = 0;
+		listener->disconnect = 0;
+		listener->sending = 0;
+		listener->unblocked = 0;
+		listener->loop = afb_completion_get_queue();
+		listener->posted = 0;
+		listener->dead = 0;
+		listener->interests = NULL;
+		listener->broadcastmark = 0;
+
+		/* link */
+		listener->next = listeners;
+		listener->prev = &listeners;
+		if (listeners != NULL)
+			listeners->prev = &listener->next;
 		listeners = listener;
+		prv = &listeners_by_closure[hash_address(closure) & (listeners_size - 1)];
+		listener->next_by_closure = *prv;
+		*prv = listener;
+		listeners_count++;
 	}
+end:
+	pthread_mutex_unlock(&mutex);
 	return listener;
 }
 
@@ -331,7 +1787,7 @@ struct afb_evt_listener *afb_evt_listener_create(const struct afb_evt_itf *itf,
  */
 struct afb_evt_listener *afb_evt_listener_addref(struct afb_evt_listener *listener)
 {
-	listener->refcount++;
+	__atomic_add_fetch(&listener->refcount, 1, __ATOMIC_RELAXED);
 	return listener;
 }
 
@@ -341,49 +1797,85 @@ struct afb_evt_listener *afb_evt_listener_addref(struct afb_evt_listener *listen
  */
 void afb_evt_listener_unref(struct afb_evt_listener *listener)
 {
-	if (0 == --listener->refcount) {
-		struct afb_evt_listener **prv;
+	unsigned idx;
+	struct broadcast_interest *interest;
+
+	pthread_mutex_lock(&mutex);
+	if (0 == __atomic_sub_fetch(&listener->refcount, 1, __ATOMIC_ACQ_REL)) {
 
 		/* remove the watchers */
-		while (listener->watchs != NULL)
-			remove_watch(listener->watchs);
+		for (idx = 0 ; idx < listener->watchsize ; idx++)
+			while (listener->watchs[idx] != NULL)
+				remove_watch(listener->watchs[idx]);
+		free(listener->watchs);
 
 		/* unlink the listener */
-		prv = &listeners;
-		while (*prv != listener)
-			prv = &(*prv)->next;
-		*prv = listener->next;
+		*listener->prev = listener->next;
+		if (listener->next != NULL)
+			listener->next->prev = listener->prev;
+		*search_listener(listener->itf, listener->closure) = listener->next_by_closure;
+		listeners_count--;
+
+		/* remove the patterns of broadcasts */
+		while ((interest = listener->interests) != NULL) {
+			listener->interests = interest->next_by_listener;
+			remove_interest(interest);
+		}
 
-		/* free the listener */
-		free(listener);
+		/* free the listener and its queue, later if it is in use */
+		for (idx = 0 ; idx < (unsigned)listener->queuecount ; idx++)
+			afb_evt_data_unref(listener->queue[idx]);
+		free(listener->queue);
+		listener->queue = NULL;
+		listener->queuecount = listener->queuesize = 0;
+		if (listener->ready || listener->sending || listener->posted)
+			__atomic_store_n(&listener->dead, 1, __ATOMIC_RELAXED);
+		else
+			free(listener);
 	}
+	pthread_mutex_unlock(&mutex);
 }
 
 /*
- * Makes the 'listener' watching 'event'
- * Returns 0 in case of success or else -1.
+ * Tells that 'listener', whose 'batch' didn't send all its data,
+ * can send again: its waiting data are sent.
  */
-int afb_evt_add_watch(struct afb_evt_listener *listener, struct afb_event event)
+void afb_evt_listener_unblock(struct afb_evt_listener *listener)
 {
-	struct afb_evt_watch *watch;
-	struct afb_evt_event *evt;
-
-	/* check parameter */
-	if (event.itf != &afb_evt_event_itf || listener->itf->push == NULL) {
-		errno = EINVAL;
-		return -1;
+	pthread_mutex_lock(&mutex);
+	if (listener->sending)
+		listener->unblocked = 1;
+	else if (listener->blocked) {
+		listener->blocked = 0;
+		if (listener->queuecount != 0) {
+			make_ready(listener);
+			send_readys();
+		}
 	}
+	pthread_mutex_unlock(&mutex);
+}
+
+/*
+ * Makes the 'listener' watching 'evt' with at least 'interval'
+ * nanoseconds between deliveries (0 for no limit).
+ * Returns 0 in case of success or else -1.
+ */
+static int add_watch(struct afb_evt_listener *listener, struct afb_evt_event *evt, uint64_t interval)
+{
+	struct afb_evt_watch *watch, **prv;
 
 	/* search the existing watch for the listener */
-	evt = event.closure;
-	watch = listener->watchs;
-	while(watch != NULL) {
-		if (watch->event == evt)
+	if (listener->watchsize != 0) {
+		watch = *search_watch(listener, evt);
+		if (watch != NULL)
 			goto found;
-		watch = watch->next_by_listener;
 	}
 
-	/* not found, allocate a new */
+	/* not found, makes room and allocate a new */
+	if (listener->watchcount >= listener->watchsize && grow_watchs(listener) < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
 	watch = malloc(sizeof *watch);
 	if (watch == NULL) {
 		errno = ENOMEM;
@@ -393,20 +1885,53 @@ int afb_evt_add_watch(struct afb_evt_listener *listener, struct afb_event event)
 	/* initialise and link */
 	watch->event = evt;
 	watch->next_by_event = evt->watchs;
+	watch->prev_by_event = &evt->watchs;
+	if (evt->watchs != NULL)
+		evt->watchs->prev_by_event = &watch->next_by_event;
+	evt->watchs = watch;
+	__atomic_add_fetch(&evt->watchcount, 1, __ATOMIC_RELAXED);
 	watch->listener = listener;
-	watch->next_by_listener = listener->watchs;
+	prv = &listener->watchs[hash_address(evt) & (listener->watchsize - 1)];
+	watch->next_by_listener = *prv;
+	*prv = watch;
+	listener->watchcount++;
 	watch->activity = 0;
-	evt->watchs = watch;
-	listener->watchs = watch;
+	watch->delayed = -1;
+	watch->next = 0;
+	watch->pending = NULL;
 
 found:
 	if (watch->activity == 0 && listener->itf->add != NULL)
 		listener->itf->add(listener->closure, evt->name, evt->id);
 	watch->activity++;
+	watch->interval = interval;
 
 	return 0;
 }
 
+/*
+ * Makes the 'listener' watching 'event' with the limit of rate
+ * set for the event if any.
+ * Returns 0 in case of success or else -1.
+ */
+int afb_evt_add_watch(struct afb_evt_listener *listener, struct afb_event event)
+{
+	int rc;
+	struct afb_evt_event *evt;
+
+	/* check parameter */
+	if (event.itf != &afb_evt_event_itf || listener->itf->push == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	evt = event.closure;
+	pthread_mutex_lock(&mutex);
+	rc = add_watch(listener, evt, search_interval(evt->name));
+	pthread_mutex_unlock(&mutex);
+	return rc;
+}
+
 /*
  * Avoids the 'listener' to watch 'event'
  * Returns 0 in case of success or else -1.
@@ -424,20 +1949,23 @@ int afb_evt_remove_watch(struct afb_evt_listener *listener, struct afb_event eve
 
 	/* search the existing watch */
 	evt = event.closure;
-	watch = listener->watchs;
-	while(watch != NULL) {
-		if (watch->event == evt) {
-			/* found: remove it */
-			if (watch->activity != 0) {
-				watch->activity--;
-				if (watch->activity == 0 && listener->itf->remove != NULL)
-					listener->itf->remove(listener->closure, evt->name, evt->id);
-			}
-			return 0;
+	pthread_mutex_lock(&mutex);
+	watch = listener->watchsize == 0 ? NULL : *search_watch(listener, evt);
+	if (watch == NULL) {
+		pthread_mutex_unlock(&mutex);
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* found: deactivate it */
+	if (watch->activity != 0) {
+		watch->activity--;
+		if (watch->activity == 0) {
+			drop_pending(watch);
+			if (listener->itf->remove != NULL)
+				listener->itf->remove(listener->closure, evt->name, evt->id);
 		}
-		watch = watch->next_by_listener;
 	}
-	errno = ENOENT;
-	return -1;
+	pthread_mutex_unlock(&mutex);
+	return 0;
 }
-
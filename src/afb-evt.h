@@ -17,15 +17,61 @@
 
 #pragma once
 
+#include <stddef.h>
+
 struct afb_event;
 struct AFB_clientCtx;
+struct sd_event;
 
 struct afb_evt_listener;
+struct afb_evt_data;
+
+/*
+ * What to do when the queue of events of a listener is full
+ */
+enum afb_evt_policy
+{
+	afb_evt_policy_drop_oldest,	/* drop the oldest event waiting */
+	afb_evt_policy_drop_newest,	/* drop the event being queued */
+	afb_evt_policy_coalesce,	/* replace the waiting value of the same event or drop the oldest */
+	afb_evt_policy_disconnect	/* drop all and disconnect the listener */
+};
 
+/*
+ * An encoding of the data of events for a protocol. The encoding of the
+ * data of an event is made once and shared by all the listeners using
+ * the same encoding. 'encode' returns a buffer allocated with malloc
+ * and stores its length in 'length' or returns NULL on error.
+ */
+struct afb_evt_encoding
+{
+	char *(*encode)(const char *event, int eventid, struct json_object *object, size_t *length);
+};
+
+/* plain JSON text of the object of the event, "null" when none */
+extern const struct afb_evt_encoding afb_evt_encoding_json;
+
+/*
+ * The data of an event given to the listeners is only valid during
+ * the call of 'push', 'broadcast' or 'batch': use 'afb_evt_data_addref'
+ * to keep it. The events are sent by the event loop of the thread
+ * that created the listener (the main loop for threads without loop)
+ * so that a listener is only written by its own loop. When set,
+ * 'batch' receives at once all the data to send to the listener,
+ * the broadcasts being the data of id 0. It returns the
+ * count of data sent: the remaining ones wait until the listener
+ * calls 'afb_evt_listener_unblock' when it can send again.
+ * 'disconnect' is called when the queue of the listener overflows
+ * with the policy afb_evt_policy_disconnect. The broadcasts are only
+ * given to the listeners having added a matching pattern with
+ * 'afb_evt_add_broadcast'.
+ */
 struct afb_evt_itf
 {
-	void (*push)(void *closure, const char *event, int eventid, struct json_object *object);
-	void (*broadcast)(void *closure, const char *event, int eventid, struct json_object *object);
+	void (*push)(void *closure, struct afb_evt_data *data);
+	void (*broadcast)(void *closure, struct afb_evt_data *data);
+	int (*batch)(void *closure, struct afb_evt_data **datas, int count);
+	void (*disconnect)(void *closure);
 	void (*add)(void *closure, const char *event, int eventid);
 	void (*remove)(void *closure, const char *event, int eventid);
 };
@@ -36,11 +82,32 @@ extern int afb_evt_broadcast(const char *event, struct json_object *object);
 
 extern struct afb_evt_listener *afb_evt_listener_addref(struct afb_evt_listener *listener);
 extern void afb_evt_listener_unref(struct afb_evt_listener *listener);
+extern void afb_evt_listener_unblock(struct afb_evt_listener *listener);
 
 extern struct afb_event afb_evt_create_event(const char *name);
 extern const char *afb_evt_event_name(struct afb_event event);
 extern int afb_evt_event_id(struct afb_event event);
 
+extern struct afb_evt_data *afb_evt_data_addref(struct afb_evt_data *data);
+extern void afb_evt_data_unref(struct afb_evt_data *data);
+extern const char *afb_evt_data_event(struct afb_evt_data *data);
+extern int afb_evt_data_id(struct afb_evt_data *data);
+extern struct json_object *afb_evt_data_object(struct afb_evt_data *data);
+extern const char *afb_evt_data_encode(struct afb_evt_data *data, const struct afb_evt_encoding *encoding, size_t *length);
+
 extern int afb_evt_add_watch(struct afb_evt_listener *listener, struct afb_event event);
 extern int afb_evt_remove_watch(struct afb_evt_listener *listener, struct afb_event event);
 
+extern int afb_evt_add_broadcast(struct afb_evt_listener *listener, const char *pattern);
+
+struct afb_evt_stats
+{
+	unsigned long coalesced;	/* count of data replaced by a more recent one before delivery */
+	unsigned long dropped;		/* count of data dropped because of full queues */
+	unsigned long disconnected;	/* count of listeners disconnected because of full queues */
+};
+
+extern int afb_evt_set_event_loop(struct sd_event *loop);
+extern int afb_evt_add_rate(const char *spec);
+extern int afb_evt_set_queue(const char *spec);
+extern void afb_evt_get_stats(struct afb_evt_stats *stats);
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <json-c/json.h>
 
@@ -60,7 +61,7 @@ struct afb_hook_req {
 	struct hook_req_observer *observers; /* observers */
 	struct afb_context *context; /* context of the request */
 	struct afb_req req; /* the request hookd */
-	unsigned refcount; /* reference count proxy for request */
+	unsigned refcount; /* atomic reference count proxy for request */
 	char name[1]; /* hook info for the request */
 };
 
@@ -79,6 +80,9 @@ static unsigned hook_count = 0;
 /* list of hooks */
 static struct afb_hook *list_of_hooks = NULL;
 
+/* protection of the list of hooks */
+static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+
 /******************************************************************************
  * section: default callbacks for tracing requests
  *****************************************************************************/
@@ -252,13 +256,13 @@ static struct afb_hook_req_itf hook_req_default_itf = {
 
 static void hook_req_addref(struct afb_hook_req *tr)
 {
-	tr->refcount++;
+	__atomic_add_fetch(&tr->refcount, 1, __ATOMIC_RELAXED);
 }
 
 static void hook_req_unref(struct afb_hook_req *tr)
 {
 	struct hook_req_observer *o1, *o2;
-	if (!--tr->refcount) {
+	if (!__atomic_sub_fetch(&tr->refcount, 1, __ATOMIC_ACQ_REL)) {
 		TRACE_REQX(end, tr);
 		afb_req_unref(tr->req);
 		o1 = tr->observers;
@@ -280,9 +284,7 @@ static struct afb_hook_req *hook_req_create(struct afb_req req, struct afb_conte
 	tr = malloc(sizeof *tr + 8 + lenapi + lenverb);
 	if (tr != NULL) {
 		/* get the call id */
-		id = ++hook_count;
-		if (id == 1000000)
-			id = hook_count = 1;
+		id = 1 + __atomic_fetch_add(&hook_count, 1, __ATOMIC_RELAXED) % 999999;
 
 		/* init hook */
 		tr->observers = NULL;
@@ -500,6 +502,7 @@ struct afb_req afb_hook_req_call(struct afb_req req, struct afb_context *context
 	struct afb_hook_req *tr;
 	struct afb_hook *hook;
 
+	pthread_rwlock_rdlock(&rwlock);
 	hook = list_of_hooks;
 	if (hook) {
 		tr = NULL;
@@ -522,6 +525,7 @@ struct afb_req afb_hook_req_call(struct afb_req req, struct afb_context *context
 			TRACE_REQX(begin, tr);
 		}
 	}
+	pthread_rwlock_unlock(&rwlock);
 
 	return req;
 }
@@ -552,26 +556,31 @@ struct afb_hook *afb_hook_req_create(const char *api, const char *verb, struct A
 	hook->reqitf = itf ? itf : &hook_req_default_itf;
 	hook->closure = closure;
 
+	pthread_rwlock_wrlock(&rwlock);
 	hook->next = list_of_hooks;
 	list_of_hooks = hook;
+	pthread_rwlock_unlock(&rwlock);
 	return hook;
 }
 
 struct afb_hook *afb_hook_addref(struct afb_hook *hook)
 {
-	hook->refcount++;
+	__atomic_add_fetch(&hook->refcount, 1, __ATOMIC_RELAXED);
 	return hook;
 }
 
 void afb_hook_unref(struct afb_hook *hook)
 {
-	if (!--hook->refcount) {
+	if (!__atomic_sub_fetch(&hook->refcount, 1, __ATOMIC_ACQ_REL)) {
 		/* unlink */
-		struct afb_hook **prv = &list_of_hooks;
+		struct afb_hook **prv;
+		pthread_rwlock_wrlock(&rwlock);
+		prv = &list_of_hooks;
 		while (*prv && *prv != hook)
 			prv = &(*prv)->next;
 		if(*prv)
 			*prv = hook->next;
+		pthread_rwlock_unlock(&rwlock);
 
 		/* free */
 		free(hook->api);
@@ -38,6 +38,8 @@
 #include "afb-context.h"
 #include "afb-hreq.h"
 #include "afb-subcall.h"
+#include "afb-thread.h"
+#include "afb-rate.h"
 #include "session.h"
 #include "verbose.h"
 #include "locale-root.h"
@@ -158,13 +160,32 @@ static int validsubpath(const char *subpath)
 	return 1;
 }
 
+/* queues the pending response of 'hreq', called by its event loop */
+static void hreq_queue_response(struct afb_hreq *hreq)
+{
+	MHD_queue_response(hreq->connection, hreq->status, hreq->response);
+	MHD_destroy_response(hreq->response);
+	hreq->response = NULL;
+
+	hreq->replied = 1;
+	if (hreq->suspended != 0) {
+		extern void run_micro_httpd(struct afb_hsrv *hsrv);
+		MHD_resume_connection (hreq->connection);
+		hreq->suspended = 0;
+		run_micro_httpd(hreq->hsrv);
+	}
+	afb_hreq_unref(hreq);
+}
+
 static void afb_hreq_reply_v(struct afb_hreq *hreq, unsigned status, struct MHD_Response *response, va_list args)
 {
 	char *cookie;
 	const char *k, *v;
 
-	if (hreq->replied != 0)
+	if (hreq->replied != 0 || __atomic_exchange_n(&hreq->replying, 1, __ATOMIC_ACQ_REL) != 0) {
+		MHD_destroy_response(response);
 		return;
+	}
 
 	k = va_arg(args, const char *);
 	while (k != NULL) {
@@ -177,16 +198,12 @@ static void afb_hreq_reply_v(struct afb_hreq *hreq, unsigned status, struct MHD_
 		MHD_add_response_header(response, MHD_HTTP_HEADER_SET_COOKIE, cookie);
 		free(cookie);
 	}
-	MHD_queue_response(hreq->connection, status, response);
-	MHD_destroy_response(response);
 
-	hreq->replied = 1;
-	if (hreq->suspended != 0) {
-		extern void run_micro_httpd(struct afb_hsrv *hsrv);
-		MHD_resume_connection (hreq->connection);
-		hreq->suspended = 0;
-		run_micro_httpd(hreq->hsrv);
-	}
+	/* queues the response from the event loop */
+	hreq->status = status;
+	hreq->response = response;
+	afb_hreq_addref(hreq);
+	afb_completion_post(hreq->queue, &hreq->completion, (void*)hreq_queue_response, hreq);
 }
 
 void afb_hreq_reply(struct afb_hreq *hreq, unsigned status, struct MHD_Response *response, ...)
@@ -301,14 +318,14 @@ static const char *mimetype_fd_name(int fd, const char *filename)
 
 void afb_hreq_addref(struct afb_hreq *hreq)
 {
-	hreq->refcount++;
+	__atomic_add_fetch(&hreq->refcount, 1, __ATOMIC_RELAXED);
 }
 
 void afb_hreq_unref(struct afb_hreq *hreq)
 {
 	struct hreq_data *data;
 
-	if (hreq == NULL || --hreq->refcount)
+	if (hreq == NULL || __atomic_sub_fetch(&hreq->refcount, 1, __ATOMIC_ACQ_REL))
 		return;
 
 	if (hreq->postform != NULL)
@@ -898,6 +915,7 @@ static void req_reply(struct afb_hreq *hreq, unsigned retcode, const char *statu
 	struct json_object *reply;
 	const char *reqid;
 	struct MHD_Response *response;
+	char retry[12];
 
 	reqid = afb_hreq_get_argument(hreq, long_key_for_reqid);
 	if (reqid == NULL)
@@ -906,12 +924,24 @@ static void req_reply(struct afb_hreq *hreq, unsigned retcode, const char *statu
 	reply = afb_msg_json_reply(status, info, resp, &hreq->context, reqid);
 
 	response = MHD_create_response_from_callback((uint64_t)strlen(json_object_to_json_string_ext(reply, JSON_C_TO_STRING_PLAIN)), SIZE_RESPONSE_BUFFER, (void*)send_json_cb, reply, (void*)json_object_put);
-	afb_hreq_reply(hreq, retcode, response, NULL);
+	if (retcode == MHD_HTTP_SERVICE_UNAVAILABLE) {
+		snprintf(retry, sizeof retry, "%d", afb_thread_retry_after());
+		afb_hreq_reply(hreq, retcode, response, MHD_HTTP_HEADER_RETRY_AFTER, retry, NULL);
+	} else if (retcode == MHD_HTTP_TOO_MANY_REQUESTS) {
+		snprintf(retry, sizeof retry, "%d", afb_rate_retry_after());
+		afb_hreq_reply(hreq, retcode, response, MHD_HTTP_HEADER_RETRY_AFTER, retry, NULL);
+	} else
+		afb_hreq_reply(hreq, retcode, response, NULL);
 }
 
 static void req_fail(struct afb_hreq *hreq, const char *status, const char *info)
 {
-	req_reply(hreq, MHD_HTTP_OK, status, info, NULL);
+	if (status == afb_thread_busy)
+		req_reply(hreq, MHD_HTTP_SERVICE_UNAVAILABLE, status, info, NULL);
+	else if (status == afb_rate_too_many)
+		req_reply(hreq, MHD_HTTP_TOO_MANY_REQUESTS, status, info, NULL);
+	else
+		req_reply(hreq, MHD_HTTP_OK, status, info, NULL);
 }
 
 static void req_success(struct afb_hreq *hreq, json_object *obj, const char *info)
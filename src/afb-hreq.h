@@ -17,6 +17,8 @@
 
 #pragma once
 
+#include "afb-completion.h"
+
 struct AFB_clientCtx;
 struct json_object;
 struct hreq_data;
@@ -32,7 +34,7 @@ struct afb_hreq {
 	 * is an implicit convertion to struct afb_context
 	 */
 	struct afb_context context;
-	int refcount;
+	int refcount;	/* atomic: held by the connection and by each pending job */
 	struct afb_hsrv *hsrv;
 	const char *cacheTimeout;
 	struct MHD_Connection *connection;
@@ -51,6 +53,11 @@ struct afb_hreq {
 	struct hreq_data *data;
 	struct json_object *json;
 	int upgrade;
+	int replying;	/* atomic: set by the first reply */
+	unsigned status;	/* the status of the pending response */
+	struct MHD_Response *response;	/* the pending response */
+	struct afb_completion_queue *queue;	/* the completions of the loop of the connection */
+	struct afb_completion completion;	/* queues the response from that loop */
 };
 
 extern int afb_hreq_unprefix(struct afb_hreq *request, const char *prefix, size_t length);
@@ -133,11 +133,12 @@ static int access_handler(
 		hreq->refcount = 1;
 		hreq->hsrv = hsrv;
 		hreq->cacheTimeout = hsrv->cache_to;
-		hreq->reqid = ++global_reqids;
+		hreq->reqid = __atomic_add_fetch(&global_reqids, 1, __ATOMIC_RELAXED);
 		hreq->scanned = 0;
 		hreq->suspended = 0;
 		hreq->replied = 0;
 		hreq->connection = connection;
+		hreq->queue = afb_completion_get_queue();
 		hreq->method = method;
 		hreq->version = version;
 		hreq->lang = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT_LANGUAGE);
@@ -389,12 +390,24 @@ int afb_hsrv_set_cache_timeout(struct afb_hsrv *hsrv, int duration)
 	return 1;
 }
 
-int afb_hsrv_start(struct afb_hsrv *hsrv, uint16_t port, unsigned int connection_timeout)
+/*
+ * Starts the server 'hsrv' on the event loop of the calling thread.
+ * When 'reuseport' isn't zero, the listening socket is opened with
+ * SO_REUSEPORT so that other servers can share the 'port'.
+ */
+int afb_hsrv_start(struct afb_hsrv *hsrv, uint16_t port, unsigned int connection_timeout, int reuseport)
 {
 	sd_event_source *evsrc;
 	int rc;
 	struct MHD_Daemon *httpd;
 	const union MHD_DaemonInfo *info;
+	static struct MHD_OptionItem no_options[] = {
+		{ MHD_OPTION_END, 0, NULL }
+	};
+	static struct MHD_OptionItem reuse_options[] = {
+		{ MHD_OPTION_LISTENING_ADDRESS_REUSE, 1, NULL },
+		{ MHD_OPTION_END, 0, NULL }
+	};
 
 	httpd = MHD_start_daemon(
 		MHD_USE_EPOLL_LINUX_ONLY | MHD_USE_TCP_FASTOPEN | MHD_USE_DEBUG | MHD_USE_SUSPEND_RESUME,
@@ -403,6 +416,7 @@ int afb_hsrv_start(struct afb_hsrv *hsrv, uint16_t port, unsigned int connection
 		access_handler, hsrv,	/* Http Request Call back + extra attribute */
 		MHD_OPTION_NOTIFY_COMPLETED, end_handler, hsrv,
 		MHD_OPTION_CONNECTION_TIMEOUT, connection_timeout,
+		MHD_OPTION_ARRAY, reuseport ? reuse_options : no_options,
 		MHD_OPTION_END);	/* options-end */
 
 	if (httpd == NULL) {
@@ -27,6 +27,7 @@
 #include "afb-context.h"
 #include "afb-hreq.h"
 #include "afb-apis.h"
+#include "afb-rate.h"
 #include "session.h"
 #include "afb-websock.h"
 
@@ -46,7 +47,7 @@ int afb_hswitch_apis(struct afb_hreq *hreq, void *data)
 
 	if (afb_hreq_init_context(hreq) < 0)
 		afb_hreq_reply_error(hreq, MHD_HTTP_INTERNAL_SERVER_ERROR);
-	else
+	else if (afb_rate_check(afb_hreq_to_req(hreq), &hreq->context, api, lenapi, verb, lenverb))
 		afb_apis_call(afb_hreq_to_req(hreq), &hreq->context, api, lenapi, verb, lenverb);
 	return 1;
 }
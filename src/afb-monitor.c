@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2016 "IoT.bzh"
+ * Author José Bollo <jose.bollo@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+
+#include <json-c/json.h>
+
+#include <afb/afb-req-itf.h>
+
+#include "afb-monitor.h"
+#include "afb-apis.h"
+#include "afb-context.h"
+#include "afb-thread.h"
+#include "afb-rate.h"
+#include "afb-evt.h"
+#include "session.h"
+#include "verbose.h"
+
+/* name of the api of monitoring */
+static const char monitor_api_name[] = "monitor";
+
+/*
+ * Adds to 'obj' the integer 'value' with the 'key'
+ */
+static void add_int(struct json_object *obj, const char *key, int64_t value)
+{
+	json_object_object_add(obj, key, json_object_new_int64(value));
+}
+
+/*
+ * Returns the statistics of the pool of threads
+ */
+static struct json_object *stats_threads()
+{
+	struct afb_thread_stats stats;
+	struct json_object *obj;
+
+	afb_thread_get_stats(&stats);
+	obj = json_object_new_object();
+	add_int(obj, "workers-min", stats.workers_min);
+	add_int(obj, "workers-max", stats.workers_max);
+	add_int(obj, "workers-idle", stats.workers_idle);
+	add_int(obj, "grow-wait", stats.grow_wait);
+	add_int(obj, "jobs-max", stats.jobs_max);
+	add_int(obj, "started", stats.started);
+	add_int(obj, "running", stats.running);
+	add_int(obj, "pending", stats.pending);
+	add_int(obj, "wait", stats.wait);
+	return obj;
+}
+
+/*
+ * Returns the statistics of the store of sessions
+ */
+static struct json_object *stats_sessions()
+{
+	struct ctxStoreStats stats;
+	struct json_object *obj;
+
+	ctxStoreGetStats(&stats);
+	obj = json_object_new_object();
+	add_int(obj, "count", stats.count);
+	add_int(obj, "max", stats.max);
+	add_int(obj, "memory", (int64_t)stats.memory);
+	add_int(obj, "budget", (int64_t)stats.budget);
+	add_int(obj, "evictions", (int64_t)stats.evictions);
+	add_int(obj, "rejections", (int64_t)stats.rejections);
+	return obj;
+}
+
+/*
+ * Returns the counters of the limits of rate
+ */
+static struct json_object *stats_rates()
+{
+	struct afb_rate_stats stats;
+	struct json_object *obj;
+
+	afb_rate_get_stats(&stats);
+	obj = json_object_new_object();
+	add_int(obj, "accepted", (int64_t)stats.accepted);
+	add_int(obj, "session-rejects", (int64_t)stats.session_rejects);
+	add_int(obj, "verb-rejects", (int64_t)stats.verb_rejects);
+	return obj;
+}
+
+/*
+ * Returns the counters of the deliveries of events
+ */
+static struct json_object *stats_events()
+{
+	struct afb_evt_stats stats;
+	struct json_object *obj;
+
+	afb_evt_get_stats(&stats);
+	obj = json_object_new_object();
+	add_int(obj, "coalesced", (int64_t)stats.coalesced);
+	add_int(obj, "dropped", (int64_t)stats.dropped);
+	add_int(obj, "disconnected", (int64_t)stats.disconnected);
+	return obj;
+}
+
+/*
+ * Replies to the verb 'stats' with the statistics of the daemon
+ */
+static void monitor_stats(struct afb_req req)
+{
+	struct json_object *obj;
+
+	obj = json_object_new_object();
+	json_object_object_add(obj, "threads", stats_threads());
+	json_object_object_add(obj, "sessions", stats_sessions());
+	json_object_object_add(obj, "rates", stats_rates());
+	json_object_object_add(obj, "events", stats_events());
+	afb_req_success(req, obj, NULL);
+}
+
+static void call_cb(void *closure, struct afb_req req, struct afb_context *context, const char *verb, size_t lenverb)
+{
+	if (lenverb == 5 && !strncasecmp(verb, "stats", 5))
+		monitor_stats(req);
+	else
+		afb_req_fail_f(req, "unknown-verb", "verb %.*s unknown within api %s", (int)lenverb, verb, monitor_api_name);
+}
+
+static int service_start_cb(void *closure, int share_session, int onneed)
+{
+	return 0;
+}
+
+/*
+ * Adds the api 'monitor' whose verb 'stats' returns the
+ * statistics of the daemon.
+ * Returns 0 in case of success or -1 on error.
+ */
+int afb_monitor_init()
+{
+	return afb_apis_add(monitor_api_name, (struct afb_api){ .closure = NULL, .call = call_cb, .service_start = service_start_cb });
+}
+
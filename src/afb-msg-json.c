@@ -17,12 +17,16 @@
 
 #define _GNU_SOURCE
 
+#include <string.h>
+
 #include <json-c/json.h>
 
 #include <afb/afb-req-itf.h>
 
 #include "afb-msg-json.h"
 #include "afb-context.h"
+#include "afb-thread.h"
+#include "afb-rate.h"
 
 
 struct json_object *afb_msg_json_reply(const char *status, const char *info, struct json_object *resp, struct afb_context *context, const char *reqid)
@@ -46,6 +50,11 @@ struct json_object *afb_msg_json_reply(const char *status, const char *info, str
 	if (info != NULL)
 		json_object_object_add(request, "info", json_object_new_string(info));
 
+	if (status == afb_thread_busy)
+		json_object_object_add(request, "retry", json_object_new_int(afb_thread_retry_after()));
+	else if (status == afb_rate_too_many)
+		json_object_object_add(request, "retry", json_object_new_int(afb_rate_retry_after()));
+
 	if (reqid != NULL)
 		json_object_object_add(request, "reqid", json_object_new_string(reqid));
 
@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2016 "IoT.bzh"
+ * Author José Bollo <jose.bollo@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <afb/afb-req-itf.h>
+
+#include "afb-rate.h"
+#include "afb-context.h"
+#include "session.h"
+#include "verbose.h"
+
+/*
+ * A limit of rate is a token bucket implemented as a generic cell
+ * rate algorithm: a bucket only records the theoretical time of
+ * the next call, what is updated without lock.
+ */
+struct limit
+{
+	uint64_t interval;	/* nanoseconds between two calls at the sustained rate */
+	uint64_t tolerance;	/* nanoseconds of advance allowed for bursts */
+};
+
+/*
+ * The limit of a verb
+ */
+struct verb_limit
+{
+	struct limit limit;	/* the limit */
+	const char *api;	/* name of the api */
+	size_t lenapi;		/* length of the name of the api */
+	const char *verb;	/* name of the verb */
+	size_t lenverb;		/* length of the name of the verb */
+};
+
+/* the limit of each session, not limited when interval is 0 */
+static struct limit session_limit;
+
+/* the limits of verbs */
+static struct verb_limit *verb_limits = NULL;
+static int verb_count = 0;
+
+/* the counters (atomic) */
+static struct afb_rate_stats stats;
+
+/* key of the cookie of the buckets of a session */
+static const char buckets_cookie_key[] = "rate";
+
+/* status of the calls rejected by the limits */
+const char afb_rate_too_many[] = "too-many-requests";
+
+/* seconds to wait computed by the last rejection of the thread */
+static _Thread_local int retry_after;
+
+/*
+ * Reads in 'text' the limit 'RATE[:BURST]' of RATE calls per second
+ * with bursts of BURST calls (default is RATE) and stores it in 'limit'.
+ * Returns 0 in case of success or -1 on error.
+ */
+static int parse_limit(const char *text, struct limit *limit)
+{
+	double rate;
+	unsigned long burst;
+	char *end;
+
+	rate = strtod(text, &end);
+	if (end == text || !(rate > 0))
+		goto error;
+	if (*end != ':')
+		burst = rate < 1 ? 1 : (unsigned long)rate;
+	else {
+		text = end + 1;
+		burst = strtoul(text, &end, 10);
+		if (end == text || burst == 0)
+			goto error;
+	}
+	if (*end != 0)
+		goto error;
+
+	limit->interval = (uint64_t)(1e9 / rate);
+	if (limit->interval == 0)
+		limit->interval = 1;
+	limit->tolerance = (burst - 1) * limit->interval;
+	return 0;
+
+error:
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Sets the limit of calls of each session as given by 'spec': RATE[:BURST]
+ * Returns 0 in case of success or -1 on error.
+ */
+int afb_rate_set_session(const char *spec)
+{
+	if (parse_limit(spec, &session_limit) < 0) {
+		ERROR("invalid rate of sessions %s, expected RATE[:BURST]", spec);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Adds a limit of calls of a verb for each session as given
+ * by 'spec': API/VERB=RATE[:BURST]
+ * Returns 0 in case of success or -1 on error.
+ */
+int afb_rate_add_verb(const char *spec)
+{
+	char *api, *verb, *rate;
+	struct verb_limit *limits;
+
+	api = strdup(spec);
+	if (api == NULL) {
+		ERROR("out of memory");
+		goto error;
+	}
+	verb = strchr(api, '/');
+	rate = verb == NULL ? NULL : strchr(verb, '=');
+	if (rate == NULL || verb == api || rate == verb + 1) {
+		ERROR("invalid rate of verb %s, expected API/VERB=RATE[:BURST]", spec);
+		goto error2;
+	}
+	*verb++ = 0;
+	*rate++ = 0;
+
+	limits = realloc(verb_limits, ((unsigned)verb_count + 1) * sizeof *limits);
+	if (limits == NULL) {
+		ERROR("out of memory");
+		goto error2;
+	}
+	verb_limits = limits;
+	limits = &verb_limits[verb_count];
+	if (parse_limit(rate, &limits->limit) < 0) {
+		ERROR("invalid rate of verb %s, expected API/VERB=RATE[:BURST]", spec);
+		goto error2;
+	}
+	limits->api = api;
+	limits->lenapi = strlen(api);
+	limits->verb = verb;
+	limits->lenverb = strlen(verb);
+	verb_count++;
+	return 0;
+
+error2:
+	free(api);
+error:
+	return -1;
+}
+
+/*
+ * Takes a call from the bucket 'tat' of 'limit' at time 'now'.
+ * Returns 0 if the call is allowed or, when over the limit,
+ * the nanoseconds to wait before the call is allowed.
+ */
+static uint64_t take(uint64_t *tat, const struct limit *limit, uint64_t now)
+{
+	uint64_t cur, next;
+
+	cur = __atomic_load_n(tat, __ATOMIC_RELAXED);
+	do {
+		next = cur > now ? cur : now;
+		if (next - now > limit->tolerance)
+			return next - now - limit->tolerance;
+		next += limit->interval;
+	} while (!__atomic_compare_exchange_n(tat, &cur, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return 0;
+}
+
+/*
+ * Gives back to the bucket 'tat' of 'limit' a call taken by 'take'.
+ */
+static void give(uint64_t *tat, const struct limit *limit)
+{
+	__atomic_sub_fetch(tat, limit->interval, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the buckets of 'session': the one of the session
+ * followed by one for each limit of verb. Returns NULL
+ * when out of memory.
+ */
+static uint64_t *get_buckets(struct AFB_clientCtx *session)
+{
+	uint64_t *buckets, *result;
+
+	result = ctxClientCookieGet(session, buckets_cookie_key);
+	if (result == NULL) {
+		buckets = calloc(1 + (unsigned)verb_count, sizeof *buckets);
+		if (buckets != NULL) {
+			result = ctxClientCookieAdd(session, buckets_cookie_key, buckets, free);
+			if (result != buckets)
+				free(buckets);
+		}
+	}
+	return result;
+}
+
+/*
+ * Checks that the call of 'verb' of 'api' by the session of 'context'
+ * doesn't exceed the limits.
+ * Returns 0 if the call is allowed or, when it must be rejected,
+ * the nanoseconds to wait.
+ */
+static uint64_t check(struct afb_context *context, const char *api, size_t lenapi, const char *verb, size_t lenverb)
+{
+	int i;
+	uint64_t *buckets, *bucket, now, wait;
+	const struct limit *limit;
+	struct timespec ts;
+
+	/* a failure to allocate the buckets doesn't reject the call */
+	buckets = get_buckets(context->session);
+	if (buckets == NULL)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+
+	/* the limit of the verb if any */
+	bucket = NULL;
+	limit = NULL;
+	for (i = 0 ; i < verb_count ; i++) {
+		if (verb_limits[i].lenapi == lenapi && !strncasecmp(verb_limits[i].api, api, lenapi)
+		 && verb_limits[i].lenverb == lenverb && !strncasecmp(verb_limits[i].verb, verb, lenverb)) {
+			bucket = &buckets[1 + i];
+			limit = &verb_limits[i].limit;
+			wait = take(bucket, limit, now);
+			if (wait != 0) {
+				__atomic_add_fetch(&stats.verb_rejects, 1, __ATOMIC_RELAXED);
+				return wait;
+			}
+			break;
+		}
+	}
+
+	/* the limit of the session */
+	if (session_limit.interval != 0) {
+		wait = take(&buckets[0], &session_limit, now);
+		if (wait != 0) {
+			/* the rejected call is not charged to the verb */
+			if (bucket != NULL)
+				give(bucket, limit);
+			__atomic_add_fetch(&stats.session_rejects, 1, __ATOMIC_RELAXED);
+			return wait;
+		}
+	}
+
+	__atomic_add_fetch(&stats.accepted, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Checks the limits of the call of 'verb' of 'api' by the session of
+ * 'context', a call coming from a client. Calls made by bindings are
+ * not limited.
+ * Returns 1 if the call is allowed. Otherwise, fails 'req' with the
+ * status afb_rate_too_many and returns 0.
+ */
+int afb_rate_check(struct afb_req req, struct afb_context *context, const char *api, size_t lenapi, const char *verb, size_t lenverb)
+{
+	uint64_t wait;
+
+	/* nothing to do without limits */
+	if (session_limit.interval == 0 && verb_count == 0)
+		return 1;
+
+	wait = check(context, api, lenapi, verb, lenverb);
+	if (wait == 0)
+		return 1;
+
+	retry_after = (int)((wait + 999999999) / 1000000000);
+	afb_req_fail(req, afb_rate_too_many, "rate limit exceeded");
+	return 0;
+}
+
+/*
+ * Returns the count of seconds to wait before calling again
+ * as computed by the last rejection of the calling thread.
+ */
+int afb_rate_retry_after()
+{
+	return retry_after;
+}
+
+/*
+ * Gets the counters of the limits in 'result'
+ */
+void afb_rate_get_stats(struct afb_rate_stats *result)
+{
+	result->accepted = __atomic_load_n(&stats.accepted, __ATOMIC_RELAXED);
+	result->session_rejects = __atomic_load_n(&stats.session_rejects, __ATOMIC_RELAXED);
+	result->verb_rejects = __atomic_load_n(&stats.verb_rejects, __ATOMIC_RELAXED);
+}
+
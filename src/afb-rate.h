@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2016 "IoT.bzh"
+ * Author: José Bollo <jose.bollo@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+struct afb_context;
+struct afb_req;
+
+/*
+ * The status of the calls rejected by the limits. It is
+ * compared by address so that the same status given by
+ * a binding isn't taken as a rejection.
+ */
+extern const char afb_rate_too_many[];
+
+struct afb_rate_stats
+{
+	unsigned long accepted;        /* count of calls accepted */
+	unsigned long session_rejects; /* count of calls rejected by the limit of sessions */
+	unsigned long verb_rejects;    /* count of calls rejected by the limit of a verb */
+};
+
+extern int afb_rate_set_session(const char *spec);
+extern int afb_rate_add_verb(const char *spec);
+
+extern int afb_rate_check(struct afb_req req, struct afb_context *context, const char *api, size_t lenapi, const char *verb, size_t lenverb);
+extern int afb_rate_retry_after();
+
+extern void afb_rate_get_stats(struct afb_rate_stats *stats);
+
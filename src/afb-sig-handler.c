@@ -41,6 +41,10 @@ static void on_signal_error(int signum)
 {
 	sigset_t sigset;
 
+	// ignore alarms of jobs already completed
+	if (signum == SIGALRM && !afb_thread_timer_expired())
+		return;
+
 	// unlock signal to allow a new signal to come
 	if (error_handler != NULL) {
 		sigemptyset(&sigset);
@@ -71,7 +71,7 @@ struct afb_subcall
 	 */
 	struct afb_context context;
 	struct afb_context *original_context;
-	int refcount;
+	int refcount;	/* atomic: the subcall holds a reference on 'req' until freed */
 	struct json_object *args;
 	struct afb_req req;
 	void (*callback)(void*, int, struct json_object*);
@@ -80,12 +80,12 @@ struct afb_subcall
 
 static void subcall_addref(struct afb_subcall *subcall)
 {
-	subcall->refcount++;
+	__atomic_add_fetch(&subcall->refcount, 1, __ATOMIC_RELAXED);
 }
 
 static void subcall_unref(struct afb_subcall *subcall)
 {
-	if (0 == --subcall->refcount) {
+	if (0 == __atomic_sub_fetch(&subcall->refcount, 1, __ATOMIC_ACQ_REL)) {
 		json_object_put(subcall->args);
 		afb_req_unref(subcall->req);
 		free(subcall);
@@ -59,12 +59,12 @@ struct svc_req
 	/* the service */
 	struct afb_svc *svc;
 
-	/* the count of references to the request */
+	/* the count of references to the request (atomic) */
 	int refcount;
 };
 
 /* functions for services */
-static void svc_on_event(struct afb_svc *svc, const char *event, int eventid, struct json_object *object);
+static void svc_on_event(struct afb_svc *svc, struct afb_evt_data *data);
 static void svc_call(struct afb_svc *svc, const char *api, const char *verb, struct json_object *args,
 				void (*callback)(void*, int, struct json_object*), void *closure);
 
@@ -140,6 +140,8 @@ struct afb_svc *afb_svc_create(int share_session, int (*init)(struct afb_service
 		svc->listener = afb_evt_listener_create(&evt_itf, svc);
 		if (svc->listener == NULL)
 			goto error3;
+		if (afb_evt_add_broadcast(svc->listener, "*") < 0)
+			goto error4;
 	}
 
 	/* initialises the svc now */
@@ -163,10 +165,9 @@ error:
 /*
  * Propagates the event to the service
  */
-static void svc_on_event(struct afb_svc *svc, const char *event, int eventid, struct json_object *object)
+static void svc_on_event(struct afb_svc *svc, struct afb_evt_data *data)
 {
-	svc->on_event(event, object);
-	json_object_put(object);
+	svc->on_event(afb_evt_data_event(data), afb_evt_data_object(data));
 }
 
 /*
@@ -196,12 +197,12 @@ static void svc_call(struct afb_svc *svc, const char *api, const char *verb, str
 
 static void svcreq_addref(struct svc_req *svcreq)
 {
-	svcreq->refcount++;
+	__atomic_add_fetch(&svcreq->refcount, 1, __ATOMIC_RELAXED);
 }
 
 static void svcreq_unref(struct svc_req *svcreq)
 {
-	if (0 == --svcreq->refcount) {
+	if (0 == __atomic_sub_fetch(&svcreq->refcount, 1, __ATOMIC_ACQ_REL)) {
 		afb_context_disconnect(&svcreq->context);
 		free(svcreq);
 	}
@@ -18,11 +18,12 @@
 #define _GNU_SOURCE
 
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/syscall.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
 #include <assert.h>
 
@@ -32,13 +33,40 @@
 #include "afb-sig-handler.h"
 #include "verbose.h"
 
+/* mean waiting time of jobs in ms above which a thread is added */
+#define GROW_WAIT_MS 10
+
+/* count of free jobs taken at once by a thread, that gives back its free jobs above twice this count */
+#define JOB_MAGAZINE 32
+
+/* maximum delay in seconds advised before retrying a rejected request */
+#define RETRY_AFTER_MAX 60
+
+/* timing wheel of the watchdog: 4 levels of 64 slots of 100 ms */
+#define WHEEL_TICK_MS 100
+#define WHEEL_BITS    6
+#define WHEEL_SLOTS   (1 << WHEEL_BITS)
+#define WHEEL_LEVELS  4
+
+struct job;
+
+/* double ended queue of jobs */
+struct deque
+{
+	pthread_mutex_t mutex; /* protection of the deque */
+	struct job *head;      /* first job (popped by owner and thieves) */
+	struct job *tail;      /* last job */
+};
+
 /* control of threads */
 struct thread
 {
-	pthread_t tid;     /* the thread id */
-	unsigned stop: 1;  /* stop request */
-	unsigned ended: 1; /* ended status */
-	unsigned works: 1; /* is it processing a job? */
+	pthread_t tid;      /* the thread id */
+	int alive;          /* is the thread started? */
+	int stop;           /* stop request */
+	int works;          /* is it processing a job? */
+	unsigned victim;    /* next thread to rob */
+	struct deque deque; /* jobs to be processed by the thread */
 };
 
 /* describes pending job */
@@ -47,30 +75,295 @@ struct job
 	void (*callback)(struct afb_req req); /* processing callback */
 	struct afb_req req; /* request to be processed */
 	int timeout;        /* timeout in second for processing the request */
-	int blocked;        /* is an other request blocking this one ? */
-	void *group;        /* group of the request */
+	long stamp;         /* time of queuing in ms */
+	struct afb_thread_group *group; /* group of the request */
+	struct afb_thread_client *client; /* client of the request */
 	struct job *next;   /* link to the next job enqueued */
 };
 
-/* synchronisation of threads */
+/* group of serialized jobs */
+struct afb_thread_group
+{
+	pthread_mutex_t mutex; /* protection of the group */
+	int refcount;       /* count of references */
+	int active;         /* is a job of the group queued or running? */
+	struct job *first;  /* first job waiting the end of the active one */
+	struct job *last;   /* last job waiting the end of the active one */
+	struct afb_thread_group *next;     /* next group */
+	struct afb_thread_group **prvnext; /* link to this group */
+};
+
+/* accounting of the jobs of a client */
+struct afb_thread_client
+{
+	int refcount;       /* count of references */
+	int weight;         /* weight of the client for sharing the jobs */
+	int queued;         /* count of jobs of the client waiting a thread */
+	pthread_mutex_t mutex; /* protects weight and queued */
+};
+
+/* status of the requests rejected because of overload */
+const char afb_thread_busy[] = "busy";
+
+/* management of threads */
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  cond = PTHREAD_COND_INITIALIZER;
 
-/* queue of pending jobs */
-static struct job *first_job = NULL;
+/* sleeping of idle threads */
+static pthread_mutex_t sleep_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  sleep_cond = PTHREAD_COND_INITIALIZER;
+static int sleeping = 0;
 
-/* count allowed, started and running threads */
+/* count allowed, minimum, started and running threads, pending and remaining jobs */
 static int allowed = 0;
+static int minimum = 0;
 static int started = 0;
 static int running = 0;
+static int pending = 0;
 static int remains = 0;
+static int waiters = 0;
+
+/* sum of the weights of the clients having jobs waiting */
+static int weights = 0;
+
+/* seconds of idleness before retiring a thread */
+static int idle_timeout = 30;
+
+/* mean waiting time of jobs in ms */
+static int wait_mean = 0;
+
+/* attributes of the threads: the cores of the process, not the ones of the creator */
+static pthread_attr_t thread_attr;
+static pthread_attr_t *thread_attrp = NULL;
+
+/* set when threading terminates */
+static int stopping = 0;
+
+/* round robin distribution of jobs from external threads */
+static unsigned distrib = 0;
 
 /* list of threads */
 static struct thread *threads = NULL;
 
+/* the thread record of the current thread if it is a processing thread */
+static _Thread_local struct thread *current_thread;
+
+/* free jobs of the current thread */
+static _Thread_local struct job *magazine_head;
+static _Thread_local struct job *magazine_tail;
+static _Thread_local int magazine_count;
+
+/* free jobs given back by the threads */
+static pthread_mutex_t free_jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct job *free_jobs = NULL;
+
+/* list of groups */
+static pthread_mutex_t groups_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct afb_thread_group *groups = NULL;
+
+/* watch of the timeout of a thread */
+struct watch
+{
+	pthread_t thread;       /* the watched thread */
+	long deadline;          /* deadline in ms, 0 if disarmed, -1 if expired */
+	unsigned generation;    /* generation of the job watched, changed at each arm */
+	unsigned fired;         /* generation of the job whose deadline passed */
+	long expire;            /* time in ms of the slot of the wheel, LONG_MAX if none */
+	int pushed;             /* is the watch in the incoming list? */
+	struct watch *link;     /* link in the incoming list */
+	struct watch *next;     /* next watch of the slot of the wheel */
+	struct watch **prvnext; /* link to this watch in the wheel */
+};
+
+/* the watchdog and its timing wheel */
+static pthread_once_t watchdog_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t watchdog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watchdog_cond;
+static int watchdog_idle = 0;
+static struct watch *incoming = NULL;
+static struct watch *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static long wheel_tick = 0;
+static int wheel_count = 0;
+
 /* local timers */
 static _Thread_local int thread_timer_set;
-static _Thread_local timer_t thread_timerid;
+static _Thread_local struct watch thread_watch;
+
+/* current monotonic time in ms */
+static long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* removes the watch 'w' from the wheel */
+static void wheel_remove(struct watch *w)
+{
+	*w->prvnext = w->next;
+	if (w->next != NULL)
+		w->next->prvnext = w->prvnext;
+	w->prvnext = NULL;
+	__atomic_store_n(&w->expire, LONG_MAX, __ATOMIC_RELAXED);
+	wheel_count--;
+}
+
+/* inserts in the wheel the watch 'w' to be checked at time 'expire' */
+static void wheel_insert(struct watch *w, long expire)
+{
+	long tick, delta;
+	int level;
+	struct watch **slot;
+
+	/* compute the slot */
+	tick = (expire + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+	if (tick < wheel_tick)
+		tick = wheel_tick;
+	delta = tick - wheel_tick;
+	if (delta >> (WHEEL_BITS * WHEEL_LEVELS)) {
+		delta = (1L << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+		tick = wheel_tick + delta;
+	}
+	level = 0;
+	while (delta >> (WHEEL_BITS * (level + 1)))
+		level++;
+	slot = &wheel[level][(tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+
+	/* insert in the slot */
+	__atomic_store_n(&w->expire, tick * WHEEL_TICK_MS, __ATOMIC_RELAXED);
+	w->prvnext = slot;
+	w->next = *slot;
+	if (w->next != NULL)
+		w->next->prvnext = &w->next;
+	*slot = w;
+	wheel_count++;
+}
+
+/* puts in the wheel the watches of the incoming list */
+static void wheel_incoming(long now)
+{
+	struct watch *w, *list;
+	long deadline;
+
+	list = __atomic_exchange_n(&incoming, NULL, __ATOMIC_SEQ_CST);
+	while ((w = list) != NULL) {
+		list = w->link;
+		__atomic_store_n(&w->pushed, 0, __ATOMIC_SEQ_CST);
+		if (w->prvnext != NULL)
+			wheel_remove(w);
+		deadline = __atomic_load_n(&w->deadline, __ATOMIC_SEQ_CST);
+		if (deadline > 0)
+			wheel_insert(w, deadline > now ? deadline : now);
+	}
+}
+
+/* checks the watches of the slot of the current tick */
+static void wheel_fire(long now)
+{
+	struct watch *w, *list;
+	long deadline, expired;
+	unsigned generation;
+	int level, index;
+
+	/* cascade the watches of upper levels */
+	level = 0;
+	index = (int)(wheel_tick & (WHEEL_SLOTS - 1));
+	while (index == 0 && ++level < WHEEL_LEVELS) {
+		index = (int)((wheel_tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+		list = wheel[level][index];
+		while ((w = list) != NULL) {
+			list = w->next;
+			wheel_remove(w);
+			/* read after the removal, as when checking, not to miss an arm */
+			deadline = __atomic_load_n(&w->deadline, __ATOMIC_SEQ_CST);
+			if (deadline > 0)
+				wheel_insert(w, deadline);
+		}
+	}
+
+	/* check the watches of the current tick */
+	list = wheel[0][wheel_tick & (WHEEL_SLOTS - 1)];
+	while ((w = list) != NULL) {
+		list = w->next;
+		wheel_remove(w);
+		generation = __atomic_load_n(&w->generation, __ATOMIC_SEQ_CST);
+		deadline = __atomic_load_n(&w->deadline, __ATOMIC_SEQ_CST);
+		while (deadline > 0 && deadline <= now
+			&& !__atomic_compare_exchange_n(&w->deadline, &deadline, -1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+		if (deadline > now)
+			wheel_insert(w, deadline);
+		else if (deadline > 0) {
+			/* the deadline is passed, signal the job if it is still the same */
+			__atomic_store_n(&w->fired, generation, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&w->generation, __ATOMIC_SEQ_CST) == generation)
+				pthread_kill(w->thread, SIGALRM);
+			else {
+				/* the deadline was the one of a new job, restore it */
+				expired = -1;
+				if (__atomic_compare_exchange_n(&w->deadline, &expired, deadline, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+					wheel_insert(w, deadline);
+			}
+		}
+	}
+}
+
+/* main loop of the watchdog */
+static void *watchdog_main_loop(void *data)
+{
+	long now;
+	struct timespec ts;
+
+	pthread_mutex_lock(&watchdog_mutex);
+	for (;;) {
+		/* process the passed ticks */
+		now = now_ms();
+		if (wheel_count == 0)
+			wheel_tick = now / WHEEL_TICK_MS;
+		wheel_incoming(now);
+		while (wheel_tick <= now / WHEEL_TICK_MS) {
+			wheel_fire(now);
+			wheel_tick++;
+		}
+
+		/* wait the next tick or, if nothing is watched, a new watch */
+		if (wheel_count != 0) {
+			ts.tv_sec = (time_t)(wheel_tick * WHEEL_TICK_MS / 1000);
+			ts.tv_nsec = (long)(wheel_tick * WHEEL_TICK_MS % 1000) * 1000000;
+			pthread_cond_timedwait(&watchdog_cond, &watchdog_mutex, &ts);
+		} else {
+			__atomic_store_n(&watchdog_idle, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&incoming, __ATOMIC_SEQ_CST) == NULL)
+				pthread_cond_wait(&watchdog_cond, &watchdog_mutex);
+			__atomic_store_n(&watchdog_idle, 0, __ATOMIC_SEQ_CST);
+		}
+	}
+	return NULL;
+}
+
+/* starts the watchdog */
+static void watchdog_start()
+{
+	pthread_t tid;
+	pthread_condattr_t attr;
+	sigset_t sigset, oldset;
+	int rc;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&watchdog_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/* the watchdog doesn't receive signals */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_SETMASK, &sigset, &oldset);
+	rc = pthread_create(&tid, NULL, watchdog_main_loop, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	if (rc != 0) {
+		errno = rc;
+		ERROR("not able to start the watchdog: %m");
+	} else
+		pthread_detach(tid);
+}
 
 /*
  * Creates a timer for the current thread
@@ -79,22 +372,16 @@ static _Thread_local timer_t thread_timerid;
  */
 int afb_thread_timer_create()
 {
-	int rc;
-	struct sigevent sevp;
-
-	if (thread_timer_set)
-		rc = 0;
-	else {
-		sevp.sigev_notify = SIGEV_THREAD_ID;
-		sevp.sigev_signo = SIGALRM;
-		sevp.sigev_value.sival_ptr = NULL;
-#if defined(sigev_notify_thread_id)
-		sevp.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
-#else
-		sevp._sigev_un._tid = (pid_t)syscall(SYS_gettid);
-#endif
-		rc = timer_create(CLOCK_THREAD_CPUTIME_ID, &sevp, &thread_timerid);
-		thread_timer_set = !rc;
+	if (!thread_timer_set) {
+		pthread_once(&watchdog_once, watchdog_start);
+		thread_watch.thread = pthread_self();
+		thread_watch.deadline = 0;
+		thread_watch.generation = 0;
+		thread_watch.fired = 0;
+		thread_watch.expire = LONG_MAX;
+		thread_watch.pushed = 0;
+		thread_watch.prvnext = NULL;
+		thread_timer_set = 1;
 	}
 	return 0;
 }
@@ -104,19 +391,31 @@ int afb_thread_timer_create()
  */
 int afb_thread_timer_arm(int timeout)
 {
-	int rc;
-	struct itimerspec its;
+	struct watch *w = &thread_watch;
+	long deadline;
 
-	rc = afb_thread_timer_create();
-	if (rc == 0) {
-		its.it_interval.tv_sec = 0;
-		its.it_interval.tv_nsec = 0;
-		its.it_value.tv_sec = timeout;
-		its.it_value.tv_nsec = 0;
-		rc = timer_settime(thread_timerid, 0, &its, NULL);
+	if (timeout <= 0) {
+		afb_thread_timer_disarm();
+		return 0;
 	}
 
-	return rc;
+	afb_thread_timer_create();
+	deadline = now_ms() + 1000L * timeout;
+	__atomic_add_fetch(&w->generation, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&w->deadline, deadline, __ATOMIC_SEQ_CST);
+
+	/* tell the watchdog if it would check too late */
+	if (deadline < __atomic_load_n(&w->expire, __ATOMIC_RELAXED)
+	 && !__atomic_exchange_n(&w->pushed, 1, __ATOMIC_SEQ_CST)) {
+		w->link = __atomic_load_n(&incoming, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&incoming, &w->link, w, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+		if (__atomic_load_n(&watchdog_idle, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&watchdog_mutex);
+			pthread_cond_signal(&watchdog_cond);
+			pthread_mutex_unlock(&watchdog_mutex);
+		}
+	}
+	return 0;
 }
 
 /*
@@ -125,7 +424,18 @@ int afb_thread_timer_arm(int timeout)
 void afb_thread_timer_disarm()
 {
 	if (thread_timer_set)
-		afb_thread_timer_arm(0);
+		__atomic_store_n(&thread_watch.deadline, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Tells whether the alarm of the current job of the current thread expired.
+ * The alarms signalled for a previous job aren't taken into account.
+ */
+int afb_thread_timer_expired()
+{
+	return thread_timer_set
+		&& __atomic_load_n(&thread_watch.deadline, __ATOMIC_SEQ_CST) < 0
+		&& __atomic_load_n(&thread_watch.fired, __ATOMIC_SEQ_CST) == thread_watch.generation;
 }
 
 /*
@@ -133,111 +443,479 @@ void afb_thread_timer_disarm()
  */
 void afb_thread_timer_delete()
 {
+	struct watch *w = &thread_watch;
+
 	if (thread_timer_set) {
-		timer_delete(thread_timerid);
+		__atomic_store_n(&w->deadline, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_lock(&watchdog_mutex);
+		wheel_incoming(now_ms());
+		if (w->prvnext != NULL)
+			wheel_remove(w);
+		pthread_mutex_unlock(&watchdog_mutex);
 		thread_timer_set = 0;
 	}
 }
 
-/* add the job to the list */
-static inline void job_add(struct job *job)
+/* initialise the 'deque' */
+static void deque_init(struct deque *deque)
 {
-	void *group = job->group;
-	struct job *ijob, **pjob;
+	pthread_mutex_init(&deque->mutex, NULL);
+	deque->head = NULL;
+	deque->tail = NULL;
+}
 
-	pjob = &first_job;
-	ijob = first_job;
-	group = job->group;
-	if (group == NULL)
-		group = job;
-	while (ijob) {
-		if (ijob->group == group)
-			job->blocked = 1;
-		pjob = &ijob->next;
-		ijob = ijob->next;
-	}
-	*pjob = job;
+/* add the 'job' at the end of the 'deque' */
+static void deque_push_back(struct deque *deque, struct job *job)
+{
 	job->next = NULL;
-	remains--;
+	pthread_mutex_lock(&deque->mutex);
+	if (deque->tail == NULL)
+		__atomic_store_n(&deque->head, job, __ATOMIC_RELAXED);
+	else
+		deque->tail->next = job;
+	deque->tail = job;
+	pthread_mutex_unlock(&deque->mutex);
 }
 
-/* get the next job to process or NULL if none */
-static inline struct job *job_get()
+/* add the 'job' at the front of the 'deque' */
+static void deque_push_front(struct deque *deque, struct job *job)
+{
+	pthread_mutex_lock(&deque->mutex);
+	job->next = deque->head;
+	if (job->next == NULL)
+		deque->tail = job;
+	__atomic_store_n(&deque->head, job, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&deque->mutex);
+}
+
+/* get the first job of the 'deque' or NULL if the deque is empty */
+static struct job *deque_pop_front(struct deque *deque)
+{
+	struct job *job;
+
+	/* avoids locking empty deques */
+	if (__atomic_load_n(&deque->head, __ATOMIC_RELAXED) == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&deque->mutex);
+	job = deque->head;
+	if (job != NULL) {
+		__atomic_store_n(&deque->head, job->next, __ATOMIC_RELAXED);
+		if (job->next == NULL)
+			deque->tail = NULL;
+	}
+	pthread_mutex_unlock(&deque->mutex);
+	return job;
+}
+
+/* gives back the free jobs of the current thread */
+static void magazine_flush()
+{
+	if (magazine_head != NULL) {
+		pthread_mutex_lock(&free_jobs_mutex);
+		magazine_tail->next = free_jobs;
+		__atomic_store_n(&free_jobs, magazine_head, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&free_jobs_mutex);
+		magazine_head = magazine_tail = NULL;
+		magazine_count = 0;
+	}
+}
+
+/* takes free jobs given back by the threads */
+static void magazine_refill()
+{
+	struct job *job;
+
+	if (__atomic_load_n(&free_jobs, __ATOMIC_RELAXED) != NULL) {
+		pthread_mutex_lock(&free_jobs_mutex);
+		job = free_jobs;
+		if (job != NULL) {
+			magazine_head = job;
+			magazine_count = 1;
+			while (job->next != NULL && magazine_count < JOB_MAGAZINE) {
+				job = job->next;
+				magazine_count++;
+			}
+			magazine_tail = job;
+			__atomic_store_n(&free_jobs, job->next, __ATOMIC_RELAXED);
+			job->next = NULL;
+		}
+		pthread_mutex_unlock(&free_jobs_mutex);
+	}
+}
+
+/* allocates a job */
+static struct job *job_alloc()
+{
+	struct job *job;
+
+	if (magazine_head == NULL)
+		magazine_refill();
+	job = magazine_head;
+	if (job == NULL)
+		job = malloc(sizeof *job);
+	else {
+		magazine_head = job->next;
+		if (magazine_head == NULL)
+			magazine_tail = NULL;
+		magazine_count--;
+	}
+	return job;
+}
+
+/* releases the 'job' */
+static void job_release(struct job *job)
+{
+	job->next = magazine_head;
+	if (magazine_head == NULL)
+		magazine_tail = job;
+	magazine_head = job;
+	if (++magazine_count >= 2 * JOB_MAGAZINE)
+		magazine_flush();
+}
+
+/* creates a client of 'weight' */
+struct afb_thread_client *afb_thread_client_create(int weight)
+{
+	struct afb_thread_client *client;
+
+	client = malloc(sizeof *client);
+	if (client == NULL)
+		errno = ENOMEM;
+	else {
+		client->refcount = 1;
+		client->weight = weight > 0 ? weight : 1;
+		client->queued = 0;
+		pthread_mutex_init(&client->mutex, NULL);
+	}
+	return client;
+}
+
+/* adds a reference to the 'client' */
+void afb_thread_client_addref(struct afb_thread_client *client)
+{
+	__atomic_add_fetch(&client->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/* removes a reference to the 'client' and destroys it when unreferenced */
+void afb_thread_client_unref(struct afb_thread_client *client)
+{
+	if (client != NULL && !__atomic_sub_fetch(&client->refcount, 1, __ATOMIC_ACQ_REL)) {
+		pthread_mutex_destroy(&client->mutex);
+		free(client);
+	}
+}
+
+/* changes the 'weight' of the 'client' */
+void afb_thread_client_set_weight(struct afb_thread_client *client, int weight)
+{
+	if (weight <= 0)
+		weight = 1;
+	if (__atomic_load_n(&client->weight, __ATOMIC_RELAXED) != weight) {
+		pthread_mutex_lock(&client->mutex);
+		if (client->queued != 0)
+			__atomic_add_fetch(&weights, weight - client->weight, __ATOMIC_RELAXED);
+		__atomic_store_n(&client->weight, weight, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&client->mutex);
+	}
+}
+
+/* forgets a job waiting for the 'client' */
+static void client_release(struct afb_thread_client *client)
 {
-	struct job *job, **pjob;
-	pjob = &first_job;
-	job = first_job;
-	while (job && job->blocked) {
-		pjob = &job->next;
-		job = job->next;
+	pthread_mutex_lock(&client->mutex);
+	if (!--client->queued)
+		__atomic_sub_fetch(&weights, client->weight, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&client->mutex);
+}
+
+/*
+ * Records a job waiting for the 'client' if it doesn't exceed
+ * the share of the client. The share of a client is the part of the
+ * queue of jobs proportional to its weight among the weights of the
+ * clients having jobs waiting.
+ * The fairness being enforced here, the jobs of the clients are then
+ * queued in the deques of the threads like the other jobs.
+ * Returns 1 if recorded or 0 if the share is exceeded.
+ */
+static int client_enter(struct afb_thread_client *client)
+{
+	int queued, total, share, rc;
+
+	pthread_mutex_lock(&client->mutex);
+	queued = client->queued + 1;
+	total = __atomic_load_n(&weights, __ATOMIC_RELAXED);
+	if (queued == 1)
+		total += client->weight;
+	share = total > 0 ? waiters * client->weight / total : waiters;
+	rc = queued <= share || queued == 1;
+	if (rc) {
+		client->queued = queued;
+		if (queued == 1)
+			__atomic_add_fetch(&weights, client->weight, __ATOMIC_RELAXED);
 	}
-	if (job) {
-		*pjob = job->next;
-		remains++;
+	pthread_mutex_unlock(&client->mutex);
+	return rc;
+}
+
+/* releases the job waiting for the 'client' and its reference */
+static void client_leave(struct afb_thread_client *client)
+{
+	client_release(client);
+	afb_thread_client_unref(client);
+}
+
+/* creates a group of serialized jobs */
+struct afb_thread_group *afb_thread_group_create()
+{
+	struct afb_thread_group *group;
+
+	group = malloc(sizeof *group);
+	if (group == NULL)
+		errno = ENOMEM;
+	else {
+		pthread_mutex_init(&group->mutex, NULL);
+		group->refcount = 1;
+		group->active = 0;
+		group->first = NULL;
+		group->last = NULL;
+		pthread_mutex_lock(&groups_mutex);
+		group->prvnext = &groups;
+		group->next = groups;
+		if (groups != NULL)
+			groups->prvnext = &group->next;
+		groups = group;
+		pthread_mutex_unlock(&groups_mutex);
+	}
+	return group;
+}
+
+/* adds a reference to the 'group' */
+void afb_thread_group_addref(struct afb_thread_group *group)
+{
+	__atomic_add_fetch(&group->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/* removes a reference to the 'group' and destroys it when unreferenced */
+void afb_thread_group_unref(struct afb_thread_group *group)
+{
+	if (group != NULL && !__atomic_sub_fetch(&group->refcount, 1, __ATOMIC_ACQ_REL)) {
+		assert(group->first == NULL);
+		pthread_mutex_lock(&groups_mutex);
+		*group->prvnext = group->next;
+		if (group->next != NULL)
+			group->next->prvnext = group->prvnext;
+		pthread_mutex_unlock(&groups_mutex);
+		pthread_mutex_destroy(&group->mutex);
+		free(group);
+	}
+}
+
+/*
+ * Activates the group of the 'job' or, if the group is already
+ * active, queues the 'job' in the group.
+ * Returns 1 if the job can be scheduled or 0 if it waits.
+ */
+static int group_enter(struct job *job)
+{
+	struct afb_thread_group *group = job->group;
+	int rc;
+
+	pthread_mutex_lock(&group->mutex);
+	if (!group->active) {
+		group->active = 1;
+		rc = 1;
+	} else {
+		job->next = NULL;
+		if (group->last == NULL)
+			group->first = job;
+		else
+			group->last->next = job;
+		group->last = job;
+		rc = 0;
+	}
+	pthread_mutex_unlock(&group->mutex);
+	return rc;
+}
+
+/*
+ * Terminates the active job of 'group'.
+ * Returns the next job of the group to schedule or NULL
+ * if the group has no more job (and is then deactivated).
+ */
+static struct job *group_leave(struct afb_thread_group *group)
+{
+	struct job *job;
+
+	pthread_mutex_lock(&group->mutex);
+	job = group->first;
+	if (job == NULL)
+		group->active = 0;
+	else {
+		group->first = job->next;
+		if (group->first == NULL)
+			group->last = NULL;
 	}
+	pthread_mutex_unlock(&group->mutex);
 	return job;
 }
 
-/* unblock a group of job */
-static inline void job_unblock(void *group)
+/* queues the 'job' for being processed by a thread */
+static void job_schedule(struct job *job)
+{
+	struct thread *me;
+	unsigned index;
+
+	/* counted before being published: a thief can take it at once */
+	__atomic_add_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+	job->stamp = now_ms();
+	me = current_thread;
+	if (me != NULL) {
+		/* jobs made by a processing thread are processed first */
+		deque_push_front(&me->deque, job);
+	} else {
+		/* jobs from other threads are distributed */
+		index = __atomic_fetch_add(&distrib, 1, __ATOMIC_RELAXED);
+		deque_push_back(&threads[index % (unsigned)allowed].deque, job);
+	}
+
+	/* wake up a sleeping thread if any */
+	if (__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST) != 0) {
+		pthread_mutex_lock(&sleep_mutex);
+		pthread_cond_signal(&sleep_cond);
+		pthread_mutex_unlock(&sleep_mutex);
+	}
+}
+
+/* get the next job to process or NULL if none */
+static struct job *job_get(struct thread *me)
 {
 	struct job *job;
+	unsigned i, n;
+	int wait;
 
-	job = first_job;
-	while (job) {
-		if (job->group == group) {
-			job->blocked = 0;
-			break;
+	/*
+	 * first, the jobs of the thread, one at a time so that the
+	 * other jobs remain available to the other threads
+	 */
+	job = deque_pop_front(&me->deque);
+	if (job == NULL) {
+		/* second, steal a job of an other thread, retired or not */
+		n = (unsigned)allowed;
+		for (i = 0 ; job == NULL && i < n ; i++) {
+			me->victim = (me->victim + 1) % n;
+			job = deque_pop_front(&threads[me->victim].deque);
 		}
-		job = job->next;
 	}
+	if (job != NULL) {
+		__atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&remains, 1, __ATOMIC_RELAXED);
+		if (job->client != NULL)
+			client_leave(job->client);
+
+		/* updates the mean waiting time */
+		wait = (int)(now_ms() - job->stamp);
+		__atomic_store_n(&wait_mean, (7 * __atomic_load_n(&wait_mean, __ATOMIC_RELAXED) + wait) / 8, __ATOMIC_RELAXED);
+	}
+	return job;
+}
+
+/* cancel the pending 'job' */
+static void job_cancel(struct job *job)
+{
+	if (job->client != NULL)
+		client_leave(job->client);
+	afb_req_fail(job->req, "aborted", "termination of threading");
+	afb_req_unref(job->req);
+	afb_thread_group_unref(job->group);
+	job_release(job);
+}
+
+/*
+ * Wait for a job to process or a stop request.
+ * Returns 1 if the thread remained idle during 'idle_timeout'
+ * or otherwise 0.
+ */
+static int thread_sleep(struct thread *me)
+{
+	struct timespec ts;
+	int rc;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += idle_timeout;
+	rc = 0;
+	pthread_mutex_lock(&sleep_mutex);
+	__atomic_add_fetch(&sleeping, 1, __ATOMIC_SEQ_CST);
+	while (!me->stop && __atomic_load_n(&pending, __ATOMIC_SEQ_CST) == 0 && rc == 0)
+		rc = pthread_cond_timedwait(&sleep_cond, &sleep_mutex, &ts);
+	__atomic_sub_fetch(&sleeping, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&sleep_mutex);
+	return rc == ETIMEDOUT && __atomic_load_n(&pending, __ATOMIC_SEQ_CST) == 0;
+}
+
+/*
+ * Retires the idle thread 'me' if more than the minimum count
+ * of threads are started.
+ * Returns 1 if the thread is retired or otherwise 0.
+ */
+static int thread_retire(struct thread *me)
+{
+	int rc;
+
+	pthread_mutex_lock(&mutex);
+	rc = !stopping && started > minimum;
+	if (rc) {
+		pthread_detach(me->tid);
+		me->alive = 0;
+		__atomic_store_n(&started, started - 1, __ATOMIC_RELEASE);
+		INFO("idle thread retired, %d threads remain", started);
+	}
+	pthread_mutex_unlock(&mutex);
+	return rc;
 }
 
+static void thread_grow();
+
 /* main loop of processing threads */
 static void *thread_main_loop(void *data)
 {
 	struct thread *me = data;
 	struct job *job, j;
 
-	me->works = 0;
-	me->ended = 0;
+	current_thread = me;
 	afb_thread_timer_create();
-	pthread_mutex_lock(&mutex);
-	while (!me->stop) {
+	while (!__atomic_load_n(&me->stop, __ATOMIC_RELAXED)) {
 		/* get a job */
-		job = job_get();
-		if (job == NULL && first_job != NULL && running == 0) {
-			/* sad situation!! should not happen */
-			ERROR("threads are blocked!");
-			job = first_job;
-			first_job = job->next;
-		}
+		job = job_get(me);
 		if (job == NULL) {
 			/* no job... */
-			pthread_cond_wait(&cond, &mutex);
+			if (thread_sleep(me) && thread_retire(me))
+				break;
 		} else {
 			/* run the job */
-			running++;
+			thread_grow();
+			__atomic_add_fetch(&running, 1, __ATOMIC_RELAXED);
 			me->works = 1;
-			pthread_mutex_unlock(&mutex);
 			j = *job;
-			free(job);
+			job_release(job);
 			afb_thread_timer_arm(j.timeout);
 			afb_sig_req(j.req, j.callback);
 			afb_thread_timer_disarm();
 			afb_req_unref(j.req);
-			pthread_mutex_lock(&mutex);
-			if (j.group != NULL)
-				job_unblock(j.group);
+			if (j.group != NULL) {
+				/* let the next job of the group run */
+				job = group_leave(j.group);
+				if (job != NULL)
+					job_schedule(job);
+				afb_thread_group_unref(j.group);
+			}
 			me->works = 0;
-			running--;
+			__atomic_sub_fetch(&running, 1, __ATOMIC_RELAXED);
 		}
-
 	}
-	me->ended = 1;
-	pthread_mutex_unlock(&mutex);
 	afb_thread_timer_delete();
-	return me;
+	magazine_flush();
+	return NULL;
 }
 
 /* start a new thread */
@@ -248,90 +926,201 @@ static int start_one_thread()
 
 	assert(started < allowed);
 
-	t = &threads[started++];
+	/* search a free slot */
+	t = threads;
+	while (t->alive)
+		t++;
+
+	t->alive = 1;
 	t->stop = 0;
-	rc = pthread_create(&t->tid, NULL, thread_main_loop, t);
+	t->works = 0;
+	t->victim = (unsigned)(t - threads);
+	rc = pthread_create(&t->tid, thread_attrp, thread_main_loop, t);
 	if (rc != 0) {
-		started--;
+		t->alive = 0;
 		errno = rc;
 		WARNING("not able to start thread: %m");
 		rc = -1;
+	} else {
+		__atomic_store_n(&started, started + 1, __ATOMIC_RELEASE);
 	}
 	return rc;
 }
 
+/* is an other thread needed? */
+static inline int need_thread()
+{
+	int n = __atomic_load_n(&started, __ATOMIC_ACQUIRE);
+
+	return n < allowed
+		&& __atomic_load_n(&sleeping, __ATOMIC_RELAXED) == 0
+		&& __atomic_load_n(&pending, __ATOMIC_RELAXED) != 0
+		&& (n == __atomic_load_n(&running, __ATOMIC_RELAXED)
+			|| __atomic_load_n(&wait_mean, __ATOMIC_RELAXED) > GROW_WAIT_MS);
+}
+
+/* start an other thread if needed */
+static void thread_grow()
+{
+	if (need_thread()) {
+		pthread_mutex_lock(&mutex);
+		if (!stopping && need_thread() && start_one_thread() == 0)
+			INFO("thread added, %d threads started", started);
+		pthread_mutex_unlock(&mutex);
+	}
+}
+
 /* process the 'request' with the 'callback' using a separate thread if available */
-void afb_thread_call(struct afb_req req, void (*callback)(struct afb_req req), int timeout, void *group)
+void afb_thread_call(struct afb_req req, void (*callback)(struct afb_req req), int timeout, struct afb_thread_group *group, struct afb_thread_client *client)
 {
 	const char *info;
 	struct job *job;
-	int rc;
+	int n;
+
+	/* checks the share of the client */
+	if (client != NULL && !client_enter(client)) {
+		info = "too many pending requests of the client";
+		goto busy;
+	}
+
+	/* reserves a place for the job */
+	n = __atomic_load_n(&remains, __ATOMIC_RELAXED);
+	do {
+		if (n <= 0) {
+			info = "too many pending requests";
+			goto busy2;
+		}
+	} while (!__atomic_compare_exchange_n(&remains, &n, n - 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
 	/* allocates the job */
-	job = malloc(sizeof *job);
+	job = job_alloc();
 	if (job == NULL) {
 		info = "out of memory";
-		goto error;
-	}
-
-	/* start a thread if needed */
-	pthread_mutex_lock(&mutex);
-	if (remains == 0) {
-		info = "too many jobs";
 		goto error2;
 	}
-	if (started == running && started < allowed) {
-		rc = start_one_thread();
-		if (rc < 0 && started == 0) {
-			/* failed to start threading */
-			info = "can't start thread";
-			goto error2;
-		}
+
+	/* check that threading is started */
+	if (__atomic_load_n(&started, __ATOMIC_RELAXED) == 0) {
+		info = "no thread started";
+		goto error3;
 	}
 
-	/* fills and queues the job */
+	/* fills the job */
 	job->callback = callback;
 	job->req = req;
 	job->timeout = timeout;
-	job->blocked = 0;
 	job->group = group;
+	job->client = client;
+
+	/* queues the job */
 	afb_req_addref(req);
-	job_add(job);
-	pthread_mutex_unlock(&mutex);
+	if (client != NULL)
+		afb_thread_client_addref(client);
+	if (group == NULL)
+		job_schedule(job);
+	else {
+		afb_thread_group_addref(group);
+		if (group_enter(job))
+			job_schedule(job);
+	}
 
-	/* signal an existing job */
-	pthread_cond_signal(&cond);
+	/* start a thread if needed */
+	thread_grow();
 	return;
 
+error3:
+	job_release(job);
 error2:
-	pthread_mutex_unlock(&mutex);
-	free(job);
-error:
+	__atomic_add_fetch(&remains, 1, __ATOMIC_RELAXED);
+	if (client != NULL)
+		client_release(client);
 	ERROR("can't process job with threads: %s", info);
 	afb_req_fail(req, "internal-error", info);
+	return;
+
+busy2:
+	if (client != NULL)
+		client_release(client);
+busy:
+	INFO("request rejected: %s", info);
+	afb_req_fail(req, afb_thread_busy, info);
+}
+
+/* get the advised delay in seconds before retrying a rejected request */
+int afb_thread_retry_after()
+{
+	int delay = 1 + __atomic_load_n(&wait_mean, __ATOMIC_RELAXED) / 1000;
+
+	return delay < RETRY_AFTER_MAX ? delay : RETRY_AFTER_MAX;
+}
+
+/* set the seconds of idleness before retiring a thread */
+void afb_thread_set_idle_timeout(int timeout)
+{
+	idle_timeout = timeout > 0 ? timeout : 1;
+}
+
+/* get the statistics of the threads */
+void afb_thread_get_stats(struct afb_thread_stats *stats)
+{
+	stats->workers_min = minimum;
+	stats->workers_max = allowed;
+	stats->workers_idle = idle_timeout;
+	stats->grow_wait = GROW_WAIT_MS;
+	stats->jobs_max = waiters;
+	stats->started = __atomic_load_n(&started, __ATOMIC_RELAXED);
+	stats->running = __atomic_load_n(&running, __ATOMIC_RELAXED);
+	stats->pending = __atomic_load_n(&pending, __ATOMIC_RELAXED);
+	stats->wait = __atomic_load_n(&wait_mean, __ATOMIC_RELAXED);
 }
 
 /* initialise the threads */
 int afb_thread_init(int allowed_count, int start_count, int waiter_count)
 {
-	threads = calloc(allowed_count, sizeof *threads);
+	int i;
+	cpu_set_t cpus;
+
+	if (start_count < 1)
+		start_count = 1;
+	if (allowed_count < start_count)
+		allowed_count = start_count;
+
+	threads = calloc((size_t)allowed_count, sizeof *threads);
 	if (threads == NULL) {
 		errno = ENOMEM;
 		ERROR("can't allocate threads");
 		return -1;
 	}
+	for (i = 0 ; i < allowed_count ; i++)
+		deque_init(&threads[i].deque);
 
-	/* records the allowed count */
+	/* the threads created later by a thread pinned to a core use all the cores */
+	if (sched_getaffinity(0, sizeof cpus, &cpus) == 0
+	 && pthread_attr_init(&thread_attr) == 0) {
+		if (pthread_attr_setaffinity_np(&thread_attr, sizeof cpus, &cpus) == 0)
+			thread_attrp = &thread_attr;
+		else
+			pthread_attr_destroy(&thread_attr);
+	}
+
+	/* records the counts */
 	allowed = allowed_count;
+	minimum = start_count;
 	started = 0;
 	running = 0;
-	remains = waiter_count;
+	pending = 0;
+	remains = waiters = waiter_count;
+	wait_mean = 0;
+	stopping = 0;
 
-	/* start at least one thread */
+	/* start the minimum count of threads */
 	pthread_mutex_lock(&mutex);
 	while (started < start_count && start_one_thread() == 0);
 	pthread_mutex_unlock(&mutex);
 
+	NOTICE("threads: min %d, max %d, idle %ds, grow above %dms of wait, max %d jobs",
+			minimum, allowed, idle_timeout, GROW_WAIT_MS, waiters);
+
 	/* end */
 	return -(started != start_count);
 }
@@ -340,40 +1129,62 @@ int afb_thread_init(int allowed_count, int start_count, int waiter_count)
 void afb_thread_terminate()
 {
 	int i, n;
-	struct job *job;
+	struct job *job, *jobs;
+	struct afb_thread_group *group;
 
-	/* request all threads to stop */
+	/* forbids creation and retirement of threads */
 	pthread_mutex_lock(&mutex);
-	allowed = 0;
-	n = started;
+	stopping = 1;
+	pthread_mutex_unlock(&mutex);
+
+	/* request all threads to stop */
+	pthread_mutex_lock(&sleep_mutex);
+	n = allowed;
 	for (i = 0 ; i < n ; i++)
-		threads[i].stop = 1;
+		__atomic_store_n(&threads[i].stop, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&sleep_cond);
+	pthread_mutex_unlock(&sleep_mutex);
 
 	/* wait until all thread are terminated */
-	while (started != 0) {
-		/* signal threads */
-		pthread_mutex_unlock(&mutex);
-		pthread_cond_broadcast(&cond);
-		pthread_mutex_lock(&mutex);
+	for (i = 0 ; i < n ; i++)
+		if (threads[i].alive) {
+			pthread_join(threads[i].tid, NULL);
+			threads[i].alive = 0;
+		}
+	started = 0;
 
-		/* join the terminated threads */
-		for (i = 0 ; i < n ; i++) {
-			if (threads[i].tid && threads[i].ended) {
-				pthread_join(threads[i].tid, NULL);
-				threads[i].tid = 0;
-				started--;
-			}
+	/* cancel pending jobs */
+	for (i = 0 ; i < n ; i++)
+		while ((job = deque_pop_front(&threads[i].deque)) != NULL)
+			job_cancel(job);
+	jobs = NULL;
+	pthread_mutex_lock(&groups_mutex);
+	for (group = groups ; group != NULL ; group = group->next) {
+		if (group->first != NULL) {
+			group->last->next = jobs;
+			jobs = group->first;
+			group->first = NULL;
+			group->last = NULL;
 		}
+		group->active = 0;
+	}
+	pthread_mutex_unlock(&groups_mutex);
+	while ((job = jobs) != NULL) {
+		jobs = job->next;
+		job_cancel(job);
 	}
-	pthread_mutex_unlock(&mutex);
-	free(threads);
 
-	/* cancel pending jobs */
-	while (first_job) {
-		job = first_job;
-		first_job = job->next;
-		afb_req_fail(job->req, "aborted", "termination of threading");
-		afb_req_unref(job->req);
+	/* free the free jobs */
+	magazine_flush();
+	pthread_mutex_lock(&free_jobs_mutex);
+	jobs = free_jobs;
+	free_jobs = NULL;
+	pthread_mutex_unlock(&free_jobs_mutex);
+	while ((job = jobs) != NULL) {
+		jobs = job->next;
 		free(job);
 	}
+	allowed = 0;
+	free(threads);
+	threads = NULL;
 }
@@ -18,14 +18,48 @@
 #pragma once
 
 struct afb_req;
+struct afb_thread_group;
+struct afb_thread_client;
 
-extern void afb_thread_call(struct afb_req req, void (*callback)(struct afb_req req), int timeout, void *group);
+/*
+ * status of the requests rejected because of overload, compared
+ * by address to distinguish it from the statuses given by bindings
+ */
+extern const char afb_thread_busy[];
+
+extern struct afb_thread_group *afb_thread_group_create();
+extern void afb_thread_group_addref(struct afb_thread_group *group);
+extern void afb_thread_group_unref(struct afb_thread_group *group);
+
+extern struct afb_thread_client *afb_thread_client_create(int weight);
+extern void afb_thread_client_addref(struct afb_thread_client *client);
+extern void afb_thread_client_unref(struct afb_thread_client *client);
+extern void afb_thread_client_set_weight(struct afb_thread_client *client, int weight);
+
+extern void afb_thread_call(struct afb_req req, void (*callback)(struct afb_req req), int timeout, struct afb_thread_group *group, struct afb_thread_client *client);
+extern int afb_thread_retry_after();
+
+struct afb_thread_stats
+{
+	int workers_min;    /* minimum count of threads */
+	int workers_max;    /* maximum count of threads */
+	int workers_idle;   /* seconds of idleness before retiring a thread */
+	int grow_wait;      /* mean waiting time of jobs in ms for adding a thread */
+	int jobs_max;       /* maximum count of jobs waiting */
+	int started;        /* count of started threads */
+	int running;        /* count of threads processing a job */
+	int pending;        /* count of jobs waiting a thread */
+	int wait;           /* mean waiting time of jobs in ms */
+};
 
 extern int afb_thread_init(int allowed_count, int start_count, int waiter_count);
+extern void afb_thread_set_idle_timeout(int timeout);
+extern void afb_thread_get_stats(struct afb_thread_stats *stats);
 extern void afb_thread_terminate();
 
 extern int afb_thread_timer_create();
 extern int afb_thread_timer_arm(int timeout);
 extern void afb_thread_timer_disarm();
+extern int afb_thread_timer_expired();
 extern void afb_thread_timer_delete();
 
@@ -40,6 +40,9 @@ static const char sec_websocket_accept_s[] = "Sec-WebSocket-Accept";
 static const char sec_websocket_protocol_s[] = "Sec-WebSocket-Protocol";
 static const char websocket_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
+static const char long_key_for_broadcast[] = "x-afb-broadcast";
+static const char short_key_for_broadcast[] = "broadcast";
+
 static void enc64(unsigned char *in, char *out)
 {
 	static const char tob64[] =
@@ -94,7 +97,7 @@ static int headerhas(const char *header, const char *needle)
 struct protodef
 {
 	const char *name;
-	void *(*create)(int fd, void *context, void (*cleanup)(void*), void *cleanup_closure);
+	void *(*create)(int fd, void *context, const char *broadcasts, void (*cleanup)(void*), void *cleanup_closure);
 };
 
 static const struct protodef *search_proto(const struct protodef *protodefs, const char *protocols)
@@ -119,7 +122,7 @@ static const struct protodef *search_proto(const struct protodef *protodefs, con
 	}
 }
 
-static int check_websocket_upgrade(struct MHD_Connection *con, const struct protodef *protodefs, void *context, void **websock)
+static int check_websocket_upgrade(struct MHD_Connection *con, const struct protodef *protodefs, void *context, const char *broadcasts, void **websock)
 {
 	const union MHD_ConnectionInfo *info;
 	struct MHD_Response *response;
@@ -174,7 +177,7 @@ static int check_websocket_upgrade(struct MHD_Connection *con, const struct prot
 		MHD_destroy_response(response);
 		return 1;
 	}
-	ws = proto->create(info->connect_fd, context, (void*)MHD_resume_connection, con);
+	ws = proto->create(info->connect_fd, context, broadcasts, (void*)MHD_resume_connection, con);
 	if (ws == NULL) {
 		response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
 		MHD_queue_response(con, MHD_HTTP_INTERNAL_SERVER_ERROR, response);
@@ -205,14 +208,20 @@ int afb_websock_check_upgrade(struct afb_hreq *hreq)
 {
 	void *ws;
 	int rc;
+	const char *broadcasts;
 
 	/* is a get ? */
 	if (hreq->method != afb_method_get
 	 || strcasecmp(hreq->version, MHD_HTTP_VERSION_1_1))
 		return 0;
 
+	/* the patterns of the broadcasts to receive */
+	broadcasts = afb_hreq_get_argument(hreq, long_key_for_broadcast);
+	if (broadcasts == NULL)
+		broadcasts = afb_hreq_get_argument(hreq, short_key_for_broadcast);
+
 	ws = NULL;
-	rc = check_websocket_upgrade(hreq->connection, protodefs, &hreq->context, &ws);
+	rc = check_websocket_upgrade(hreq->connection, protodefs, &hreq->context, broadcasts, &ws);
 	if (rc == 1) {
 		hreq->replied = 1;
 		if (ws != NULL)
@@ -22,6 +22,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/uio.h>
 
 #include <json-c/json.h>
 
@@ -30,22 +31,32 @@
 #include "afb-wsj1.h"
 #include "afb-ws-json1.h"
 #include "afb-common.h"
+#include "afb-completion.h"
 #include "afb-msg-json.h"
 #include "session.h"
 #include "afb-apis.h"
+#include "afb-rate.h"
 #include "afb-context.h"
 #include "afb-evt.h"
 #include "afb-subcall.h"
 #include "verbose.h"
 
+/* limits of the patterns of broadcasts given by a client */
+#define BROADCAST_PATTERN_MAX	128	/* maximum length of a pattern */
+#define BROADCAST_COUNT_MAX	32	/* maximum count of patterns */
+
 /* predeclaration of structures */
 struct afb_ws_json1;
 struct afb_wsreq;
 
 /* predeclaration of websocket callbacks */
 static void aws_on_hangup(struct afb_ws_json1 *ws, struct afb_wsj1 *wsj1);
+static void aws_on_writable(struct afb_ws_json1 *ws, struct afb_wsj1 *wsj1);
 static void aws_on_call(struct afb_ws_json1 *ws, const char *api, const char *verb, struct afb_wsj1_msg *msg);
-static void aws_on_event(struct afb_ws_json1 *ws, const char *event, int eventid, struct json_object *object);
+static void aws_on_event(struct afb_ws_json1 *ws, struct afb_evt_data *data);
+static int aws_on_events(struct afb_ws_json1 *ws, struct afb_evt_data **datas, int count);
+static void aws_on_disconnect(struct afb_ws_json1 *ws);
+static char *aws_encode_event(const char *event, int eventid, struct json_object *object, size_t *length);
 
 /* predeclaration of wsreq callbacks */
 static void wsreq_addref(struct afb_wsreq *wsreq);
@@ -69,6 +80,8 @@ struct afb_ws_json1
 	struct AFB_clientCtx *session;
 	struct afb_evt_listener *listener;
 	struct afb_wsj1 *wsj1;
+	struct afb_completion_queue *queue;
+	struct afb_completion hangup; /* hangs up from the loop of aws */
 	int new_session;
 };
 
@@ -80,16 +93,23 @@ struct afb_wsreq
 	 * is an implicit convertion to struct afb_context
 	 */
 	struct afb_context context;
-	int refcount;
+	int refcount;	/* atomic: the last release, on any thread, drops aws and msgj1 */
 	struct afb_ws_json1 *aws;
 	struct afb_wsreq *next;
 	struct afb_wsj1_msg *msgj1;
+	int replied;			/* atomic: set by the first reply */
+	int iserror;			/* is the pending reply an error? */
+	struct json_object *reply;	/* the pending reply as an object */
+	char *text;			/* the pending reply as a text */
+	char *token;			/* the token of the pending reply */
+	struct afb_completion completion; /* sends the reply from the loop of aws */
 };
 
 /* interface for afb_ws_json1 / afb_wsj1 */
 static struct afb_wsj1_itf wsj1_itf = {
 	.on_hangup = (void*)aws_on_hangup,
-	.on_call = (void*)aws_on_call
+	.on_call = (void*)aws_on_call,
+	.on_writable = (void*)aws_on_writable
 };
 
 /* interface for wsreq / afb_req */
@@ -114,7 +134,14 @@ const struct afb_req_itf afb_ws_json1_req_itf = {
 /* the interface for events */
 static const struct afb_evt_itf evt_itf = {
 	.broadcast = (void*)aws_on_event,
-	.push = (void*)aws_on_event
+	.push = (void*)aws_on_event,
+	.batch = (void*)aws_on_events,
+	.disconnect = (void*)aws_on_disconnect
+};
+
+/* the encoding of events, shared by all the websockets */
+static const struct afb_evt_encoding evt_encoding = {
+	.encode = aws_encode_event
 };
 
 /***************************************************************
@@ -125,7 +152,41 @@ static const struct afb_evt_itf evt_itf = {
 ****************************************************************
 ***************************************************************/
 
-struct afb_ws_json1 *afb_ws_json1_create(int fd, struct afb_context *context, void (*cleanup)(void*), void *cleanup_closure)
+/*
+ * Makes the listener of 'ws' receiving the broadcasts matching the
+ * comma separated patterns of 'broadcasts' or all of them when NULL.
+ * Returns 0 in case of success or -1 on error.
+ */
+static int aws_add_broadcasts(struct afb_ws_json1 *ws, const char *broadcasts)
+{
+	int count;
+	size_t length;
+	char pattern[BROADCAST_PATTERN_MAX + 1];
+
+	if (broadcasts == NULL)
+		return afb_evt_add_broadcast(ws->listener, "*");
+
+	count = 0;
+	while (*broadcasts) {
+		length = strcspn(broadcasts, ",");
+		if (length != 0) {
+			if (length > BROADCAST_PATTERN_MAX || ++count > BROADCAST_COUNT_MAX) {
+				ERROR("too long or too many patterns of broadcasts");
+				errno = EINVAL;
+				return -1;
+			}
+			memcpy(pattern, broadcasts, length);
+			pattern[length] = 0;
+			if (afb_evt_add_broadcast(ws->listener, pattern) < 0)
+				return -1;
+		}
+		broadcasts += length;
+		broadcasts += *broadcasts == ',';
+	}
+	return 0;
+}
+
+struct afb_ws_json1 *afb_ws_json1_create(int fd, struct afb_context *context, const char *broadcasts, void (*cleanup)(void*), void *cleanup_closure)
 {
 	struct afb_ws_json1 *result;
 
@@ -141,6 +202,8 @@ struct afb_ws_json1 *afb_ws_json1_create(int fd, struct afb_context *context, vo
 	result->cleanup_closure = cleanup_closure;
 	result->session = ctxClientAddRef(context->session);
 	result->new_session = context->created != 0;
+	result->queue = afb_completion_get_queue();
+	result->listener = NULL;
 	if (result->session == NULL)
 		goto error2;
 
@@ -152,8 +215,13 @@ struct afb_ws_json1 *afb_ws_json1_create(int fd, struct afb_context *context, vo
 	if (result->listener == NULL)
 		goto error4;
 
+	if (aws_add_broadcasts(result, broadcasts) < 0)
+		goto error5;
+
 	return result;
 
+error5:
+	afb_evt_listener_unref(result->listener);
 error4:
 	afb_wsj1_unref(result->wsj1);
 error3:
@@ -167,13 +235,13 @@ error:
 
 static struct afb_ws_json1 *aws_addref(struct afb_ws_json1 *ws)
 {
-	ws->refcount++;
+	__atomic_add_fetch(&ws->refcount, 1, __ATOMIC_RELAXED);
 	return ws;
 }
 
 static void aws_unref(struct afb_ws_json1 *ws)
 {
-	if (--ws->refcount == 0) {
+	if (__atomic_sub_fetch(&ws->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
 		afb_evt_listener_unref(ws->listener);
 		afb_wsj1_unref(ws->wsj1);
 		if (ws->cleanup != NULL)
@@ -188,6 +256,13 @@ static void aws_on_hangup(struct afb_ws_json1 *ws, struct afb_wsj1 *wsj1)
 	aws_unref(ws);
 }
 
+static void aws_on_writable(struct afb_ws_json1 *ws, struct afb_wsj1 *wsj1)
+{
+	/* sends the events kept while the client was not reading */
+	if (ws->listener != NULL)
+		afb_evt_listener_unblock(ws->listener);
+}
+
 static void aws_on_call(struct afb_ws_json1 *ws, const char *api, const char *verb, struct afb_wsj1_msg *msg)
 {
 	struct afb_req r;
@@ -220,13 +295,70 @@ static void aws_on_call(struct afb_ws_json1 *ws, const char *api, const char *ve
 	/* emits the call */
 	r.closure = wsreq;
 	r.itf = &afb_ws_json1_req_itf;
-	afb_apis_call_(r, &wsreq->context, api, verb);
+	if (afb_rate_check(r, &wsreq->context, api, strlen(api), verb, strlen(verb)))
+		afb_apis_call_(r, &wsreq->context, api, verb);
 	wsreq_unref(wsreq);
 }
 
-static void aws_on_event(struct afb_ws_json1 *aws, const char *event, int eventid, struct json_object *object)
+static char *aws_encode_event(const char *event, int eventid, struct json_object *object, size_t *length)
+{
+	char *result;
+	struct json_object *msg;
+
+	msg = afb_msg_json_event(event, json_object_get(object));
+	result = afb_wsj1_encode_event(event, json_object_to_json_string_ext(msg, JSON_C_TO_STRING_PLAIN), length);
+	json_object_put(msg);
+	return result;
+}
+
+static void aws_on_event(struct afb_ws_json1 *aws, struct afb_evt_data *data)
+{
+	size_t length;
+	const char *text;
+
+	text = afb_evt_data_encode(data, &evt_encoding, &length);
+	if (text == NULL)
+		ERROR("can't encode event %s", afb_evt_data_event(data));
+	else
+		afb_wsj1_send_encoded(aws->wsj1, text, length);
+}
+
+static int aws_on_events(struct afb_ws_json1 *aws, struct afb_evt_data **datas, int count)
+{
+	struct iovec texts[32];
+	int i, n;
+
+	/* a client not reading keeps its events */
+	if (!afb_wsj1_is_writable(aws->wsj1))
+		return 0;
+
+	n = 0;
+	for (i = 0 ; i < count ; i++) {
+		texts[n].iov_base = (void*)afb_evt_data_encode(datas[i], &evt_encoding, &texts[n].iov_len);
+		if (texts[n].iov_base == NULL)
+			ERROR("can't encode event %s", afb_evt_data_event(datas[i]));
+		else if (++n == (int)(sizeof texts / sizeof *texts)) {
+			afb_wsj1_send_encodeds(aws->wsj1, texts, n);
+			n = 0;
+			if (!afb_wsj1_is_writable(aws->wsj1))
+				return i + 1;
+		}
+	}
+	if (n != 0)
+		afb_wsj1_send_encodeds(aws->wsj1, texts, n);
+	return count;
+}
+
+static void aws_hangup(struct afb_ws_json1 *aws)
 {
-	afb_wsj1_send_event_j(aws->wsj1, event, afb_msg_json_event(event, object));
+	afb_wsj1_hangup(aws->wsj1);
+	aws_unref(aws);
+}
+
+static void aws_on_disconnect(struct afb_ws_json1 *aws)
+{
+	ERROR("disconnecting websocket: too many events waiting");
+	afb_completion_post(aws->queue, &aws->hangup, (void*)aws_hangup, aws_addref(aws));
 }
 
 /***************************************************************
@@ -239,12 +371,12 @@ static void aws_on_event(struct afb_ws_json1 *aws, const char *event, int eventi
 
 static void wsreq_addref(struct afb_wsreq *wsreq)
 {
-	wsreq->refcount++;
+	__atomic_add_fetch(&wsreq->refcount, 1, __ATOMIC_RELAXED);
 }
 
 static void wsreq_unref(struct afb_wsreq *wsreq)
 {
-	if (--wsreq->refcount == 0) {
+	if (__atomic_sub_fetch(&wsreq->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
 		afb_context_disconnect(&wsreq->context);
 		afb_wsj1_msg_unref(wsreq->msgj1);
 		aws_unref(wsreq->aws);
@@ -262,20 +394,60 @@ static struct afb_arg wsreq_get(struct afb_wsreq *wsreq, const char *name)
 	return afb_msg_json_get_arg(wsreq_json(wsreq), name);
 }
 
-static void wsreq_fail(struct afb_wsreq *wsreq, const char *status, const char *info)
+/* sends the pending reply of 'wsreq', called by its event loop */
+static void wsreq_send_reply(struct afb_wsreq *wsreq)
 {
 	int rc;
-	rc = afb_wsj1_reply_error_j(wsreq->msgj1, afb_msg_json_reply_error(status, info, &wsreq->context, NULL), afb_context_sent_token(&wsreq->context));
+
+	if (wsreq->text != NULL)
+		rc = afb_wsj1_reply_s(wsreq->msgj1, wsreq->text, wsreq->token, wsreq->iserror);
+	else
+		rc = afb_wsj1_reply_j(wsreq->msgj1, wsreq->reply, wsreq->token, wsreq->iserror);
 	if (rc)
-		ERROR("Can't send fail reply: %m");
+		ERROR("Can't send %s reply: %m", wsreq->iserror ? "fail" : "success");
+	free(wsreq->text);
+	free(wsreq->token);
+	wsreq_unref(wsreq);
+}
+
+/*
+ * Records the reply given either by 'reply' or by 'text' and posts
+ * it to the main loop. Takes the ownership of 'reply' and 'text'.
+ */
+static void wsreq_reply(struct afb_wsreq *wsreq, struct json_object *reply, char *text, int iserror)
+{
+	const char *token;
+
+	if (__atomic_exchange_n(&wsreq->replied, 1, __ATOMIC_ACQ_REL) != 0) {
+		ERROR("Can't reply twice to a request");
+		goto error;
+	}
+	if (reply == NULL && text == NULL) {
+		ERROR("Can't record the reply: %m");
+		goto error;
+	}
+	token = afb_context_sent_token(&wsreq->context);
+	wsreq->token = token == NULL ? NULL : strdup(token);
+	wsreq->reply = reply;
+	wsreq->text = text;
+	wsreq->iserror = iserror;
+	wsreq_addref(wsreq);
+	afb_completion_post(wsreq->aws->queue, &wsreq->completion, (void*)wsreq_send_reply, wsreq);
+	return;
+
+error:
+	json_object_put(reply);
+	free(text);
+}
+
+static void wsreq_fail(struct afb_wsreq *wsreq, const char *status, const char *info)
+{
+	wsreq_reply(wsreq, afb_msg_json_reply_error(status, info, &wsreq->context, NULL), NULL, 1);
 }
 
 static void wsreq_success(struct afb_wsreq *wsreq, json_object *obj, const char *info)
 {
-	int rc;
-	rc = afb_wsj1_reply_ok_j(wsreq->msgj1, afb_msg_json_reply_ok(info, obj, &wsreq->context, NULL), afb_context_sent_token(&wsreq->context));
-	if (rc)
-		ERROR("Can't send success reply: %m");
+	wsreq_reply(wsreq, afb_msg_json_reply_ok(info, obj, &wsreq->context, NULL), NULL, 0);
 }
 
 static const char *wsreq_raw(struct afb_wsreq *wsreq, size_t *size)
@@ -288,10 +460,7 @@ static const char *wsreq_raw(struct afb_wsreq *wsreq, size_t *size)
 
 static void wsreq_send(struct afb_wsreq *wsreq, const char *buffer, size_t size)
 {
-	int rc;
-	rc = afb_wsj1_reply_ok_s(wsreq->msgj1, buffer, afb_context_sent_token(&wsreq->context));
-	if (rc)
-		ERROR("Can't send raw reply: %m");
+	wsreq_reply(wsreq, NULL, strndup(buffer, size), 0);
 }
 
 static int wsreq_subscribe(struct afb_wsreq *wsreq, struct afb_event event)
@@ -25,6 +25,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <poll.h>
+#include <sys/socket.h>
 
 #include <systemd/sd-event.h>
 
@@ -43,6 +44,7 @@ static void aws_on_text(struct afb_ws *ws, int last, size_t size);
 static void aws_on_binary(struct afb_ws *ws, int last, size_t size);
 static void aws_on_continue(struct afb_ws *ws, int last, size_t size);
 static void aws_on_readable(struct afb_ws *ws);
+static void aws_on_writable(struct afb_ws *ws);
 static void aws_on_error(struct afb_ws *ws, uint16_t code, const void *data, size_t size);
 
 static struct websock_itf aws_itf = {
@@ -91,6 +93,7 @@ struct afb_ws
 	struct websock *ws;	/* the websock handler */
 	sd_event_source *evsrc;	/* the event source for the socket */
 	struct buf buffer;	/* the last read fragment */
+	struct buf output;	/* the data waiting to be written */
 };
 
 /*
@@ -117,6 +120,9 @@ static void aws_disconnect(struct afb_ws *ws, int call_on_hangup)
 		ws->evsrc = NULL;
 		websock_destroy(wsi);
 		free(aws_pick_buffer(ws).buffer);
+		free(ws->output.buffer);
+		ws->output.buffer = NULL;
+		ws->output.size = 0;
 		ws->state = waiting;
 		if (call_on_hangup && ws->itf->on_hangup)
 			ws->itf->on_hangup(ws->closure);
@@ -127,6 +133,8 @@ static int io_event_callback(sd_event_source *src, int fd, uint32_t revents, voi
 {
 	if ((revents & EPOLLIN) != 0)
 		aws_on_readable(ws);
+	if ((revents & EPOLLOUT) != 0)
+		aws_on_writable(ws);
 	if ((revents & EPOLLHUP) != 0)
 		afb_ws_hangup(ws);
 	return 0;
@@ -160,6 +168,8 @@ struct afb_ws *afb_ws_create(struct sd_event *eloop, int fd, const struct afb_ws
 	result->closure = closure;
 	result->buffer.buffer = NULL;
 	result->buffer.size = 0;
+	result->output.buffer = NULL;
+	result->output.size = 0;
 
 	/* creates the websocket */
 	result->ws = websock_create_v13(&aws_itf, result);
@@ -209,6 +219,15 @@ int afb_ws_is_connected(struct afb_ws *ws)
 	return ws->ws != NULL;
 }
 
+/*
+ * Is the websocket 'ws' connected and without data waiting to be written?
+ * When it is not, the callback 'on_writable' tells when it becomes so.
+ */
+int afb_ws_is_writable(struct afb_ws *ws)
+{
+	return ws->ws != NULL && ws->output.size == 0;
+}
+
 /*
  * Sends a 'close' command to the endpoint of 'ws' with the 'code' and the
  * 'reason' (that can be NULL and that else should not be greater than 123
@@ -304,6 +323,36 @@ int afb_ws_text_v(struct afb_ws *ws, const struct iovec *iovec, int count)
 	return websock_text_v(ws->ws, 1, iovec, count);
 }
 
+/*
+ * Sends the 'count' text messages of 'iovec' to the endpoint of 'ws'
+ * at once, each 'iovec' being one message.
+ * Returns 0 on success or -1 in case of error.
+ */
+int afb_ws_text_messages(struct afb_ws *ws, const struct iovec *iovec, int count)
+{
+	if (ws->ws == NULL) {
+		/* disconnected */
+		errno = EPIPE;
+		return -1;
+	}
+	return websock_text_messages(ws->ws, iovec, count);
+}
+
+/*
+ * Sends the 'count' binary messages of 'iovec' to the endpoint of 'ws'
+ * at once, each 'iovec' being one message.
+ * Returns 0 on success or -1 in case of error.
+ */
+int afb_ws_binary_messages(struct afb_ws *ws, const struct iovec *iovec, int count)
+{
+	if (ws->ws == NULL) {
+		/* disconnected */
+		errno = EPIPE;
+		return -1;
+	}
+	return websock_binary_messages(ws->ws, iovec, count);
+}
+
 /*
  * Sends a binary 'data' of 'length' to the endpoint of 'ws'.
  * Returns 0 on success or -1 in case of error.
@@ -333,26 +382,56 @@ int afb_ws_binary_v(struct afb_ws *ws, const struct iovec *iovec, int count)
 }
 
 /*
- * callback for writing data
+ * callback for writing data: never blocks, the data that can't be
+ * written are kept in the output of 'ws' and written when the socket
+ * is writable again.
  */
 static ssize_t aws_writev(struct afb_ws *ws, const struct iovec *iov, int iovcnt)
 {
+	int i;
 	ssize_t rc;
-	for (;;) {
-		rc = writev(ws->fd, iov, iovcnt);
+	size_t total, skip, len;
+	char *buffer;
+
+	/* writes directly if nothing is waiting, keeping the order */
+	rc = 0;
+	if (ws->output.size == 0) {
+		do {
+			rc = writev(ws->fd, iov, iovcnt);
+		} while (rc == -1 && errno == EINTR);
 		if (rc == -1) {
-			if (errno == EINTR)
-				continue;
-			else if (errno == EAGAIN) {
-				struct pollfd pfd;
-				pfd.fd = ws->fd;
-				pfd.events = POLLOUT;
-				poll(&pfd, 1, 10);
-				continue;
+			if (errno != EAGAIN)
+				return -1;
+			rc = 0;
+		}
+	}
+
+	/* keeps the data not written */
+	for (total = 0, i = 0 ; i < iovcnt ; i++)
+		total += iov[i].iov_len;
+	if ((size_t)rc < total) {
+		buffer = realloc(ws->output.buffer, ws->output.size + total - (size_t)rc);
+		if (buffer == NULL) {
+			/* the stream is cut, the loop will hang up */
+			shutdown(ws->fd, SHUT_RDWR);
+			errno = ENOMEM;
+			return -1;
+		}
+		if (ws->output.size == 0)
+			sd_event_source_set_io_events(ws->evsrc, EPOLLIN|EPOLLOUT);
+		ws->output.buffer = buffer;
+		for (skip = (size_t)rc, i = 0 ; i < iovcnt ; i++) {
+			len = iov[i].iov_len;
+			if (skip >= len)
+				skip -= len;
+			else {
+				memcpy(&buffer[ws->output.size], (char*)iov[i].iov_base + skip, len - skip);
+				ws->output.size += len - skip;
+				skip = 0;
 			}
 		}
-		return rc;
 	}
+	return (ssize_t)total;
 }
 
 /*
@@ -384,6 +463,38 @@ static void aws_on_readable(struct afb_ws *ws)
 		afb_ws_hangup(ws);
 }
 
+/*
+ * callback on writable socket: writes the data waiting and
+ * calls on_writable when all are written
+ */
+static void aws_on_writable(struct afb_ws *ws)
+{
+	ssize_t rc;
+
+	if (ws->ws == NULL || ws->output.size == 0)
+		return;
+
+	do {
+		rc = write(ws->fd, ws->output.buffer, ws->output.size);
+	} while (rc == -1 && errno == EINTR);
+	if (rc == -1) {
+		if (errno != EAGAIN)
+			afb_ws_hangup(ws);
+		return;
+	}
+
+	ws->output.size -= (size_t)rc;
+	if (ws->output.size != 0)
+		memmove(ws->output.buffer, &ws->output.buffer[rc], ws->output.size);
+	else {
+		free(ws->output.buffer);
+		ws->output.buffer = NULL;
+		sd_event_source_set_io_events(ws->evsrc, EPOLLIN);
+		if (ws->itf->on_writable != NULL)
+			ws->itf->on_writable(ws->closure);
+	}
+}
+
 /*
  * Reads from the websocket handled by 'ws' data of length 'size'
  * and append it to the current buffer of 'ws'.
@@ -28,12 +28,14 @@ struct afb_ws_itf
 	void (*on_binary) (void *, char *, size_t size);
 	void (*on_error) (void *, uint16_t code, const void *, size_t size); /* optional, if not set hangup is called */
 	void (*on_hangup) (void *); /* optional, it is safe too call afb_ws_destroy within the callback */
+	void (*on_writable) (void *); /* optional, called when the data waiting are written */
 };
 
 extern struct afb_ws *afb_ws_create(struct sd_event *eloop, int fd, const struct afb_ws_itf *itf, void *closure);
 extern void afb_ws_destroy(struct afb_ws *ws);
 extern void afb_ws_hangup(struct afb_ws *ws);
 extern int afb_ws_is_connected(struct afb_ws *ws);
+extern int afb_ws_is_writable(struct afb_ws *ws);
 extern int afb_ws_close(struct afb_ws *ws, uint16_t code, const char *reason);
 extern int afb_ws_error(struct afb_ws *ws, uint16_t code, const char *reason);
 extern int afb_ws_text(struct afb_ws *ws, const char *text, size_t length);
@@ -41,4 +43,6 @@ extern int afb_ws_texts(struct afb_ws *ws, ...);
 extern int afb_ws_binary(struct afb_ws *ws, const void *data, size_t length);
 extern int afb_ws_text_v(struct afb_ws *ws, const struct iovec *iovec, int count);
 extern int afb_ws_binary_v(struct afb_ws *ws, const struct iovec *iovec, int count);
+extern int afb_ws_text_messages(struct afb_ws *ws, const struct iovec *iovec, int count);
+extern int afb_ws_binary_messages(struct afb_ws *ws, const struct iovec *iovec, int count);
 
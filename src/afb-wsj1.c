@@ -23,6 +23,7 @@
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #include <json-c/json.h>
 
@@ -36,10 +37,12 @@
 
 static void wsj1_on_hangup(struct afb_wsj1 *wsj1);
 static void wsj1_on_text(struct afb_wsj1 *wsj1, char *text, size_t size);
+static void wsj1_on_writable(struct afb_wsj1 *wsj1);
 
 static struct afb_ws_itf wsj1_itf = {
 	.on_hangup = (void*)wsj1_on_hangup,
-	.on_text = (void*)wsj1_on_text
+	.on_text = (void*)wsj1_on_text,
+	.on_writable = (void*)wsj1_on_writable
 };
 
 struct wsj1_call
@@ -75,6 +78,7 @@ struct afb_wsj1
 	void *closure;
 	struct json_tokener *tokener;
 	struct afb_ws *ws;
+	pthread_mutex_t mutex;
 	struct afb_wsj1_msg *messages;
 	struct wsj1_call *calls;
 };
@@ -92,6 +96,7 @@ struct afb_wsj1 *afb_wsj1_create(struct sd_event *eloop, int fd, struct afb_wsj1
 	result->refcount = 1;
 	result->itf = itf;
 	result->closure = closure;
+	pthread_mutex_init(&result->mutex, NULL);
 
 	result->tokener = json_tokener_new();
 	if (result->tokener == NULL)
@@ -115,14 +120,15 @@ error:
 void afb_wsj1_addref(struct afb_wsj1 *wsj1)
 {
 	if (wsj1 != NULL)
-		wsj1->refcount++;
+		__atomic_add_fetch(&wsj1->refcount, 1, __ATOMIC_RELAXED);
 }
 
 void afb_wsj1_unref(struct afb_wsj1 *wsj1)
 {
-	if (wsj1 != NULL && !--wsj1->refcount) {
+	if (wsj1 != NULL && !__atomic_sub_fetch(&wsj1->refcount, 1, __ATOMIC_ACQ_REL)) {
 		afb_ws_destroy(wsj1->ws);
 		json_tokener_free(wsj1->tokener);
+		pthread_mutex_destroy(&wsj1->mutex);
 		free(wsj1);
 	}
 }
@@ -133,6 +139,12 @@ static void wsj1_on_hangup(struct afb_wsj1 *wsj1)
 		wsj1->itf->on_hangup(wsj1->closure, wsj1);
 }
 
+static void wsj1_on_writable(struct afb_wsj1 *wsj1)
+{
+	if (wsj1->itf->on_writable != NULL)
+		wsj1->itf->on_writable(wsj1->closure, wsj1);
+}
+
 
 static struct wsj1_call *wsj1_call_search(struct afb_wsj1 *wsj1, const char *id, int remove)
 {
@@ -301,10 +313,12 @@ static void wsj1_on_text(struct afb_wsj1 *wsj1, char *text, size_t size)
 	msg->refcount = 1;
 	afb_wsj1_addref(wsj1);
 	msg->wsj1 = wsj1;
+	pthread_mutex_lock(&wsj1->mutex);
 	msg->next = wsj1->messages;
 	if (msg->next != NULL)
 		msg->next->previous = msg;
 	wsj1->messages = msg;
+	pthread_mutex_unlock(&wsj1->mutex);
 
 	/* incoke the handler */
 	switch (msg->code) {
@@ -333,19 +347,21 @@ alloc_error:
 void afb_wsj1_msg_addref(struct afb_wsj1_msg *msg)
 {
 	if (msg != NULL)
-		msg->refcount++;
+		__atomic_add_fetch(&msg->refcount, 1, __ATOMIC_RELAXED);
 }
 
 void afb_wsj1_msg_unref(struct afb_wsj1_msg *msg)
 {
-	if (msg != NULL && --msg->refcount == 0) {
+	if (msg != NULL && __atomic_sub_fetch(&msg->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
 		/* unlink the message */
+		pthread_mutex_lock(&msg->wsj1->mutex);
 		if (msg->next != NULL)
 			msg->next->previous = msg->previous;
 		if (msg->previous == NULL)
 			msg->wsj1->messages = msg->next;
 		else
 			msg->previous->next = msg->next;
+		pthread_mutex_unlock(&msg->wsj1->mutex);
 		/* free ressources */
 		afb_wsj1_unref(msg->wsj1);
 		json_object_put(msg->object_j);
@@ -429,6 +445,16 @@ int afb_wsj1_close(struct afb_wsj1 *wsj1, uint16_t code, const char *text)
 	return afb_ws_close(wsj1->ws, code, text);
 }
 
+void afb_wsj1_hangup(struct afb_wsj1 *wsj1)
+{
+	afb_ws_hangup(wsj1->ws);
+}
+
+int afb_wsj1_is_writable(struct afb_wsj1 *wsj1)
+{
+	return afb_ws_is_writable(wsj1->ws);
+}
+
 static int wsj1_send_isot(struct afb_wsj1 *wsj1, int i1, const char *s1, const char *o1, const char *t1)
 {
 	char code[2] = { (char)('0' + i1), 0 };
@@ -454,6 +480,28 @@ int afb_wsj1_send_event_s(struct afb_wsj1 *wsj1, const char *event, const char *
 	return wsj1_send_isot(wsj1, EVENT, event, object, NULL);
 }
 
+char *afb_wsj1_encode_event(const char *event, const char *object, size_t *length)
+{
+	char *text;
+	int rc;
+
+	rc = asprintf(&text, "[%d,\"%s\",%s]", EVENT, event, object == NULL ? "null" : object);
+	if (rc < 0)
+		return NULL;
+	*length = (size_t)rc;
+	return text;
+}
+
+int afb_wsj1_send_encoded(struct afb_wsj1 *wsj1, const char *text, size_t length)
+{
+	return afb_ws_text(wsj1->ws, text, length);
+}
+
+int afb_wsj1_send_encodeds(struct afb_wsj1 *wsj1, const struct iovec *texts, int count)
+{
+	return afb_ws_text_messages(wsj1->ws, texts, count);
+}
+
 int afb_wsj1_call_j(struct afb_wsj1 *wsj1, const char *api, const char *verb, struct json_object *object, void (*on_reply)(void *closure, struct afb_wsj1_msg *msg), void *closure)
 {
 	const char *objstr = json_object_to_json_string_ext(object, JSON_C_TO_STRING_PLAIN);
@@ -22,6 +22,7 @@ struct afb_wsj1_msg;
 
 struct json_object;
 struct sd_event;
+struct iovec;
 
 /*
  * Interface for callback functions.
@@ -45,6 +46,12 @@ struct afb_wsj1_itf {
 	 * This function is called on incoming event
 	 */
 	void (*on_event)(void *closure, const char *event, struct afb_wsj1_msg *msg);
+
+	/*
+	 * This function, optional, is called when 'wsj1' becomes writable
+	 * again, all the data waiting being written.
+	 */
+	void (*on_writable)(void *closure, struct afb_wsj1 *wsj1);
 };
 
 /*
@@ -76,6 +83,18 @@ extern void afb_wsj1_unref(struct afb_wsj1 *wsj1);
  */
 extern int afb_wsj1_close(struct afb_wsj1 *wsj1, uint16_t code, const char *text);
 
+/*
+ * Hangs up 'wsj1' without sending anything.
+ * The callback 'on_hangup' is called.
+ */
+extern void afb_wsj1_hangup(struct afb_wsj1 *wsj1);
+
+/*
+ * Returns not zero when 'wsj1' has no data waiting to be written.
+ * Otherwise, the callback 'on_writable' is called when it becomes so.
+ */
+extern int afb_wsj1_is_writable(struct afb_wsj1 *wsj1);
+
 /*
  * Sends on 'wsj1' the event of name 'event' with the
  * data 'object'. If not NULL, 'object' should be a valid
@@ -92,6 +111,30 @@ extern int afb_wsj1_send_event_s(struct afb_wsj1 *wsj1, const char *event, const
  */
 extern int afb_wsj1_send_event_j(struct afb_wsj1 *wsj1, const char *event, struct json_object *object);
 
+/*
+ * Encodes the message of the event of name 'event' with the
+ * data 'object' that, if not NULL, should be a valid JSON string.
+ * The returned text, allocated with malloc, can be sent
+ * on any wsj1 using 'afb_wsj1_send_encoded'. Its length is
+ * stored in 'length'.
+ * Return the text in case of success or NULL when out of memory.
+ */
+extern char *afb_wsj1_encode_event(const char *event, const char *object, size_t *length);
+
+/*
+ * Sends on 'wsj1' the message 'text' of 'length' as encoded
+ * by 'afb_wsj1_encode_event'.
+ * Return 0 in case of success. Otherwise, returns -1 and set errno.
+ */
+extern int afb_wsj1_send_encoded(struct afb_wsj1 *wsj1, const char *text, size_t length);
+
+/*
+ * Sends on 'wsj1' at once the 'count' messages of 'texts' as
+ * encoded by 'afb_wsj1_encode_event'.
+ * Return 0 in case of success. Otherwise, returns -1 and set errno.
+ */
+extern int afb_wsj1_send_encodeds(struct afb_wsj1 *wsj1, const struct iovec *texts, int count);
+
 /*
  * Sends on 'wsj1' a call to the method of 'api'/'verb' with arguments
  * given by 'object'. If not NULL, 'object' should be a valid JSON string.
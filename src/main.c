@@ -26,6 +26,8 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <systemd/sd-event.h>
 
@@ -43,7 +45,11 @@
 #include "session.h"
 #include "verbose.h"
 #include "afb-common.h"
+#include "afb-completion.h"
 #include "afb-hook.h"
+#include "afb-monitor.h"
+#include "afb-rate.h"
+#include "afb-evt.h"
 
 #include <afb/afb-binding.h>
 
@@ -96,6 +102,25 @@
 
 #define SET_TRACEREQ       27
 
+#define SET_WORKERS_MIN    28
+#define SET_WORKERS_MAX    29
+#define SET_WORKERS_IDLE   30
+#define SET_JOBS_MAX       31
+
+#define SET_REACTORS       32
+
+#define SET_SESSION_MEMORY 33
+
+#define SET_RATE_SESSION   34
+#define ADD_RATE_VERB      35
+
+#define SET_SESSION_SHARED 36
+
+#define ADD_EVENT_RATE     37
+#define SET_EVENT_QUEUE    38
+
+#define SET_CLIENT_WEIGHTS 39
+
 // Command line structure hold cli --command + help text
 typedef struct {
   int  val;        // command number within application
@@ -141,9 +166,24 @@ static  AFB_options cliOptions [] = {
   {SO_BINDING       ,1,"binding"         , "load the binding of path"},
 
   {SET_SESSIONMAX   ,1,"session-max"     , "max count of session simultaneously [default 10]"},
+  {SET_SESSION_MEMORY,1,"session-memory" , "kilobytes of memory for sessions, idle ones are evicted [default 0: no limit]"},
+  {SET_SESSION_SHARED,0,"session-shared" , "share the sessions with the daemons using the same sessiondir"},
 
   {SET_TRACEREQ     ,1,"tracereq"        , "log the requests: no, common, extra, all"},
 
+  {SET_WORKERS_MIN  ,1,"workers-min"     , "min count of threads processing requests [default 1]"},
+  {SET_WORKERS_MAX  ,1,"workers-max"     , "max count of threads processing requests [default 3]"},
+  {SET_WORKERS_IDLE ,1,"workers-idle"    , "seconds of idleness before stopping a thread [default 30]"},
+  {SET_JOBS_MAX     ,1,"jobs-max"        , "max count of requests waiting a thread [default 20]"},
+  {SET_CLIENT_WEIGHTS,1,"client-weights" , "weights of the sessions for sharing the threads by LOA: W0[,W1[,...]] [default 1]"},
+
+  {SET_REACTORS     ,1,"reactors"        , "count of event loops serving HTTP [default 1]"},
+
+  {SET_RATE_SESSION ,1,"rate-session"    , "limit of calls per second of each session: RATE[:BURST] [default no limit]"},
+  {ADD_RATE_VERB    ,1,"rate-verb"       , "limit of calls per second of a verb by each session: API/VERB=RATE[:BURST]"},
+  {ADD_EVENT_RATE   ,1,"event-rate"      , "limit of deliveries per second of an event to each subscriber: EVENT[*]=RATE"},
+  {SET_EVENT_QUEUE  ,1,"event-queue"     , "queue of events of each client: SIZE[:drop-oldest|drop-newest|coalesce|disconnect] [default 1024:drop-oldest]"},
+
   {0, 0, NULL, NULL}
  };
 
@@ -214,6 +254,20 @@ static void config_set_default (struct afb_config * config)
    if (config->nbSessionMax == 0)
        config->nbSessionMax = CTX_NBCLIENTS;
 
+   // threads processing requests
+   if (config->workersMin == 0)
+       config->workersMin = DEFLT_WORKERS_MIN;
+   if (config->workersMax == 0)
+       config->workersMax = DEFLT_WORKERS_MAX;
+   if (config->workersMax < config->workersMin)
+       config->workersMax = config->workersMin;
+   if (config->workersIdle == 0)
+       config->workersIdle = DEFLT_WORKERS_IDLE;
+   if (config->jobsMax == 0)
+       config->jobsMax = DEFLT_JOBS_MAX;
+   if (config->reactors == 0)
+       config->reactors = DEFLT_REACTORS;
+
    if (config->rootdir == NULL) {
        config->rootdir = getenv("AFBDIR");
        if (config->rootdir == NULL) {
@@ -388,6 +442,57 @@ static void parse_arguments(int argc, char *argv[], struct afb_config *config)
        if (!sscanf (optarg, "%d", &config->nbSessionMax)) goto notAnInteger;
        break;
 
+    case SET_SESSION_MEMORY:
+       if (optarg == 0) goto needValueForOption;
+       if (!sscanf (optarg, "%d", &config->sessionMemory) || config->sessionMemory < 0) goto notAnInteger;
+       break;
+
+    case SET_SESSION_SHARED:
+       if (optarg != 0) goto noValueForOption;
+       config->sessionShared = 1;
+       break;
+
+    case SET_WORKERS_MIN:
+       if (optarg == 0) goto needValueForOption;
+       if (!sscanf (optarg, "%d", &config->workersMin) || config->workersMin < 0) goto notAnInteger;
+       break;
+
+    case SET_WORKERS_MAX:
+       if (optarg == 0) goto needValueForOption;
+       if (!sscanf (optarg, "%d", &config->workersMax) || config->workersMax < 1) goto notAnInteger;
+       break;
+
+    case SET_WORKERS_IDLE:
+       if (optarg == 0) goto needValueForOption;
+       if (!sscanf (optarg, "%d", &config->workersIdle) || config->workersIdle < 0) goto notAnInteger;
+       break;
+
+    case SET_JOBS_MAX:
+       if (optarg == 0) goto needValueForOption;
+       if (!sscanf (optarg, "%d", &config->jobsMax) || config->jobsMax < 0) goto notAnInteger;
+       break;
+
+    case SET_CLIENT_WEIGHTS:
+       if (optarg == 0) goto needValueForOption;
+       config->clientWeights = optarg;
+       break;
+
+    case SET_REACTORS:
+       if (optarg == 0) goto needValueForOption;
+       if (!sscanf (optarg, "%d", &config->reactors) || config->reactors < 1) goto notAnInteger;
+       break;
+
+    case SET_EVENT_QUEUE:
+       if (optarg == 0) goto needValueForOption;
+       if (optarg[0] < '0' || optarg[0] > '9') goto notAnInteger;
+       config->eventQueue = optarg;
+       break;
+
+    case SET_RATE_SESSION:
+       if (optarg == 0) goto needValueForOption;
+       config->rateSession = optarg;
+       break;
+
     case SET_FORGROUND:
        if (optarg != 0) goto noValueForOption;
        config->background  = 0;
@@ -416,6 +521,8 @@ static void parse_arguments(int argc, char *argv[], struct afb_config *config)
     case WS_CLIENT:
     case WS_SERVICE:
     case SO_BINDING:
+    case ADD_RATE_VERB:
+    case ADD_EVENT_RATE:
        if (optarg == 0) goto needValueForOption;
        add_item(config, optc, optarg);
        break;
@@ -552,11 +659,6 @@ static struct afb_hsrv *start_http_server(struct afb_config * config)
 	int rc;
 	struct afb_hsrv *hsrv;
 
-	if (afb_hreq_init_download_path("/tmp")) { /* TODO: sessiondir? */
-		ERROR("unable to set the tmp directory");
-		return NULL;
-	}
-
 	hsrv = afb_hsrv_create();
 	if (hsrv == NULL) {
 		ERROR("memory allocation failure");
@@ -573,7 +675,7 @@ static struct afb_hsrv *start_http_server(struct afb_config * config)
 	NOTICE("Waiting port=%d rootdir=%s", config->httpdPort, config->rootdir);
 	NOTICE("Browser URL= http:/*localhost:%d", config->httpdPort);
 
-	rc = afb_hsrv_start(hsrv, (uint16_t) config->httpdPort, 15);
+	rc = afb_hsrv_start(hsrv, (uint16_t) config->httpdPort, 15, config->reactors > 1);
 	if (!rc) {
 		ERROR("starting of httpd failed");
 		afb_hsrv_put(hsrv);
@@ -583,6 +685,102 @@ static struct afb_hsrv *start_http_server(struct afb_config * config)
 	return hsrv;
 }
 
+/*---------------------------------------------------------
+ | reactors: extra event loops, each one with its own
+ | HTTP server listening the same port (SO_REUSEPORT)
+ +--------------------------------------------------------- */
+
+static pthread_mutex_t reactors_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reactors_cond = PTHREAD_COND_INITIALIZER;
+static int reactors_created;   // count of created reactors
+static int reactors_pending;   // count of reactors not yet started
+static int reactors_failed;    // count of reactors that failed to start
+static cpu_set_t reactors_cpus; // the cores allowed to the process
+
+// pins the calling thread to the core of the reactor of 'index'
+static void pin_reactor(int index)
+{
+	cpu_set_t set;
+	int count, cpu;
+
+	count = CPU_COUNT(&reactors_cpus);
+	if (count == 0)
+		return;
+	index %= count;
+	for (cpu = 0 ; cpu < CPU_SETSIZE ; cpu++)
+		if (CPU_ISSET(cpu, &reactors_cpus) && index-- == 0)
+			break;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof set, &set) != 0)
+		WARNING("can't pin the reactor %d to a core", index);
+}
+
+// reports the end of the startup of a reactor
+static void reactor_started(int failed)
+{
+	pthread_mutex_lock(&reactors_mutex);
+	reactors_pending--;
+	reactors_failed += failed;
+	pthread_cond_signal(&reactors_cond);
+	pthread_mutex_unlock(&reactors_mutex);
+}
+
+// main of the threads of the reactors
+static void *run_reactor(void *arg)
+{
+	struct afb_config *config = arg;
+	struct sd_event *eventloop;
+	int index;
+
+	pthread_mutex_lock(&reactors_mutex);
+	index = ++reactors_created;
+	pthread_mutex_unlock(&reactors_mutex);
+	pin_reactor(index);
+
+	eventloop = afb_common_set_thread_event_loop();
+	if (eventloop == NULL || afb_completion_init() < 0
+	 || start_http_server(config) == NULL) {
+		ERROR("failed to start the reactor %d", index);
+		reactor_started(1);
+		return NULL;
+	}
+	reactor_started(0);
+
+	for(;;)
+		sd_event_run(eventloop, 30000000);
+	return NULL;
+}
+
+// starts the reactors in addition to the main loop
+static int start_reactors(struct afb_config *config)
+{
+	pthread_t tid;
+	int i;
+
+	if (config->reactors <= 1)
+		return 0;
+
+	/* the cores allowed by taskset or cgroups, before pinning */
+	if (sched_getaffinity(0, sizeof reactors_cpus, &reactors_cpus) < 0)
+		CPU_ZERO(&reactors_cpus);
+	pin_reactor(0);
+	reactors_pending = config->reactors - 1;
+	for (i = 1 ; i < config->reactors ; i++) {
+		if (pthread_create(&tid, NULL, run_reactor, config) != 0) {
+			ERROR("can't create the thread of a reactor");
+			return -1;
+		}
+		pthread_detach(tid);
+	}
+
+	pthread_mutex_lock(&reactors_mutex);
+	while (reactors_pending > 0)
+		pthread_cond_wait(&reactors_cond, &reactors_mutex);
+	pthread_mutex_unlock(&reactors_mutex);
+	return reactors_failed ? -1 : 0;
+}
+
 static void start_items(struct afb_config_item *item)
 {
   if (item != NULL) {
@@ -619,6 +817,14 @@ static void start_items(struct afb_config_item *item)
 	exit(1);
       }
       break;
+    case ADD_RATE_VERB:
+      if (afb_rate_add_verb(item->value) < 0)
+	exit(1);
+      break;
+    case ADD_EVENT_RATE:
+      if (afb_evt_add_rate(item->value) < 0)
+	exit(1);
+      break;
     default:
       ERROR("unexpected internal error");
       exit(1);
@@ -653,6 +859,8 @@ int main(int argc, char *argv[])  {
   }
 
   afb_api_so_set_timeout(config->apiTimeout);
+  if (config->clientWeights != NULL && afb_api_so_set_client_weights(config->clientWeights) < 0)
+     exit(1);
   if (config->ldpaths) {
     if (afb_api_so_add_pathset(config->ldpaths) < 0) {
       ERROR("initialisation of bindings within %s failed", config->ldpaths);
@@ -660,10 +868,23 @@ int main(int argc, char *argv[])  {
     }
   }
 
+  if (config->eventQueue != NULL && afb_evt_set_queue(config->eventQueue) < 0)
+     exit(1);
+
   start_items(config->items);
   config->items = NULL;
 
-  ctxStoreInit(config->nbSessionMax, config->cntxTimeout, config->token, afb_apis_count());
+  if (afb_monitor_init() < 0) {
+     ERROR("initialisation of the monitoring failed");
+     exit(1);
+  }
+
+  if (config->rateSession != NULL && afb_rate_set_session(config->rateSession) < 0)
+     exit(1);
+
+  ctxStoreSetBudget((size_t)config->sessionMemory * 1024);
+  ctxStoreSetShared(config->sessionShared);
+  ctxStoreInit(config->nbSessionMax, config->cntxTimeout, config->token, afb_apis_count(), config->sessiondir);
   if (!afb_hreq_init_cookie(config->httpdPort, config->rootapi, DEFLT_CNTX_TIMEOUT)) {
      ERROR("initialisation of cookies failed");
      exit (1);
@@ -679,7 +900,8 @@ int main(int argc, char *argv[])  {
      return 1;
   }
 
-  if (afb_thread_init(3, 1, 20) < 0) {
+  afb_thread_set_idle_timeout(config->workersIdle);
+  if (afb_thread_init(config->workersMax, config->workersMin, config->jobsMax) < 0) {
      ERROR("failed to initialise threading");
      return 1;
   }
@@ -706,6 +928,24 @@ int main(int argc, char *argv[])  {
   /* ignore any SIGPIPE */
   signal(SIGPIPE, SIG_IGN);
 
+  /* replies of the workers are sent by the main loop */
+  if (afb_completion_init() < 0) {
+     ERROR("failed to initialise the completion queue");
+     exit(1);
+  }
+
+  /* sessions expire on timer of the main loop */
+  if (ctxStoreSetEventLoop(afb_common_get_main_event_loop()) < 0) {
+     ERROR("failed to initialise the expiration of sessions");
+     exit(1);
+  }
+
+  /* delayed deliveries of events on timer of the main loop */
+  if (afb_evt_set_event_loop(afb_common_get_main_event_loop()) < 0) {
+     ERROR("failed to initialise the delivery of events");
+     exit(1);
+  }
+
   /* install trace of requests */
   switch(config->tracereq) {
   default:
@@ -723,10 +963,18 @@ int main(int argc, char *argv[])  {
   }
 
    /* start the HTTP server */
+   if (afb_hreq_init_download_path("/tmp")) { /* TODO: sessiondir? */
+	ERROR("unable to set the tmp directory");
+	exit(1);
+   }
    hsrv = start_http_server(config);
    if (hsrv == NULL)
 	exit(1);
 
+   /* start the other event loops */
+   if (start_reactors(config) < 0)
+	exit(1);
+
    /* start the services */
    if (afb_apis_start_all_services(1) < 0)
 	exit(1);
@@ -24,23 +24,44 @@
 #include <uuid/uuid.h>
 #include <assert.h>
 #include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 
 #include <json-c/json.h>
+#include <systemd/sd-event.h>
 
 #include "session.h"
 #include "verbose.h"
 
 #define NOW (time(NULL))
 
-struct client_value
-{
-	void *value;
-	void (*free_value)(void*);
-};
+#define STORE_MIN_SIZE 16   // minimal size of the hash table of sessions (power of 2)
+#define HEAP_MIN_SIZE  16   // minimal size of the heap of expirations
+#define SHARD_BITS     4    // the store is split in 2^SHARD_BITS shards
+#define SHARD_COUNT    (1 << SHARD_BITS)
+
+#define EVICT_SAMPLE   16   // count of idle sessions compared for eviction
+#define COOKIES_MIN    4    // minimal size of the map of cookies (power of 2)
+#define RANDOM_POOL    512  // size of the per thread pool of random bytes for ids
+
+#define SNAPSHOT_NAME  "sessions.snapshot"  // name of the snapshot in sessiondir
+#define SNAPSHOT_MAGIC 0x32534641u          // "AFS2" in little endian
+#define SNAPSHOT_MIN   64                   // minimal count of records of the snapshot
 
+#define SHARED_NAME    "sessions.shared"    // name of the shared store in sessiondir
+#define SHARED_MAGIC   0x48534641u          // "AFSH" in little endian
+#define SHARED_MIN     256                  // minimal count of records of the shared store
+#define SHARED_TRIES   1000                 // reads of a record being written before giving up
+
+// entry of the map of cookies, free when key is NULL
 struct cookie
 {
-	struct cookie *next;
 	const void *key;
 	void *value;
 	void (*free_value)(void*);
@@ -48,200 +69,1228 @@ struct cookie
 
 struct AFB_clientCtx
 {
-	unsigned refcount;
-	unsigned loa;
+	unsigned refcount;    // atomic, the store holds one reference until closing
+	unsigned hash;        // hash code of the uuid
+	unsigned heapidx;     // 1 + index in the heap of expirations or 0 when not in
+	unsigned slot;        // 1 + index of the record in the snapshot or 0 when none
+	unsigned loa;         // level of assurance (atomic)
 	int timeout;
 	time_t expiration;    // expiration time of the token
 	time_t access;
-	char uuid[37];        // long term authentication of remote client
-	char token[37];       // short term authentication of remote client
-	struct client_value *values;
-	struct cookie *cookies;
+	uuid_t uuid;          // long term authentication of remote client
+	uuid_t token;         // short term authentication of remote client
+	char hastoken;        // is token set? otherwise the token is sessions.initok
+	char closed;          // is the session closed? (atomic)
+	char shared;          // is the session recorded in the shared store?
+	char lock;            // spin lock of the cookies and of the texts
+	char uuidtxt[37];     // text of uuid or empty when not yet computed
+	char tokentxt[37];    // text of token or empty when not yet computed
+	struct cookie *cookies;   // open addressing map of cookies and values or NULL
+	uint16_t ncookies;        // count of cookies in the map
+	uint16_t szcookies;       // size of the map (power of 2) or 0
+};
+
+// A shard is an open addressing hash table indexed by hash code of uuid
+struct shard
+{
+  pthread_rwlock_t lock;          // protects the shard, lookups only read
+  struct AFB_clientCtx **store;   // sessions store, NULL or DELETED for free slots
+  unsigned size;                  // size of the store (power of 2)
+  unsigned used;                  // count of slots not NULL (sessions or DELETED)
+  unsigned count;                 // count of sessions in the shard
+  unsigned cursor;                // where to continue sampling for eviction
 };
 
-// Session UUID are store in a simple array [for 10 sessions this should be enough]
+// Session are stored in shards selected by the high bits of the hash code
 static struct {
-  pthread_mutex_t mutex;          // declare a mutex to protect hash table
-  struct AFB_clientCtx **store;          // sessions store
-  int count;                      // current number of sessions
+  struct shard shards[SHARD_COUNT]; // the shards of the store
+  pthread_mutex_t mutex;          // declare a mutex to protect the heap
+  struct AFB_clientCtx **heap;    // min-heap of the sessions by expiration
+  unsigned heapsize;              // allocated size of the heap
+  unsigned heapcount;             // count of sessions in the heap
+  int timerfd;                    // timer of the next expiration
+  time_t armed;                   // expiration set for timerfd
+  struct sd_event_source *timersrc; // event source of timerfd
+  int count;                      // current number of sessions (atomic)
   int max;
+  size_t memory;                  // memory used by sessions (atomic)
+  size_t budget;                  // memory allowed for sessions or 0 when unlimited
+  unsigned evictshard;            // next shard to sample for eviction (atomic)
+  unsigned long evictions;        // count of evicted sessions (atomic)
+  unsigned long rejections;       // count of sessions refused (atomic)
   int timeout;
   int apicount;
+  char *valuekeys;                // the addresses of its items are the keys of values
   char initok[37];
 } sessions;
 
-/* generate a uuid */
-static void new_uuid(char uuid[37])
+// record of a session in the snapshot file
+struct snapshot_record
+{
+	uint8_t uuid[16];
+	uint8_t token[16];
+	uint32_t flags;       // SNAPSHOT_USED and SNAPSHOT_TOKEN
+	uint32_t loa;
+	int32_t timeout;
+	uint32_t reserved;
+	int64_t expiration;
+};
+
+#define SNAPSHOT_USED  1  // the record is used by a session
+#define SNAPSHOT_TOKEN 2  // the token of the record is set
+
+// header of the snapshot file, followed by the records
+struct snapshot_header
+{
+	uint32_t magic;
+	uint32_t count;       // count of records
+};
+
+// Sessions are saved in a file mapped in memory to survive restarts
+static struct {
+  pthread_rwlock_t lock;          // read locked for writing records, write locked for growing
+  pthread_mutex_t mutex;          // protects the free records
+  int fd;                         // the file or -1 when not saving
+  int loading;                    // is the snapshot being loaded?
+  size_t size;                    // size of the mapping
+  struct snapshot_header *header; // the mapping
+  struct snapshot_record *records; // the records after the header
+  unsigned count;                 // count of records
+  unsigned *freeslots;            // stack of indexes of free records
+  unsigned nfree;                 // count of free records
+} snapshot = { .lock = PTHREAD_RWLOCK_INITIALIZER, .mutex = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+// record of a session in the shared store, written under a sequence lock
+struct shared_record
+{
+	uint32_t sequence;    // odd while the record is written
+	uint32_t state;       // SHARED_FREE, SHARED_USED or SHARED_DELETED
+	uint8_t uuid[16];
+	uint8_t token[16];
+	uint32_t flags;       // SNAPSHOT_TOKEN
+	uint32_t loa;
+	int32_t timeout;
+	uint32_t reserved;
+	int64_t expiration;
+};
+
+#define SHARED_FREE    0  // never used, ends the probe sequences
+#define SHARED_USED    1  // used by a session
+#define SHARED_DELETED 2  // was used, doesn't end the probe sequences
+
+#define SHARED_WORDS   (sizeof(struct shared_record) / sizeof(uint32_t))
+
+// the records are only accessed by words for the readers without lock
+union shared_slot
 {
-	uuid_t newuuid;
-	uuid_generate(newuuid);
-	uuid_unparse_lower(newuuid, uuid);
+	struct shared_record record;
+	uint32_t words[SHARED_WORDS];
+};
+
+// header of the shared store, followed by the records
+struct shared_header
+{
+	uint32_t magic;
+	uint32_t capacity;    // count of records (power of 2)
+};
+
+// Sessions shared with other daemons through a file mapped in memory.
+// Lookups don't lock. Writers are serialized by 'mutex' in the process
+// and by a lock of the file between processes.
+static struct {
+  pthread_mutex_t mutex;          // serializes the writers of the process
+  int enabled;                    // is sharing requested?
+  int fd;                         // the file or -1 when not sharing
+  unsigned capacity;              // count of records (power of 2)
+  union shared_slot *slots;       // the records or NULL when not sharing
+} shared = { .mutex = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+// marks the slots of deleted sessions for not breaking the probe sequences
+static struct AFB_clientCtx deleted;
+#define DELETED (&deleted)
+
+// Per thread pool of random bytes, avoids a system call for each new id
+static _Thread_local struct {
+	unsigned avail;
+	uint8_t bytes[RANDOM_POOL];
+} randpool;
+
+/* generate a random uuid (version 4) */
+static void new_uuid(uuid_t uuid)
+{
+	ssize_t rc;
+
+	if (randpool.avail < sizeof(uuid_t)) {
+		do {
+			rc = getrandom(randpool.bytes, sizeof randpool.bytes, 0);
+		} while (rc < 0 && errno == EINTR);
+		if (rc < (ssize_t)sizeof(uuid_t)) {
+			uuid_generate(uuid);
+			return;
+		}
+		randpool.avail = (unsigned)rc;
+	}
+	randpool.avail -= (unsigned)sizeof(uuid_t);
+	memcpy(uuid, &randpool.bytes[randpool.avail], sizeof(uuid_t));
+	memset(&randpool.bytes[randpool.avail], 0, sizeof(uuid_t));
+	uuid[6] = (uint8_t)((uuid[6] & 0x0f) | 0x40);
+	uuid[8] = (uint8_t)((uuid[8] & 0x3f) | 0x80);
+}
+
+// Compares 'a' and 'b' of 'size' bytes in a time not depending on their content
+static int ctxSafeEqual (const void *a, const void *b, size_t size)
+{
+	const uint8_t *pa = a, *pb = b;
+	uint8_t diff = 0;
+
+	while (size--)
+		diff |= *pa++ ^ *pb++;
+	return diff == 0;
+}
+
+static inline void ctxClientLock (struct AFB_clientCtx *client)
+{
+	while (__atomic_test_and_set(&client->lock, __ATOMIC_ACQUIRE));
+}
+
+static inline void ctxClientUnlock (struct AFB_clientCtx *client)
+{
+	__atomic_clear(&client->lock, __ATOMIC_RELEASE);
+}
+
+// Returns the first index to probe for 'key' in a map of mask 'mask'
+static inline unsigned ctxCookiesHome (const void *key, unsigned mask)
+{
+	return (unsigned)(((uint64_t)(uintptr_t)key * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+}
+
+// Returns the index of 'key' in 'cookies' of 'size' or of the free entry where to put it
+static unsigned ctxCookiesIndex (struct cookie *cookies, unsigned size, const void *key)
+{
+	unsigned idx;
+
+	idx = ctxCookiesHome(key, size - 1);
+	while (cookies[idx].key != NULL && cookies[idx].key != key)
+		idx = (idx + 1) & (size - 1);
+	return idx;
+}
+
+// Doubles the map of cookies of 'client', must be called locked
+static int ctxCookiesGrow (struct AFB_clientCtx *client)
+{
+	unsigned idx, size;
+	struct cookie *cookies;
+
+	size = client->szcookies ? 2 * (unsigned)client->szcookies : COOKIES_MIN;
+	if (size > UINT16_MAX)
+		return 0;
+	cookies = calloc(size, sizeof *cookies);
+	if (cookies == NULL)
+		return 0;
+	for (idx = 0 ; idx < client->szcookies ; idx++)
+		if (client->cookies[idx].key != NULL)
+			cookies[ctxCookiesIndex(cookies, size, client->cookies[idx].key)] = client->cookies[idx];
+	free(client->cookies);
+	__atomic_add_fetch(&sessions.memory, (size - client->szcookies) * sizeof *cookies, __ATOMIC_RELAXED);
+	client->cookies = cookies;
+	client->szcookies = (uint16_t)size;
+	return 1;
+}
+
+// Gets the value of 'key' in the map of 'client'
+static void *ctxCookiesGet (struct AFB_clientCtx *client, const void *key)
+{
+	void *value;
+
+	value = NULL;
+	ctxClientLock(client);
+	if (client->szcookies != 0)
+		value = client->cookies[ctxCookiesIndex(client->cookies, client->szcookies, key)].value;
+	ctxClientUnlock(client);
+	return value;
+}
+
+// Sets the value of 'key' in the map of 'client', a NULL value removes the key
+static int ctxCookiesSet (struct AFB_clientCtx *client, const void *key, void *value, void (*free_value)(void*))
+{
+	unsigned idx, next, home, mask;
+	struct cookie prev, *cookies;
+
+	idx = 0;
+	prev.value = NULL;
+	ctxClientLock(client);
+	if (client->szcookies != 0) {
+		idx = ctxCookiesIndex(client->cookies, client->szcookies, key);
+		prev = client->cookies[idx];
+	}
+	if (value != NULL) {
+		if (prev.value == NULL) {
+			// new key: keeps the load of the map under 3/4
+			if (4 * (client->ncookies + 1) > 3 * client->szcookies && !ctxCookiesGrow(client)) {
+				ctxClientUnlock(client);
+				errno = ENOMEM;
+				return -1;
+			}
+			idx = ctxCookiesIndex(client->cookies, client->szcookies, key);
+			client->ncookies++;
+		}
+		client->cookies[idx] = (struct cookie){ .key = key, .value = value, .free_value = free_value };
+	} else if (prev.value != NULL) {
+		// removal: shifts back the entries following in the probe sequence
+		cookies = client->cookies;
+		mask = client->szcookies - 1u;
+		next = idx;
+		for (;;) {
+			cookies[idx] = (struct cookie){ .key = NULL };
+			do {
+				next = (next + 1) & mask;
+				if (cookies[next].key == NULL)
+					goto removed;
+				home = ctxCookiesHome(cookies[next].key, mask);
+			} while (idx <= next ? (idx < home && home <= next) : (idx < home || home <= next));
+			cookies[idx] = cookies[next];
+			idx = next;
+		}
+removed:
+		client->ncookies--;
+	}
+	ctxClientUnlock(client);
+
+	// releases the replaced value
+	if (prev.value != NULL && prev.value != value && prev.free_value != NULL)
+		prev.free_value(prev.value);
+	return 0;
 }
 
 // Free context [XXXX Should be protected again memory abort XXXX]
 static void ctxUuidFreeCB (struct AFB_clientCtx *client)
 {
-	int idx;
-	struct cookie *cookie;
+	unsigned idx, size;
+	struct cookie *cookies;
 
-	// If application add a handle let's free it now
-	assert (client->values != NULL);
+	// detach the map of values and cookies
+	ctxClientLock(client);
+	cookies = client->cookies;
+	size = client->szcookies;
+	client->cookies = NULL;
+	client->ncookies = client->szcookies = 0;
+	ctxClientUnlock(client);
 
 	// Free client handle with a standard Free function, with app callback or ignore it
-	for (idx=0; idx < sessions.apicount; idx ++)
-		ctxClientValueSet(client, idx, NULL, NULL);
-
-	// free cookies
-	cookie = client->cookies;
-	while (cookie != NULL) {
-		client->cookies = cookie->next;
-		if (cookie->value != NULL && cookie->free_value != NULL)
-			cookie->free_value(cookie->value);
-		free(cookie);
-		cookie = client->cookies;
-	}
+	for (idx = 0 ; idx < size ; idx++)
+		if (cookies[idx].key != NULL && cookies[idx].free_value != NULL)
+			cookies[idx].free_value(cookies[idx].value);
+	free(cookies);
+	__atomic_sub_fetch(&sessions.memory, size * sizeof *cookies, __ATOMIC_RELAXED);
 }
 
+static void ctxSnapshotInit (const char *dirname);
+static int ctxSharedInit (const char *dirname);
+
 // Create a new store in RAM, not that is too small it will be automatically extended
-void ctxStoreInit (int max_session_count, int timeout, const char *initok, int context_count)
+void ctxStoreInit (int max_session_count, int timeout, const char *initok, int context_count, const char *sessiondir)
 {
-	// let's create as store as hashtable does not have any
-	sessions.store = calloc (1 + (unsigned)max_session_count, sizeof(struct AFB_clientCtx));
+	int idx;
+	uuid_t id;
+	struct shard *shard;
+
+	// let's create the hashtables, they grow as needed
+	for (idx = 0 ; idx < SHARD_COUNT ; idx++) {
+		shard = &sessions.shards[idx];
+		pthread_rwlock_init(&shard->lock, NULL);
+		shard->store = calloc (STORE_MIN_SIZE, sizeof *shard->store);
+		if (shard->store == NULL) {
+			ERROR("out of memory for the sessions");
+			exit(1);
+		}
+		shard->size = STORE_MIN_SIZE;
+	}
+	sessions.timerfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (sessions.timerfd < 0) {
+		ERROR("can't create the timer of sessions: %m");
+		exit(1);
+	}
 	sessions.max = max_session_count;
 	sessions.timeout = timeout;
 	sessions.apicount = context_count;
-	if (initok == NULL)
+	sessions.valuekeys = malloc(1 + (size_t)context_count);
+	if (sessions.valuekeys == NULL) {
+		ERROR("out of memory for the sessions");
+		exit(1);
+	}
+	if (initok == NULL) {
 		/* without token, a secret is made to forbid creation of sessions */
-		new_uuid(sessions.initok);
-	else if (strlen(initok) < sizeof(sessions.store[0]->token))
+		new_uuid(id);
+		uuid_unparse_lower(id, sessions.initok);
+	} else if (strlen(initok) < sizeof sessions.initok)
 		strcpy(sessions.initok, initok);
 	else {
 		ERROR("initial token '%s' too long (max length 36)", initok);
 		exit(1);
 	}
+	if (!ctxSharedInit(sessiondir))
+		ctxSnapshotInit(sessiondir);
 }
 
-static struct AFB_clientCtx *ctxStoreSearch (const char* uuid)
+// Computes the hash code of 'uuid' (FNV-1a)
+static unsigned ctxStoreHash (const uuid_t uuid)
 {
-    int  idx;
+    unsigned idx, hash = 2166136261u;
+
+    for (idx = 0 ; idx < sizeof(uuid_t) ; idx++)
+	hash = (hash ^ uuid[idx]) * 16777619u;
+    return hash;
+}
+
+// Returns the shard of the hash code 'hash'
+static inline struct shard *ctxStoreShard (unsigned hash)
+{
+    return &sessions.shards[hash >> (32 - SHARD_BITS)];
+}
+
+// Check if context timeout or not
+static int ctxStoreTooOld (struct AFB_clientCtx *ctx, time_t now)
+{
+    assert (ctx != NULL);
+    return __atomic_load_n(&ctx->expiration, __ATOMIC_RELAXED) < now;
+}
+
+// Places 'ctx' at 'idx' of the heap
+static void ctxHeapSet (unsigned idx, struct AFB_clientCtx *ctx)
+{
+    sessions.heap[idx] = ctx;
+    ctx->heapidx = idx + 1;
+}
+
+// Moves 'ctx' up or down in the heap until the heap is valid
+static void ctxHeapSift (struct AFB_clientCtx *ctx)
+{
+    unsigned idx, up, down;
+    struct AFB_clientCtx *other;
+
+    idx = ctx->heapidx - 1;
+    while (idx > 0 && ctx->expiration < (other = sessions.heap[up = (idx - 1) / 2])->expiration) {
+	ctxHeapSet (idx, other);
+	idx = up;
+    }
+    for (;;) {
+	down = 2 * idx + 1;
+	if (down >= sessions.heapcount)
+		break;
+	if (down + 1 < sessions.heapcount && sessions.heap[down + 1]->expiration < sessions.heap[down]->expiration)
+		down++;
+	other = sessions.heap[down];
+	if (ctx->expiration <= other->expiration)
+		break;
+	ctxHeapSet (idx, other);
+	idx = down;
+    }
+    ctxHeapSet (idx, ctx);
+}
+
+// Arms the timer for the expiration of the top of the heap
+static void ctxHeapArm ()
+{
+    struct itimerspec its = { .it_interval = { 0, 0 }, .it_value = { 0, 0 } };
+
+    if (sessions.heapcount != 0)
+	its.it_value.tv_sec = sessions.heap[0]->expiration + 1;
+    if (its.it_value.tv_sec != sessions.armed) {
+	sessions.armed = its.it_value.tv_sec;
+	timerfd_settime(sessions.timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+    }
+}
+
+// Adds 'ctx' to the heap, returns 0 on memory depletion
+static int ctxHeapAdd (struct AFB_clientCtx *ctx)
+{
+    unsigned size;
+    struct AFB_clientCtx **heap;
+
+    if (sessions.heapcount == sessions.heapsize) {
+	size = sessions.heapsize ? 2 * sessions.heapsize : HEAP_MIN_SIZE;
+	heap = realloc (sessions.heap, size * sizeof *heap);
+	if (heap == NULL)
+		return 0;
+	sessions.heap = heap;
+	sessions.heapsize = size;
+    }
+    ctx->heapidx = ++sessions.heapcount;
+    ctxHeapSift (ctx);
+    ctxHeapArm ();
+    return 1;
+}
+
+// Removes 'ctx' from the heap if it is in
+static void ctxHeapDel (struct AFB_clientCtx *ctx)
+{
+    unsigned idx;
+    struct AFB_clientCtx *last;
+
+    idx = ctx->heapidx;
+    if (idx != 0) {
+	ctx->heapidx = 0;
+	last = sessions.heap[--sessions.heapcount];
+	if (last != ctx) {
+		last->heapidx = idx;
+		ctxHeapSift (last);
+	}
+	ctxHeapArm ();
+    }
+}
+
+static void ctxClientExpire (struct AFB_clientCtx *clientCtx, time_t now);
+
+// Closes the expired sessions, called by the event loop on timer expiration
+static int ctxHeapExpire (sd_event_source *src, int fd, uint32_t revents, void *closure)
+{
+    uint64_t count;
+    time_t now;
+    struct AFB_clientCtx *ctx;
+
+    read(fd, &count, sizeof count);
+    now = NOW;
+
+    pthread_mutex_lock(&sessions.mutex);
+    sessions.armed = 0;
+    while (sessions.heapcount != 0 && ctxStoreTooOld(ctx = sessions.heap[0], now)) {
+	// closing calls the release of values: not under the lock
+	ctxHeapDel (ctx);
+	ctxClientAddRef(ctx);
+	pthread_mutex_unlock(&sessions.mutex);
+	ctxClientExpire (ctx, now);
+	ctxClientUnref (ctx);
+	pthread_mutex_lock(&sessions.mutex);
+    }
+    ctxHeapArm ();
+    pthread_mutex_unlock(&sessions.mutex);
+    return 0;
+}
+
+// Expiration of sessions are driven by the timer of 'loop'
+int ctxStoreSetEventLoop (struct sd_event *loop)
+{
+    int rc;
+
+    rc = sd_event_add_io(loop, &sessions.timersrc, sessions.timerfd, EPOLLIN, ctxHeapExpire, NULL);
+    if (rc < 0) {
+	errno = -rc;
+	ERROR("can't watch the timer of sessions: %m");
+	return -1;
+    }
+    return 0;
+}
+
+// Search the session of 'uuid' and returns it with a new reference
+static struct AFB_clientCtx *ctxStoreSearch (const uuid_t uuid)
+{
+    unsigned hash, idx, mask;
     struct AFB_clientCtx *client;
+    struct shard *shard;
 
     assert (uuid != NULL);
 
-    pthread_mutex_lock(&sessions.mutex);
+    hash = ctxStoreHash(uuid);
+    shard = ctxStoreShard(hash);
 
-    for (idx=0; idx < sessions.max; idx++) {
-	client = sessions.store[idx];
-        if (client && (0 == strcmp (uuid, client->uuid)))
+    pthread_rwlock_rdlock(&shard->lock);
+
+    mask = shard->size - 1;
+    for (idx = hash & mask ; (client = shard->store[idx]) != NULL ; idx = (idx + 1) & mask) {
+        if (client != DELETED && client->hash == hash && 0 == uuid_compare (uuid, client->uuid)) {
+		ctxClientAddRef(client);
 		goto found;
+	}
     }
-    client = NULL;
 
 found:
-    pthread_mutex_unlock(&sessions.mutex);
+    pthread_rwlock_unlock(&shard->lock);
+
+    // expired but not yet closed by the timer
+    if (client != NULL && ctxStoreTooOld(client, NOW)) {
+	ctxClientExpire (client, NOW);
+	ctxClientUnref (client);
+	client = NULL;
+    }
     return client;
 }
 
+// Resizes the 'shard' to hold its sessions plus one, must be called locked
+static int ctxStoreResize (struct shard *shard)
+{
+    unsigned size, idx, old;
+    struct AFB_clientCtx **store, *client;
+
+    // doubles the size when half full, otherwise just purges DELETED slots
+    size = shard->size;
+    while (2 * (shard->count + 1) > size)
+	size *= 2;
+    store = calloc (size, sizeof *store);
+    if (store == NULL)
+	return 0;
+
+    for (old = 0 ; old < shard->size ; old++) {
+	client = shard->store[old];
+	if (client != NULL && client != DELETED) {
+		for (idx = client->hash & (size - 1) ; store[idx] != NULL ; idx = (idx + 1) & (size - 1));
+		store[idx] = client;
+	}
+    }
+    free(shard->store);
+    shard->store = store;
+    shard->size = size;
+    shard->used = shard->count;
+    return 1;
+}
+
+// Removes 'client' from the store, returns 1 if removed or 0 if not found
 static int ctxStoreDel (struct AFB_clientCtx *client)
 {
-    int idx;
+    unsigned idx, mask;
     int status;
+    struct shard *shard;
 
     assert (client != NULL);
 
-    pthread_mutex_lock(&sessions.mutex);
+    shard = ctxStoreShard(client->hash);
+    pthread_rwlock_wrlock(&shard->lock);
 
-    for (idx=0; idx < sessions.max; idx++) {
-        if (sessions.store[idx] == client) {
-	        sessions.store[idx] = NULL;
-        	sessions.count--;
+    mask = shard->size - 1;
+    for (idx = client->hash & mask ; shard->store[idx] != NULL ; idx = (idx + 1) & mask) {
+        if (shard->store[idx] == client) {
+	        shard->store[idx] = DELETED;
+        	shard->count--;
+	        __atomic_sub_fetch(&sessions.count, 1, __ATOMIC_RELAXED);
 	        status = 1;
 		goto deleted;
 	}
     }
     status = 0;
 deleted:
-    pthread_mutex_unlock(&sessions.mutex);
+    pthread_rwlock_unlock(&shard->lock);
     return status;
 }
 
+// Returns the memory used by a session without its map of cookies
+static inline size_t ctxStoreCost ()
+{
+    return sizeof(struct AFB_clientCtx);
+}
+
+// Evicts from 'shard' the least recently accessed idle session of a sample
+static struct AFB_clientCtx *ctxStoreEvictShard (struct shard *shard)
+{
+    unsigned idx, mask, n, found, pos;
+    struct AFB_clientCtx *ctx, *victim;
+
+    // the write lock prevents lookups from taking a reference
+    pthread_rwlock_wrlock(&shard->lock);
+    victim = NULL;
+    pos = 0;
+    found = 0;
+    mask = shard->size - 1;
+    idx = shard->cursor & mask;
+    for (n = 0 ; n < shard->size && found < EVICT_SAMPLE ; n++) {
+	ctx = shard->store[idx];
+	// idle sessions are only referenced by the store
+	if (ctx != NULL && ctx != DELETED && __atomic_load_n(&ctx->refcount, __ATOMIC_RELAXED) == 1) {
+		found++;
+		if (victim == NULL || __atomic_load_n(&ctx->access, __ATOMIC_RELAXED) < __atomic_load_n(&victim->access, __ATOMIC_RELAXED)) {
+			victim = ctx;
+			pos = idx;
+		}
+	}
+	idx = (idx + 1) & mask;
+    }
+    shard->cursor = idx;
+    if (victim != NULL) {
+	shard->store[pos] = DELETED;
+	shard->count--;
+	__atomic_sub_fetch(&sessions.count, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return victim;
+}
+
+static void ctxClientRelease (struct AFB_clientCtx *clientCtx);
+
+// Evicts an idle session, returns 0 if there is none
+static int ctxStoreEvict ()
+{
+    unsigned n, first;
+    struct AFB_clientCtx *victim;
+
+    first = __atomic_fetch_add(&sessions.evictshard, 1, __ATOMIC_RELAXED);
+    for (n = 0 ; n < SHARD_COUNT ; n++) {
+	victim = ctxStoreEvictShard (&sessions.shards[(first + n) % SHARD_COUNT]);
+	if (victim != NULL) {
+		ctxClientRelease (victim);
+		__atomic_add_fetch(&sessions.evictions, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+    }
+    return 0;
+}
+
+// Is the memory budget exceeded when adding 'size' bytes?
+static inline int ctxStoreOverBudget (size_t size)
+{
+    return sessions.budget != 0 && __atomic_load_n(&sessions.memory, __ATOMIC_RELAXED) + size > sessions.budget;
+}
+
 static int ctxStoreAdd (struct AFB_clientCtx *client)
 {
-    int idx;
+    unsigned idx, mask, pos;
     int status;
+    struct AFB_clientCtx *slot;
+    struct shard *shard;
 
     assert (client != NULL);
 
-    pthread_mutex_lock(&sessions.mutex);
+    // reserves a place in the count and in the memory of sessions, evicting if needed
+    errno = ENOMEM;
+    while (__atomic_add_fetch(&sessions.count, 1, __ATOMIC_RELAXED) > sessions.max
+	|| ctxStoreOverBudget (ctxStoreCost())) {
+	__atomic_sub_fetch(&sessions.count, 1, __ATOMIC_RELAXED);
+	if (!ctxStoreEvict()) {
+		__atomic_add_fetch(&sessions.rejections, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+    }
+
+    shard = ctxStoreShard(client->hash);
+    pthread_rwlock_wrlock(&shard->lock);
 
-    for (idx=0; idx < sessions.max; idx++) {
-        if (NULL == sessions.store[idx]) {
-        	sessions.store[idx] = client;
-	        sessions.count++;
-        	status = 1;
+    // keeps the load of the table under 3/4
+    status = 0;
+    if (4 * (shard->used + 1) > 3 * shard->size && !ctxStoreResize(shard))
+	goto added;
+
+    // checks that the uuid isn't used and takes the first free slot
+    mask = shard->size - 1;
+    pos = shard->size;
+    for (idx = client->hash & mask ; (slot = shard->store[idx]) != NULL ; idx = (idx + 1) & mask) {
+	if (slot == DELETED) {
+		if (pos == shard->size)
+			pos = idx;
+	} else if (slot->hash == client->hash && 0 == uuid_compare (slot->uuid, client->uuid)) {
+		errno = EEXIST;
 		goto added;
 	}
     }
-    status = 0;
+    if (client->timeout != 0) {
+	pthread_mutex_lock(&sessions.mutex);
+	status = ctxHeapAdd (client);
+	pthread_mutex_unlock(&sessions.mutex);
+	if (!status)
+		goto added;
+    }
+    if (pos == shard->size) {
+	pos = idx;
+	shard->used++;
+    }
+    shard->store[pos] = client;
+    shard->count++;
+    status = 1;
 added:
-    pthread_mutex_unlock(&sessions.mutex);
+    pthread_rwlock_unlock(&shard->lock);
+    if (status)
+	__atomic_add_fetch(&sessions.memory, ctxStoreCost(), __ATOMIC_RELAXED);
+    else
+	__atomic_sub_fetch(&sessions.count, 1, __ATOMIC_RELAXED);
     return status;
 }
 
-// Check if context timeout or not
-static int ctxStoreTooOld (struct AFB_clientCtx *ctx, time_t now)
+// Check if context is active or not
+static int ctxIsActive (struct AFB_clientCtx *ctx, time_t now)
 {
     assert (ctx != NULL);
-    return ctx->expiration < now;
+    return !__atomic_load_n(&ctx->closed, __ATOMIC_RELAXED) && !ctxStoreTooOld(ctx, now);
 }
 
-// Check if context is active or not
-static int ctxIsActive (struct AFB_clientCtx *ctx, time_t now)
+// Doubles the count of records of the snapshot, must be called with snapshot.mutex
+static int ctxSnapshotGrow ()
 {
-    assert (ctx != NULL);
-    return ctx->uuid[0] != 0 && ctx->expiration >= now;
+	unsigned count, idx, *freeslots;
+	size_t size;
+	void *map;
+
+	count = snapshot.count ? 2 * snapshot.count : SNAPSHOT_MIN;
+	freeslots = realloc(snapshot.freeslots, count * sizeof *freeslots);
+	if (freeslots == NULL)
+		return 0;
+	snapshot.freeslots = freeslots;
+
+	size = sizeof *snapshot.header + count * sizeof *snapshot.records;
+	if (ftruncate(snapshot.fd, (off_t)size) < 0)
+		return 0;
+
+	pthread_rwlock_wrlock(&snapshot.lock);
+	if (snapshot.header == NULL)
+		map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, snapshot.fd, 0);
+	else
+		map = mremap(snapshot.header, snapshot.size, size, MREMAP_MAYMOVE);
+	if (map != MAP_FAILED) {
+		snapshot.header = map;
+		snapshot.records = (void*)(snapshot.header + 1);
+		snapshot.size = size;
+		snapshot.header->magic = SNAPSHOT_MAGIC;
+		snapshot.header->count = count;
+	}
+	pthread_rwlock_unlock(&snapshot.lock);
+	if (map == MAP_FAILED)
+		return 0;
+
+	/* the new records are free, lowest indexes on top */
+	for (idx = count ; idx-- > snapshot.count ; )
+		snapshot.freeslots[snapshot.nfree++] = idx;
+	snapshot.count = count;
+	return 1;
+}
+
+// Writes the state of 'ctx' in its record of the snapshot
+static void ctxSnapshotWrite (struct AFB_clientCtx *ctx)
+{
+	struct snapshot_record *record;
+
+	if (ctx->slot != 0) {
+		pthread_rwlock_rdlock(&snapshot.lock);
+		record = &snapshot.records[ctx->slot - 1];
+		ctxClientLock(ctx);
+		memcpy(record->token, ctx->token, sizeof record->token);
+		record->flags = ctx->hastoken ? SNAPSHOT_USED|SNAPSHOT_TOKEN : SNAPSHOT_USED;
+		ctxClientUnlock(ctx);
+		record->loa = __atomic_load_n(&ctx->loa, __ATOMIC_RELAXED);
+		record->timeout = ctx->timeout;
+		record->expiration = __atomic_load_n(&ctx->expiration, __ATOMIC_RELAXED);
+		memcpy(record->uuid, ctx->uuid, sizeof record->uuid);
+		pthread_rwlock_unlock(&snapshot.lock);
+	}
+}
+
+// Gives a record of the snapshot to the new session 'ctx'
+static void ctxSnapshotAdd (struct AFB_clientCtx *ctx)
+{
+	// sessions that never expire are internal to the daemon
+	if (snapshot.fd >= 0 && !snapshot.loading && ctx->timeout != 0) {
+		pthread_mutex_lock(&snapshot.mutex);
+		if (snapshot.nfree != 0 || ctxSnapshotGrow())
+			ctx->slot = 1 + snapshot.freeslots[--snapshot.nfree];
+		pthread_mutex_unlock(&snapshot.mutex);
+		ctxSnapshotWrite(ctx);
+	}
 }
 
-// Loop on every entry and remove old context sessions.hash
-static void ctxStoreCleanUp (time_t now)
+// Frees the record of the closed session 'ctx'
+static void ctxSnapshotDel (struct AFB_clientCtx *ctx)
 {
+	if (ctx->slot != 0) {
+		pthread_rwlock_rdlock(&snapshot.lock);
+		snapshot.records[ctx->slot - 1].flags = 0;
+		pthread_rwlock_unlock(&snapshot.lock);
+		pthread_mutex_lock(&snapshot.mutex);
+		snapshot.freeslots[snapshot.nfree++] = ctx->slot - 1;
+		pthread_mutex_unlock(&snapshot.mutex);
+		ctx->slot = 0;
+	}
+}
+
+static struct AFB_clientCtx *new_context (const uuid_t uuid, int timeout, time_t now, const struct shared_record *import);
+
+// Recreates the sessions of the snapshot still alive and frees the others
+static void ctxSnapshotLoad ()
+{
+	unsigned idx;
+	time_t now;
+	struct snapshot_record *record;
 	struct AFB_clientCtx *ctx;
-	long idx;
 
-	// Loop on Sessions Table and remove anything that is older than timeout
-	for (idx=0; idx < sessions.max; idx++) {
-		ctx = sessions.store[idx];
-		if (ctx != NULL && ctxStoreTooOld(ctx, now)) {
-			ctxClientClose (ctx);
+	now = NOW;
+	snapshot.loading = 1;
+	for (idx = snapshot.count ; idx-- > 0 ; ) {
+		record = &snapshot.records[idx];
+		ctx = NULL;
+		if ((record->flags & SNAPSHOT_USED) != 0 && record->expiration >= now)
+			ctx = new_context(record->uuid, record->timeout, now, NULL);
+		if (ctx == NULL) {
+			record->flags = 0;
+			snapshot.freeslots[snapshot.nfree++] = idx;
+		} else {
+			ctx->slot = idx + 1;
+			if ((record->flags & SNAPSHOT_TOKEN) != 0) {
+				memcpy(ctx->token, record->token, sizeof ctx->token);
+				ctx->hastoken = 1;
+			}
+			ctx->loa = record->loa;
+			pthread_mutex_lock(&sessions.mutex);
+			ctx->expiration = (time_t)record->expiration;
+			if (ctx->heapidx != 0) {
+				ctxHeapSift (ctx);
+				ctxHeapArm ();
+			}
+			pthread_mutex_unlock(&sessions.mutex);
+			ctxClientUnref(ctx);
+		}
+	}
+	snapshot.loading = 0;
+	NOTICE("%d sessions restored", sessions.count);
+}
+
+// Opens the snapshot of sessions in 'dirname' and loads it
+static void ctxSnapshotInit (const char *dirname)
+{
+	int fd;
+	char *path;
+	struct stat st;
+	struct snapshot_header *header;
+
+	if (dirname == NULL)
+		return;
+
+	/* opens the file */
+	mkdir(dirname, 0700);
+	if (asprintf(&path, "%s/%s", dirname, SNAPSHOT_NAME) < 0) {
+		ERROR("out of memory");
+		return;
+	}
+	fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		WARNING("sessions won't be saved, can't open %s: %m", path);
+		free(path);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	snapshot.fd = fd;
+
+	/* maps and checks an existing snapshot */
+	header = MAP_FAILED;
+	if ((size_t)st.st_size > sizeof *header)
+		header = mmap(NULL, (size_t)st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (header != MAP_FAILED) {
+		if (header->magic == SNAPSHOT_MAGIC && header->count != 0
+		 && (size_t)st.st_size == sizeof *header + header->count * sizeof *snapshot.records
+		 && (snapshot.freeslots = malloc(header->count * sizeof *snapshot.freeslots)) != NULL) {
+			snapshot.header = header;
+			snapshot.records = (void*)(header + 1);
+			snapshot.size = (size_t)st.st_size;
+			snapshot.count = header->count;
+			ctxSnapshotLoad();
+		} else {
+			WARNING("invalid snapshot of sessions %s dropped", path);
+			munmap(header, (size_t)st.st_size);
+			ftruncate(fd, 0);
+		}
+	}
+	free(path);
+
+	/* creates the records of a new snapshot */
+	if (snapshot.header == NULL && !ctxSnapshotGrow()) {
+		WARNING("sessions won't be saved: %m");
+		close(fd);
+		snapshot.fd = -1;
+	}
+}
+
+// Reads in 'record' the record of 'slot' as written by a single writer,
+// returns 0 if the record stays being written (busy)
+static int ctxSharedLoad (const union shared_slot *slot, struct shared_record *record)
+{
+	unsigned idx, tries;
+	uint32_t sequence;
+	union shared_slot *copy = (union shared_slot*)record;
+
+	for (tries = 0 ; tries < SHARED_TRIES ; tries++) {
+		sequence = __atomic_load_n(&slot->words[0], __ATOMIC_ACQUIRE);
+		if ((sequence & 1) == 0) {
+			for (idx = 1 ; idx < SHARED_WORDS ; idx++)
+				copy->words[idx] = __atomic_load_n(&slot->words[idx], __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->words[0], __ATOMIC_RELAXED) == sequence) {
+				copy->words[0] = sequence;
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+// Writes 'record' in 'slot', must be called with the lock of writers
+static void ctxSharedStore (union shared_slot *slot, const struct shared_record *record)
+{
+	unsigned idx;
+	uint32_t sequence;
+	const union shared_slot *copy = (const union shared_slot*)record;
+
+	// an odd sequence left by a dead writer is kept odd
+	sequence = __atomic_load_n(&slot->words[0], __ATOMIC_RELAXED) | 1;
+	__atomic_store_n(&slot->words[0], sequence, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (idx = 1 ; idx < SHARED_WORDS ; idx++)
+		__atomic_store_n(&slot->words[idx], copy->words[idx], __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->words[0], sequence + 1, __ATOMIC_RELEASE);
+}
+
+// Locks the shared store against the other writers of this process and of the others
+static void ctxSharedLock ()
+{
+	pthread_mutex_lock(&shared.mutex);
+	while (flock(shared.fd, LOCK_EX) < 0 && errno == EINTR);
+}
+
+static void ctxSharedUnlock ()
+{
+	flock(shared.fd, LOCK_UN);
+	pthread_mutex_unlock(&shared.mutex);
+}
+
+// Searches the record of 'uuid' of 'hash' alive at 'now' in the slots, returns 1 if
+// found, 0 if not found or -1 if a slot on the way stays being written (busy)
+static int ctxSharedProbe (const uuid_t uuid, unsigned hash, time_t now, struct shared_record *record)
+{
+	unsigned idx, n, mask;
+
+	mask = shared.capacity - 1;
+	for (n = 0, idx = hash & mask ; n < shared.capacity ; n++, idx = (idx + 1) & mask) {
+		if (!ctxSharedLoad(&shared.slots[idx], record))
+			return -1;
+		if (record->state == SHARED_FREE)
+			return 0;
+		if (record->state == SHARED_USED && 0 == memcmp(record->uuid, uuid, sizeof record->uuid))
+			return record->expiration >= now;
+	}
+	return 0;
+}
+
+// Searches the record of 'uuid' of 'hash' alive at 'now', returns 1 if found, 0 if
+// not found or -1 if busy: the search is made without lock unless a writer is slow,
+// in which case it is waited. Only a dead writer leaves the search busy.
+static int ctxSharedSearch (const uuid_t uuid, unsigned hash, time_t now, struct shared_record *record)
+{
+	int rc;
+
+	if (shared.slots == NULL)
+		return 0;
+
+	rc = ctxSharedProbe(uuid, hash, now, record);
+	if (rc < 0) {
+		ctxSharedLock();
+		rc = ctxSharedProbe(uuid, hash, now, record);
+		ctxSharedUnlock();
+	}
+	return rc;
+}
+
+// Records the state of 'ctx' in the shared store
+static void ctxSharedWrite (struct AFB_clientCtx *ctx)
+{
+	unsigned idx, n, mask, pos;
+	time_t now;
+	struct shared_record record, current;
+
+	// sessions that never expire are internal to the daemon
+	if (shared.slots == NULL || ctx->timeout == 0)
+		return;
+
+	memset(&record, 0, sizeof record);
+	record.state = SHARED_USED;
+	memcpy(record.uuid, ctx->uuid, sizeof record.uuid);
+	ctxClientLock(ctx);
+	memcpy(record.token, ctx->token, sizeof record.token);
+	record.flags = ctx->hastoken ? SNAPSHOT_TOKEN : 0;
+	ctxClientUnlock(ctx);
+	record.loa = __atomic_load_n(&ctx->loa, __ATOMIC_RELAXED);
+	record.timeout = ctx->timeout;
+	record.expiration = __atomic_load_n(&ctx->expiration, __ATOMIC_RELAXED);
+
+	// the record of the uuid or the first free, deleted or expired one
+	now = NOW;
+	mask = shared.capacity - 1;
+	pos = shared.capacity;
+	ctxSharedLock();
+	for (n = 0, idx = ctx->hash & mask ; n < shared.capacity ; n++, idx = (idx + 1) & mask) {
+		if (!ctxSharedLoad(&shared.slots[idx], &current) || current.state == SHARED_FREE) {
+			if (pos == shared.capacity)
+				pos = idx;
+			break;
+		}
+		if (current.state == SHARED_USED && 0 == memcmp(current.uuid, record.uuid, sizeof record.uuid)) {
+			pos = idx;
+			break;
+		}
+		if (pos == shared.capacity && (current.state == SHARED_DELETED || current.expiration < now))
+			pos = idx;
+	}
+	if (pos != shared.capacity) {
+		ctxSharedStore(&shared.slots[pos], &record);
+		__atomic_store_n(&ctx->shared, 1, __ATOMIC_RELAXED);
+	}
+	ctxSharedUnlock();
+	if (pos == shared.capacity)
+		WARNING("the shared store of sessions is full");
+}
+
+// Deletes the record of 'ctx' from the shared store, only when expired at 'now' if not 0
+static void ctxSharedDel (struct AFB_clientCtx *ctx, time_t now)
+{
+	unsigned idx, n, mask;
+	struct shared_record current;
+
+	if (!__atomic_load_n(&ctx->shared, __ATOMIC_RELAXED))
+		return;
+
+	mask = shared.capacity - 1;
+	ctxSharedLock();
+	for (n = 0, idx = ctx->hash & mask ; n < shared.capacity ; n++, idx = (idx + 1) & mask) {
+		if (!ctxSharedLoad(&shared.slots[idx], &current) || current.state == SHARED_FREE)
+			break;
+		if (current.state == SHARED_USED && 0 == memcmp(current.uuid, ctx->uuid, sizeof current.uuid)) {
+			// another daemon may have renewed it
+			if (now == 0 || current.expiration < now) {
+				current.state = SHARED_DELETED;
+				ctxSharedStore(&shared.slots[idx], &current);
+			}
+			break;
+		}
+	}
+	ctxSharedUnlock();
+	__atomic_store_n(&ctx->shared, 0, __ATOMIC_RELAXED);
+}
+
+// Sets the expiration of 'ctx' to 'expiration'
+static void ctxClientSetExpiration (struct AFB_clientCtx *ctx, time_t expiration)
+{
+	pthread_mutex_lock(&sessions.mutex);
+	__atomic_store_n(&ctx->expiration, expiration, __ATOMIC_RELAXED);
+	if (ctx->heapidx != 0) {
+		ctxHeapSift (ctx);
+		ctxHeapArm ();
+	}
+	pthread_mutex_unlock(&sessions.mutex);
+}
+
+// Updates 'ctx' with the changes made by other daemons, returns 0 if closed by them,
+// the local state being kept when the shared one can't be read
+static int ctxSharedSync (struct AFB_clientCtx *ctx, time_t now)
+{
+	int rc;
+	struct shared_record record;
+
+	if (!__atomic_load_n(&ctx->shared, __ATOMIC_RELAXED))
+		return 1;
+	rc = ctxSharedSearch(ctx->uuid, ctx->hash, now, &record);
+	if (rc <= 0)
+		return rc < 0;
+
+	ctxClientLock(ctx);
+	if ((record.flags & SNAPSHOT_TOKEN) != 0 && (!ctx->hastoken || memcmp(ctx->token, record.token, sizeof ctx->token))) {
+		memcpy(ctx->token, record.token, sizeof ctx->token);
+		ctx->hastoken = 1;
+		ctx->tokentxt[0] = 0;
+	}
+	ctxClientUnlock(ctx);
+	__atomic_store_n(&ctx->loa, record.loa, __ATOMIC_RELAXED);
+	if ((time_t)record.expiration != __atomic_load_n(&ctx->expiration, __ATOMIC_RELAXED))
+		ctxClientSetExpiration(ctx, (time_t)record.expiration);
+	return 1;
+}
+
+// Opens the store of sessions shared in 'dirname', returns 0 if not sharing
+static int ctxSharedInit (const char *dirname)
+{
+	int fd;
+	char *path;
+	unsigned capacity;
+	size_t size;
+	struct stat st;
+	struct shared_header *header;
+
+	if (!shared.enabled)
+		return 0;
+	if (dirname == NULL) {
+		WARNING("sessions can't be shared without directory of sessions");
+		return 0;
+	}
+
+	/* opens the file */
+	mkdir(dirname, 0700);
+	if (asprintf(&path, "%s/%s", dirname, SHARED_NAME) < 0) {
+		ERROR("out of memory");
+		return 0;
+	}
+	fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+	if (fd < 0) {
+		WARNING("sessions won't be shared, can't open %s: %m", path);
+		goto error;
+	}
+
+	/* the first daemon creates it, the others check it */
+	while (flock(fd, LOCK_EX) < 0 && errno == EINTR);
+	if (fstat(fd, &st) < 0) {
+		WARNING("sessions won't be shared, can't stat %s: %m", path);
+		goto error2;
+	}
+	if (st.st_size == 0) {
+		for (capacity = SHARED_MIN ; capacity < 4 * (unsigned)sessions.max ; capacity <<= 1);
+		size = sizeof *header + capacity * sizeof *shared.slots;
+		if (ftruncate(fd, (off_t)size) < 0) {
+			WARNING("sessions won't be shared, can't size %s: %m", path);
+			goto error2;
 		}
+	} else
+		size = (size_t)st.st_size;
+	header = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED) {
+		WARNING("sessions won't be shared, can't map %s: %m", path);
+		goto error2;
 	}
+	if (st.st_size == 0) {
+		header->magic = SHARED_MAGIC;
+		header->capacity = capacity;
+	} else if (header->magic != SHARED_MAGIC || header->capacity == 0
+		|| (header->capacity & (header->capacity - 1)) != 0
+		|| size != sizeof *header + header->capacity * sizeof *shared.slots) {
+		WARNING("sessions won't be shared, invalid store %s", path);
+		munmap(header, size);
+		goto error2;
+	}
+	flock(fd, LOCK_UN);
+
+	shared.fd = fd;
+	shared.capacity = header->capacity;
+	shared.slots = (void*)(header + 1);
+	NOTICE("sessions shared in %s", path);
+	free(path);
+	return 1;
+
+error2:
+	flock(fd, LOCK_UN);
+	close(fd);
+error:
+	free(path);
+	return 0;
 }
 
-static struct AFB_clientCtx *new_context (const char *uuid, int timeout, time_t now)
+// Creates a session, imported from the shared store when 'import' isn't NULL
+static struct AFB_clientCtx *new_context (const uuid_t uuid, int timeout, time_t now, const struct shared_record *import)
 {
 	struct AFB_clientCtx *clientCtx;
 
 	/* allocates a new one */
-        clientCtx = calloc(1, sizeof(struct AFB_clientCtx) + ((unsigned)sessions.apicount * sizeof(*clientCtx->values)));
+        clientCtx = calloc(1, sizeof(struct AFB_clientCtx));
 	if (clientCtx == NULL) {
 		errno = ENOMEM;
 		goto error;
 	}
-        clientCtx->values = (void*)(clientCtx + 1);
 
 	/* generate the uuid */
-	if (uuid == NULL) {
+	if (uuid == NULL)
 		new_uuid(clientCtx->uuid);
-	} else {
-		if (strlen(uuid) >= sizeof clientCtx->uuid) {
-			errno = EINVAL;
-			goto error2;
-		}
-		strcpy(clientCtx->uuid, uuid);
-	}
+	else
+		uuid_copy(clientCtx->uuid, uuid);
+	clientCtx->hash = ctxStoreHash(clientCtx->uuid);
 
-	/* init the token */
-	strcpy(clientCtx->token, sessions.initok);
+	/* the token is the initial one until a new token is made */
 	clientCtx->timeout = timeout;
 	if (timeout != 0)
 		clientCtx->expiration = now + timeout;
@@ -250,13 +1299,22 @@ static struct AFB_clientCtx *new_context (const char *uuid, int timeout, time_t
 		if (clientCtx->expiration < 0)
 			clientCtx->expiration = (time_t)(((unsigned long long)clientCtx->expiration) >> 1);
 	}
-	if (!ctxStoreAdd (clientCtx)) {
-		errno = ENOMEM;
-		goto error2;
+	clientCtx->access = now;
+	clientCtx->refcount = 2; /* one for the caller, one for the store */
+	if (import != NULL) {
+		memcpy(clientCtx->token, import->token, sizeof clientCtx->token);
+		clientCtx->hastoken = (import->flags & SNAPSHOT_TOKEN) != 0;
+		clientCtx->loa = import->loa;
+		clientCtx->expiration = (time_t)import->expiration;
+		clientCtx->shared = 1;
 	}
+	if (!ctxStoreAdd (clientCtx))
+		goto error2;
 
-	clientCtx->access = now;
-	clientCtx->refcount = 1;
+	if (import == NULL) {
+		ctxSnapshotAdd (clientCtx);
+		ctxSharedWrite (clientCtx);
+	}
 	return clientCtx;
 
 error2:
@@ -267,19 +1325,34 @@ error:
 
 struct AFB_clientCtx *ctxClientCreate (const char *uuid, int timeout)
 {
+	int rc;
 	time_t now;
-
-	/* cleaning */
-	now = NOW;
-	ctxStoreCleanUp (now);
+	uuid_t id;
+	struct shared_record record;
+	struct AFB_clientCtx *clientCtx;
 
 	/* search for an existing one not too old */
-	if (uuid != NULL && ctxStoreSearch(uuid) != NULL) {
-		errno = EEXIST;
-		return NULL;
+	now = NOW;
+	if (uuid != NULL) {
+		if (uuid_parse(uuid, id) < 0) {
+			errno = EINVAL;
+			return NULL;
+		}
+		clientCtx = ctxStoreSearch(id);
+		if (clientCtx != NULL) {
+			ctxClientUnref(clientCtx);
+			errno = EEXIST;
+			return NULL;
+		}
+		rc = ctxSharedSearch(id, ctxStoreHash(id), now, &record);
+		if (rc != 0) {
+			/* existing or unknown */
+			errno = rc > 0 ? EEXIST : EBUSY;
+			return NULL;
+		}
 	}
 
-	return new_context(uuid, timeout, now);
+	return new_context(uuid == NULL ? NULL : id, timeout, now, NULL);
 }
 
 // This function will return exiting client context or newly created client context
@@ -287,40 +1360,52 @@ struct AFB_clientCtx *ctxClientGetSession (const char *uuid, int *created)
 {
 	struct AFB_clientCtx *clientCtx;
 	time_t now;
+	uuid_t id;
+	struct shared_record record;
 
-	/* cleaning */
+	/* search for an existing one not too old, an invalid uuid gets a new session */
 	now = NOW;
-	ctxStoreCleanUp (now);
-
-	/* search for an existing one not too old */
-	if (uuid != NULL) {
-		clientCtx = ctxStoreSearch(uuid);
+	if (uuid != NULL && uuid_parse(uuid, id) == 0) {
+		clientCtx = ctxStoreSearch(id);
+		if (clientCtx != NULL && !ctxSharedSync(clientCtx, now)) {
+			/* closed by an other daemon */
+			ctxClientClose(clientCtx);
+			ctxClientUnref(clientCtx);
+			clientCtx = NULL;
+		}
+		if (clientCtx == NULL && ctxSharedSearch(id, ctxStoreHash(id), now, &record) > 0) {
+			/* opened by an other daemon */
+			clientCtx = new_context(id, record.timeout, now, &record);
+			if (clientCtx == NULL && errno == EEXIST)
+				clientCtx = ctxStoreSearch(id);
+		}
 		if (clientCtx != NULL) {
 			*created = 0;
-			clientCtx->access = now;
-			clientCtx->refcount++;
+			__atomic_store_n(&clientCtx->access, now, __ATOMIC_RELAXED);
 			return clientCtx;
 		}
-	}
+	} else
+		uuid = NULL;
 
 	*created = 1;
-	return new_context(uuid, sessions.timeout, now);
+	return new_context(uuid == NULL ? NULL : id, sessions.timeout, now, NULL);
 }
 
 struct AFB_clientCtx *ctxClientAddRef(struct AFB_clientCtx *clientCtx)
 {
 	if (clientCtx != NULL)
-		clientCtx->refcount++;
+		__atomic_add_fetch(&clientCtx->refcount, 1, __ATOMIC_RELAXED);
 	return clientCtx;
 }
 
 void ctxClientUnref(struct AFB_clientCtx *clientCtx)
 {
 	if (clientCtx != NULL) {
-		assert(clientCtx->refcount != 0);
-		--clientCtx->refcount;
-       		if (clientCtx->refcount == 0 && clientCtx->uuid[0] == 0) {
-			ctxStoreDel (clientCtx);
+		assert(__atomic_load_n(&clientCtx->refcount, __ATOMIC_RELAXED) != 0);
+		if (!__atomic_sub_fetch(&clientCtx->refcount, 1, __ATOMIC_ACQ_REL)) {
+			/* values and cookies set after closing */
+			ctxUuidFreeCB (clientCtx);
+			__atomic_sub_fetch(&sessions.memory, ctxStoreCost(), __ATOMIC_RELAXED);
 			free(clientCtx);
 		}
 	}
@@ -330,67 +1415,132 @@ void ctxClientUnref(struct AFB_clientCtx *clientCtx)
 void ctxClientClose (struct AFB_clientCtx *clientCtx)
 {
 	assert(clientCtx != NULL);
-	if (clientCtx->uuid[0] != 0) {
-		clientCtx->uuid[0] = 0;
-	        ctxUuidFreeCB (clientCtx);
-       		if (clientCtx->refcount == 0) {
-			ctxStoreDel (clientCtx);
-			free(clientCtx);
-		}
+
+	/* only the closer that removes it from the store goes further */
+	if (ctxStoreDel (clientCtx)) {
+		ctxSharedDel (clientCtx, 0);
+		ctxClientRelease (clientCtx);
 	}
 }
 
+// Closes the session expired at 'now', keeping it shared if renewed by an other daemon
+static void ctxClientExpire (struct AFB_clientCtx *clientCtx, time_t now)
+{
+	if (ctxStoreDel (clientCtx)) {
+		ctxSharedDel (clientCtx, now);
+		ctxClientRelease (clientCtx);
+	}
+}
+
+// Releases the session removed from the store
+static void ctxClientRelease (struct AFB_clientCtx *clientCtx)
+{
+	pthread_mutex_lock(&sessions.mutex);
+	ctxHeapDel (clientCtx);
+	pthread_mutex_unlock(&sessions.mutex);
+	ctxSnapshotDel (clientCtx);
+	__atomic_store_n(&clientCtx->closed, 1, __ATOMIC_RELAXED);
+        ctxUuidFreeCB (clientCtx);
+	/* drops the reference of the store */
+	ctxClientUnref(clientCtx);
+}
+
 // Sample Generic Ping Debug API
 int ctxTokenCheck (struct AFB_clientCtx *clientCtx, const char *token)
 {
+	int result;
+	size_t length;
+	uuid_t id;
+	char text[sizeof sessions.initok];
+
 	assert(clientCtx != NULL);
 	assert(token != NULL);
 
 	// compare current token with previous one
-	if (!ctxIsActive (clientCtx, NOW))
+	if (!ctxIsActive (clientCtx, NOW) || !ctxSharedSync (clientCtx, NOW))
 		return 0;
 
-	if (clientCtx->token[0] && strcmp (token, clientCtx->token) != 0)
-		return 0;
+	if (uuid_parse(token, id) < 0)
+		memset(id, 0, sizeof id);
 
-	return 1;
+	ctxClientLock(clientCtx);
+	if (clientCtx->hastoken)
+		result = ctxSafeEqual(id, clientCtx->token, sizeof id);
+	else if (!sessions.initok[0])
+		result = 1;
+	else {
+		// compares the whole zero padded texts
+		length = strnlen(token, sizeof text);
+		memset(text, 0, sizeof text);
+		memcpy(text, token, length < sizeof text ? length : 0);
+		result = ctxSafeEqual(text, sessions.initok, sizeof text);
+	}
+	ctxClientUnlock(clientCtx);
+
+	return result;
 }
 
 // generate a new token and update client context
 void ctxTokenNew (struct AFB_clientCtx *clientCtx)
 {
+	uuid_t id;
+
 	assert(clientCtx != NULL);
 
 	// Old token was valid let's regenerate a new one
-	new_uuid(clientCtx->token);
+	new_uuid(id);
+	ctxClientLock(clientCtx);
+	uuid_copy(clientCtx->token, id);
+	clientCtx->hastoken = 1;
+	clientCtx->tokentxt[0] = 0;
+	ctxClientUnlock(clientCtx);
 
 	// keep track of time for session timeout and further clean up
 	if (clientCtx->timeout != 0)
-		clientCtx->expiration = NOW + clientCtx->timeout;
+		ctxClientSetExpiration (clientCtx, NOW + clientCtx->timeout);
+	ctxSnapshotWrite (clientCtx);
+	ctxSharedWrite (clientCtx);
 }
 
 const char *ctxClientGetUuid (struct AFB_clientCtx *clientCtx)
 {
 	assert(clientCtx != NULL);
-	return clientCtx->uuid;
+	ctxClientLock(clientCtx);
+	if (!clientCtx->uuidtxt[0])
+		uuid_unparse_lower(clientCtx->uuid, clientCtx->uuidtxt);
+	ctxClientUnlock(clientCtx);
+	return clientCtx->uuidtxt;
 }
 
 const char *ctxClientGetToken (struct AFB_clientCtx *clientCtx)
 {
+	const char *result;
+
 	assert(clientCtx != NULL);
-	return clientCtx->token;
+	ctxClientLock(clientCtx);
+	if (!clientCtx->hastoken)
+		result = sessions.initok;
+	else {
+		if (!clientCtx->tokentxt[0])
+			uuid_unparse_lower(clientCtx->token, clientCtx->tokentxt);
+		result = clientCtx->tokentxt;
+	}
+	ctxClientUnlock(clientCtx);
+	return result;
 }
 
 unsigned ctxClientGetLOA (struct AFB_clientCtx *clientCtx)
 {
 	assert(clientCtx != NULL);
-	return clientCtx->loa;
+	return __atomic_load_n(&clientCtx->loa, __ATOMIC_RELAXED);
 }
 
 void ctxClientSetLOA (struct AFB_clientCtx *clientCtx, unsigned loa)
 {
 	assert(clientCtx != NULL);
-	clientCtx->loa = loa;
+	__atomic_store_n(&clientCtx->loa, loa, __ATOMIC_RELAXED);
+	ctxSnapshotWrite (clientCtx);
+	ctxSharedWrite (clientCtx);
 }
 
 void *ctxClientValueGet(struct AFB_clientCtx *clientCtx, int index)
@@ -398,63 +1548,76 @@ void *ctxClientValueGet(struct AFB_clientCtx *clientCtx, int index)
 	assert(clientCtx != NULL);
 	assert(index >= 0);
 	assert(index < sessions.apicount);
-	return clientCtx->values[index].value;
+	return ctxCookiesGet(clientCtx, &sessions.valuekeys[index]);
 }
 
 void ctxClientValueSet(struct AFB_clientCtx *clientCtx, int index, void *value, void (*free_value)(void*))
 {
-	struct client_value prev;
 	assert(clientCtx != NULL);
 	assert(index >= 0);
 	assert(index < sessions.apicount);
-	prev = clientCtx->values[index];
-	clientCtx->values[index] = (struct client_value){.value = value, .free_value = free_value};
-	if (prev.value != NULL && prev.value != value && prev.free_value != NULL)
-		prev.free_value(prev.value);
+	if (ctxCookiesSet(clientCtx, &sessions.valuekeys[index], value, free_value) < 0) {
+		ERROR("can't record the value of the session: %m");
+		if (free_value != NULL)
+			free_value(value);
+	}
 }
 
 void *ctxClientCookieGet(struct AFB_clientCtx *clientCtx, const void *key)
 {
-	struct cookie *cookie;
-
-	cookie = clientCtx->cookies;
-	while(cookie != NULL) {
-		if (cookie->key == key)
-			return cookie->value;
-		cookie = cookie->next;
-	}
-	return NULL;
+	return ctxCookiesGet(clientCtx, key);
 }
 
 int ctxClientCookieSet(struct AFB_clientCtx *clientCtx, const void *key, void *value, void (*free_value)(void*))
 {
-	struct cookie *cookie;
+	return ctxCookiesSet(clientCtx, key, value, free_value);
+}
 
-	/* search for a replacement */
-	cookie = clientCtx->cookies;
-	while(cookie != NULL) {
-		if (cookie->key == key) {
-			if (cookie->value != NULL && cookie->value != value && cookie->free_value != NULL)
-				cookie->free_value(cookie->value);
-			cookie->value = value;
-			cookie->free_value = free_value;
-			return 0;
+// Sets the cookie 'key' to 'value' if not already set and returns the value of the cookie
+void *ctxClientCookieAdd(struct AFB_clientCtx *clientCtx, const void *key, void *value, void (*free_value)(void*))
+{
+	unsigned idx;
+	void *result;
+
+	assert(clientCtx != NULL);
+	assert(value != NULL);
+
+	ctxClientLock(clientCtx);
+	result = NULL;
+	if (clientCtx->szcookies != 0)
+		result = clientCtx->cookies[ctxCookiesIndex(clientCtx->cookies, clientCtx->szcookies, key)].value;
+	if (result == NULL) {
+		if (4 * (clientCtx->ncookies + 1) > 3 * clientCtx->szcookies && !ctxCookiesGrow(clientCtx))
+			errno = ENOMEM;
+		else {
+			idx = ctxCookiesIndex(clientCtx->cookies, clientCtx->szcookies, key);
+			clientCtx->cookies[idx] = (struct cookie){ .key = key, .value = value, .free_value = free_value };
+			clientCtx->ncookies++;
+			result = value;
 		}
-		cookie = cookie->next;
 	}
+	ctxClientUnlock(clientCtx);
+	return result;
+}
 
-	/* allocates */
-	cookie = malloc(sizeof *cookie);
-	if (cookie == NULL) {
-		errno = ENOMEM;
-		return -1;
-	}
+// Shares the sessions with other daemons using the same directory of sessions
+void ctxStoreSetShared (int share)
+{
+	shared.enabled = share;
+}
 
-	cookie->key = key;
-	cookie->value = value;
-	cookie->free_value = free_value;
-	cookie->next = clientCtx->cookies;
-	clientCtx->cookies = cookie;
-	return 0;
+// Sets the memory allowed for sessions, 0 for no limit
+void ctxStoreSetBudget (size_t budget)
+{
+	sessions.budget = budget;
 }
 
+void ctxStoreGetStats (struct ctxStoreStats *stats)
+{
+	stats->count = __atomic_load_n(&sessions.count, __ATOMIC_RELAXED);
+	stats->max = sessions.max;
+	stats->memory = __atomic_load_n(&sessions.memory, __ATOMIC_RELAXED);
+	stats->budget = sessions.budget;
+	stats->evictions = __atomic_load_n(&sessions.evictions, __ATOMIC_RELAXED);
+	stats->rejections = __atomic_load_n(&sessions.rejections, __ATOMIC_RELAXED);
+}
@@ -17,10 +17,28 @@
 
 #pragma once
 
+#include <stddef.h>
+
 struct json_object;
+struct sd_event;
 struct AFB_clientCtx;
 
-extern void ctxStoreInit (int max_session_count, int timeout, const char *initok, int context_count);
+extern void ctxStoreInit (int max_session_count, int timeout, const char *initok, int context_count, const char *sessiondir);
+extern int ctxStoreSetEventLoop (struct sd_event *loop);
+
+struct ctxStoreStats
+{
+	int count;                 // current count of sessions
+	int max;                   // maximum count of sessions
+	size_t memory;             // memory used by sessions
+	size_t budget;             // memory allowed for sessions, 0 if unlimited
+	unsigned long evictions;   // count of idle sessions evicted
+	unsigned long rejections;  // count of sessions refused
+};
+
+extern void ctxStoreSetBudget (size_t budget);
+extern void ctxStoreSetShared (int share);
+extern void ctxStoreGetStats (struct ctxStoreStats *stats);
 
 extern struct AFB_clientCtx *ctxClientCreate (const char *uuid, int timeout);
 extern struct AFB_clientCtx *ctxClientGetSession (const char *uuid, int *created);
@@ -41,4 +59,5 @@ extern void ctxClientValueSet(struct AFB_clientCtx *clientCtx, int index, void *
 
 extern void *ctxClientCookieGet(struct AFB_clientCtx *clientCtx, const void *key);
 extern int ctxClientCookieSet(struct AFB_clientCtx *clientCtx, const void *key, void *value, void (*free_value)(void*));
+extern void *ctxClientCookieAdd(struct AFB_clientCtx *clientCtx, const void *key, void *value, void (*free_value)(void*));
 
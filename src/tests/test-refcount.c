@@ -0,0 +1,129 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/*
+ * The implementations of the requests are included to reach their
+ * structures and their reference counts.
+ */
+#include "../afb-ws-json1.c"
+#include "../afb-api-ws.c"
+#include "../afb-subcall.c"
+#include "../session.c"
+#include "../afb-hreq.h"
+
+#define WORKERS 16
+#define LOOPS   100000
+
+struct afb_req reqs[4];
+struct AFB_clientCtx *session;
+int failures;
+
+void check(const char *what, int value, int expected)
+{
+	if (value == expected)
+		printf("ok   %s %d\n", what, value);
+	else {
+		printf("FAIL %s %d (expected %d)\n", what, value, expected);
+		failures++;
+	}
+}
+
+/* takes and drops references of every request and of the session */
+void *worker(void *arg)
+{
+	int i, j, k, n;
+
+	for (i = 0 ; i < LOOPS ; i++) {
+		n = 1 + i % 3;
+		for (k = 0 ; k < n ; k++) {
+			for (j = 0 ; j < 4 ; j++)
+				afb_req_addref(reqs[j]);
+			ctxClientAddRef(session);
+		}
+		for (k = 0 ; k < n ; k++) {
+			ctxClientUnref(session);
+			for (j = 3 ; j >= 0 ; j--)
+				afb_req_unref(reqs[j]);
+		}
+	}
+	return arg;
+}
+
+int main()
+{
+	int i, base;
+	pthread_t tids[WORKERS];
+	struct afb_hreq *hreq;
+	struct afb_ws_json1 *aws;
+	struct afb_wsreq *wsreq;
+	struct api_ws_client *client;
+	struct api_ws_server_req *wreq;
+	struct afb_subcall *subcall;
+
+	ctxStoreInit(10, 3600, "token", 4, NULL);
+	session = ctxClientCreate(NULL, 3600);
+	if (session == NULL) {
+		printf("can't create the session\n");
+		return 1;
+	}
+	base = session->refcount;
+
+	/* the requests, each one holding the session */
+	hreq = calloc(1, sizeof *hreq);
+	hreq->refcount = 1;
+	hreq->context.session = ctxClientAddRef(session);
+	reqs[0] = afb_hreq_to_req(hreq);
+
+	aws = calloc(1, sizeof *aws);
+	aws->refcount = 1;
+	wsreq = calloc(1, sizeof *wsreq);
+	wsreq->refcount = 1;
+	wsreq->aws = aws_addref(aws);
+	wsreq->context.session = ctxClientAddRef(session);
+	reqs[1] = (struct afb_req){ .itf = &afb_ws_json1_req_itf, .closure = wsreq };
+
+	client = calloc(1, sizeof *client);
+	client->refcount = 1;
+	wreq = calloc(1, sizeof *wreq);
+	wreq->refcount = 1;
+	wreq->client = client;
+	__atomic_add_fetch(&client->refcount, 1, __ATOMIC_RELAXED);
+	wreq->context.session = ctxClientAddRef(session);
+	reqs[2] = (struct afb_req){ .itf = &afb_api_ws_req_itf, .closure = wreq };
+
+	/* the subcall holds the http request */
+	subcall = calloc(1, sizeof *subcall);
+	subcall->refcount = 1;
+	subcall->req = reqs[0];
+	afb_req_addref(subcall->req);
+	reqs[3] = (struct afb_req){ .itf = &afb_subcall_req_itf, .closure = subcall };
+
+	for (i = 0 ; i < WORKERS ; i++)
+		pthread_create(&tids[i], NULL, worker, NULL);
+	for (i = 0 ; i < WORKERS ; i++)
+		pthread_join(tids[i], NULL);
+
+	check("hreq", hreq->refcount, 2);
+	check("wsreq", wsreq->refcount, 1);
+	check("api-ws", wreq->refcount, 1);
+	check("subcall", subcall->refcount, 1);
+	check("session", session->refcount, base + 3);
+
+	/* releasing the requests releases what they hold */
+	afb_req_unref(reqs[3]);
+	check("hreq after subcall", hreq->refcount, 1);
+	afb_req_unref(reqs[1]);
+	check("aws after wsreq", aws->refcount, 1);
+	afb_req_unref(reqs[2]);
+	check("client after api-ws", client->refcount, 1);
+	afb_req_unref(reqs[0]);
+	check("session after requests", session->refcount, base);
+
+	free(aws);
+	free(client);
+	ctxClientUnref(session);
+	printf("%s\n", failures ? "FAILED" : "SUCCESS");
+	return !!failures;
+}
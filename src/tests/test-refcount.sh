@@ -0,0 +1,14 @@
+#!/bin/sh
+
+# use "./test-refcount.sh tsan" to check data races with the thread sanitizer
+if [ "$1" = "tsan" ]; then
+	SAN="-g -fsanitize=thread"
+fi
+
+# the sources of afb-lib but the ones included by the test
+SRCS=$(ls ../*.c | grep -v -e main.c -e afb-client-demo.c -e afb-ws-json1.c -e afb-api-ws.c -e afb-subcall.c -e session.c)
+
+cc $SAN -std=gnu11 -DBINDING_INSTALL_DIR='"/tmp"' test-refcount.c $SRCS -o test-refcount \
+	$(pkg-config --cflags --libs json-c libsystemd libmicrohttpd uuid openssl) \
+	-lmagic -ldl -lrt -lpthread -I../../include
+./test-refcount
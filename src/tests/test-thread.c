@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <pthread.h>
 #include <time.h>
 #include <unistd.h>
@@ -16,13 +17,13 @@ struct foo {
 void addref(void *closure)
 {
 	struct foo *foo = closure;
-	foo->refcount++;
+	__atomic_add_fetch(&foo->refcount, 1, __ATOMIC_RELAXED);
 }
 
 void unref(void *closure)
 {
 	struct foo *foo = closure;
-	if(!--foo->refcount) {
+	if(!__atomic_sub_fetch(&foo->refcount, 1, __ATOMIC_ACQ_REL)) {
 		printf("%06d FREE\n", foo->value);
 		free(foo);
 	}
@@ -75,14 +76,17 @@ int main()
 	struct foo *foo;
 	struct afb_req req;
 	struct timespec ts;
+	struct afb_thread_group *groups[4];
 
 	req.itf = &itf;
-	afb_thread_init(4, 1);
+	afb_thread_init(4, 1, 20);
+	for (i = 0 ; i < 4 ; i++)
+		groups[i] = afb_thread_group_create();
 	for (i = 0 ; i  < 10000 ; i++) {
 		req.closure = foo = malloc(sizeof *foo);
 		foo->value = i;
 		foo->refcount = 1;
-		afb_thread_call(req, process, 5, (&ts) + (i % 4));
+		afb_thread_call(req, process, 5, groups[i % 4], NULL);
 		unref(foo);
 		ts.tv_sec = 0;
 		ts.tv_nsec = 1000000;
@@ -92,6 +96,8 @@ int main()
 	ts.tv_nsec = 0;
 	nanosleep(&ts, NULL);
 	afb_thread_terminate();
+	for (i = 0 ; i < 4 ; i++)
+		afb_thread_group_unref(groups[i]);
 }
 
 
@@ -1,4 +1,9 @@
 #!/bin/sh
 
-cc test-thread.c ../afb-thread.c ../verbose.c ../afb-sig-handler.c -o test-thread -lrt -lpthread -I../../include
+# use "./test-thread.sh tsan" to check data races with the thread sanitizer
+if [ "$1" = "tsan" ]; then
+	SAN="-g -fsanitize=thread"
+fi
+
+cc $SAN test-thread.c ../afb-thread.c ../verbose.c ../afb-sig-handler.c -o test-thread -lrt -lpthread -I../../include
 ./test-thread
@@ -75,6 +75,36 @@ static ssize_t ws_writev(struct websock *ws, const struct iovec *iov, int iovcnt
 	return ws->itf->writev(ws->closure, iov, iovcnt);
 }
 
+/*
+ * Writes the 'iovcnt' buffers of 'iov' entirely: after a short write,
+ * continues from the written offset so that no frame is cut.
+ * 'iov' is modified. Returns 0 on success or -1 on error.
+ */
+static int ws_writev_all(struct websock *ws, struct iovec *iov, int iovcnt)
+{
+	ssize_t rc;
+	size_t len;
+
+	while (iovcnt > 0) {
+		rc = ws_writev(ws, iov, iovcnt);
+		if (rc < 0)
+			return -1;
+
+		/* skip the written bytes */
+		len = (size_t)rc;
+		while (iovcnt > 0 && len >= iov->iov_len) {
+			len -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (len != 0) {
+			iov->iov_base = (char*)iov->iov_base + len;
+			iov->iov_len -= len;
+		}
+	}
+	return 0;
+}
+
 static ssize_t ws_readv(struct websock *ws, const struct iovec *iov, int iovcnt)
 {
 	return ws->itf->readv(ws->closure, iov, iovcnt);
@@ -98,12 +128,38 @@ static ssize_t ws_read(struct websock *ws, void *buffer, size_t buffer_size)
 	return ws_readv(ws, &iov, 1);
 }
 
+static size_t websock_make_header(unsigned char *header, unsigned char first, size_t size)
+{
+	size_t pos;
+
+	pos = 0;
+	header[pos++] = first;
+	size = (uint64_t) size;
+	if (size < 126) {
+		header[pos++] = FRAME_SET_MASK(0) | FRAME_SET_LENGTH(size, 0);
+	} else {
+		if (size < 65536) {
+			header[pos++] = FRAME_SET_MASK(0) | 126;
+		} else {
+			header[pos++] = FRAME_SET_MASK(0) | 127;
+			header[pos++] = FRAME_SET_LENGTH(size, 7);
+			header[pos++] = FRAME_SET_LENGTH(size, 6);
+			header[pos++] = FRAME_SET_LENGTH(size, 5);
+			header[pos++] = FRAME_SET_LENGTH(size, 4);
+			header[pos++] = FRAME_SET_LENGTH(size, 3);
+			header[pos++] = FRAME_SET_LENGTH(size, 2);
+		}
+		header[pos++] = FRAME_SET_LENGTH(size, 1);
+		header[pos++] = FRAME_SET_LENGTH(size, 0);
+	}
+	return pos;
+}
+
 static int websock_send_internal_v(struct websock *ws, unsigned char first, const struct iovec *iovec, int count)
 {
 	struct iovec iov[32];
 	int i, j;
-	size_t pos, size, len;
-	ssize_t rc;
+	size_t size, len;
 	unsigned char header[32];
 
 	/* checks count */
@@ -126,33 +182,35 @@ static int websock_send_internal_v(struct websock *ws, unsigned char first, cons
 	}
 
 	/* makes the header */
-	pos = 0;
-	header[pos++] = first;
-	size = (uint64_t) size;
-	if (size < 126) {
-		header[pos++] = FRAME_SET_MASK(0) | FRAME_SET_LENGTH(size, 0);
-	} else {
-		if (size < 65536) {
-			header[pos++] = FRAME_SET_MASK(0) | 126;
-		} else {
-			header[pos++] = FRAME_SET_MASK(0) | 127;
-			header[pos++] = FRAME_SET_LENGTH(size, 7);
-			header[pos++] = FRAME_SET_LENGTH(size, 6);
-			header[pos++] = FRAME_SET_LENGTH(size, 5);
-			header[pos++] = FRAME_SET_LENGTH(size, 4);
-			header[pos++] = FRAME_SET_LENGTH(size, 3);
-			header[pos++] = FRAME_SET_LENGTH(size, 2);
-		}
-		header[pos++] = FRAME_SET_LENGTH(size, 1);
-		header[pos++] = FRAME_SET_LENGTH(size, 0);
-	}
-
-	/* allocates the vec */
 	iov[0].iov_base = header;
-	iov[0].iov_len = pos;
-	rc = ws_writev(ws, iov, i);
+	iov[0].iov_len = websock_make_header(header, first, size);
+	return ws_writev_all(ws, iov, i);
+}
 
-	return rc < 0 ? -1 : 0;
+/*
+ * Sends the 'count' messages of 'iovec', each of one frame of code 'first',
+ * using one writev for each group of WEBSOCK_MESSAGES_MAX messages.
+ */
+#define WEBSOCK_MESSAGES_MAX  32
+static int websock_send_messages(struct websock *ws, unsigned char first, const struct iovec *iovec, int count)
+{
+	struct iovec iov[2 * WEBSOCK_MESSAGES_MAX];
+	unsigned char headers[WEBSOCK_MESSAGES_MAX][10];
+	int i, n;
+
+	while (count > 0) {
+		n = count < WEBSOCK_MESSAGES_MAX ? count : WEBSOCK_MESSAGES_MAX;
+		for (i = 0 ; i < n ; i++) {
+			iov[2 * i].iov_base = headers[i];
+			iov[2 * i].iov_len = websock_make_header(headers[i], first, iovec[i].iov_len);
+			iov[2 * i + 1] = iovec[i];
+		}
+		if (ws_writev_all(ws, iov, 2 * n) < 0)
+			return -1;
+		iovec += n;
+		count -= n;
+	}
+	return 0;
 }
 
 static int websock_send_internal(struct websock *ws, unsigned char first, const void *buffer, size_t size)
@@ -247,6 +305,11 @@ int websock_text_v(struct websock *ws, int last, const struct iovec *iovec, int
 	return websock_send_v(ws, last, 0, 0, 0, OPCODE_TEXT, iovec, count);
 }
 
+int websock_text_messages(struct websock *ws, const struct iovec *iovec, int count)
+{
+	return websock_send_messages(ws, (unsigned char)(FRAME_SET_FIN(1) | FRAME_SET_OPCODE(OPCODE_TEXT)), iovec, count);
+}
+
 int websock_binary(struct websock *ws, int last, const void *data, size_t length)
 {
 	return websock_send(ws, last, 0, 0, 0, OPCODE_BINARY, data, length);
@@ -257,6 +320,11 @@ int websock_binary_v(struct websock *ws, int last, const struct iovec *iovec, in
 	return websock_send_v(ws, last, 0, 0, 0, OPCODE_BINARY, iovec, count);
 }
 
+int websock_binary_messages(struct websock *ws, const struct iovec *iovec, int count)
+{
+	return websock_send_messages(ws, (unsigned char)(FRAME_SET_FIN(1) | FRAME_SET_OPCODE(OPCODE_BINARY)), iovec, count);
+}
+
 int websock_continue(struct websock *ws, int last, const void *data, size_t length)
 {
 	return websock_send(ws, last, 0, 0, 0, OPCODE_CONTINUATION, data, length);
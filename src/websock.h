@@ -64,6 +64,8 @@ extern int websock_text(struct websock *ws, int last, const void *text, size_t l
 extern int websock_text_v(struct websock *ws, int last, const struct iovec *iovec, int count);
 extern int websock_binary(struct websock *ws, int last, const void *data, size_t length);
 extern int websock_binary_v(struct websock *ws, int last, const struct iovec *iovec, int count);
+extern int websock_text_messages(struct websock *ws, const struct iovec *iovec, int count);
+extern int websock_binary_messages(struct websock *ws, const struct iovec *iovec, int count);
 extern int websock_continue(struct websock *ws, int last, const void *data, size_t length);
 extern int websock_continue_v(struct websock *ws, int last, const struct iovec *iovec, int count);
 